@@ -0,0 +1,64 @@
+/**
+ * @file ngx_http_waf_module_aho_corasick.h
+ * @brief 大小写不敏感的 AC 自动机。
+*/
+
+#ifndef NGX_HTTP_WAF_MODULE_AHO_CORASICK_H
+#define NGX_HTTP_WAF_MODULE_AHO_CORASICK_H
+
+#include <ngx_http_waf_module_macro.h>
+#include <ngx_http_waf_module_type.h>
+#include <ngx_http_waf_module_mem_pool.h>
+
+/**
+ * @defgroup aho_corasick AC 自动机
+ * @addtogroup aho_corasick AC 自动机
+ * @{
+*/
+
+/**
+ * @brief 初始化一个 AC 自动机。
+ * @param[out] ac 要初始化的自动机。
+ * @param[in] pool_type 内存池类型。
+ * @param[in] native_pool 内存池。
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示初始化成功，反之则不是。
+*/
+ngx_int_t ac_automaton_init(ac_automaton_t* ac, mem_pool_type_e pool_type, void* native_pool);
+
+
+/**
+ * @brief 插入一个字面量。
+ * @param[in] ac 要操作的自动机。
+ * @param[in] data 字面量的首地址。
+ * @param[in] len 字面量的长度。
+ * @param[out] id 字面量的编号，相同的字面量（不区分大小写）具有相同的编号。
+ * @return 操作结果。
+ * @retval NGX_HTTP_WAF_SUCCESS 成功。
+ * @retval NGX_HTTP_WAF_FAIL 自动机已经构建完成或者字面量的数量超出了上限。
+ * @retval NGX_HTTP_WAF_MALLOC_ERROR 内存分配失败。
+*/
+ngx_int_t ac_automaton_add(ac_automaton_t* ac, u_char* data, size_t len, ngx_uint_t* id);
+
+
+/**
+ * @brief 构建失配指针，之后便不能再插入字面量。
+ * @param[in] ac 要操作的自动机。
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示成功，反之则不是。
+*/
+ngx_int_t ac_automaton_build(ac_automaton_t* ac);
+
+
+/**
+ * @brief 扫描一个字符串，将其中出现过的字面量的编号在位图中标记出来。
+ * @param[in] ac 要使用的自动机。
+ * @param[in] data 字符串的首地址。
+ * @param[in] len 字符串的长度。
+ * @param[out] bitmap 位图，至少要有 (ac->size + 7) / 8 个字节并且已经清零。
+*/
+void ac_automaton_scan(ac_automaton_t* ac, u_char* data, size_t len, u_char* bitmap);
+
+/**
+ * @}
+*/
+
+#endif
@@ -14,6 +14,7 @@
 #include <ngx_http_waf_module_type.h>
 #include <ngx_http_waf_module_util.h>
 #include <ngx_http_waf_module_ip_trie.h>
+#include <ngx_http_waf_module_regex_set.h>
 #include <ngx_http_waf_module_lru_cache.h>
 #include <libinjection.h>
 #include <libinjection_sqli.h>
@@ -24,6 +25,12 @@
 #define NGX_HTTP_WAF_MODLULE_CHECK_H
 
 
+/**
+ * @brief 使用检查缓存的检查项目的名称，下标就是检查项目在缓存中的编号。
+*/
+extern const char* ngx_http_waf_inspection_types[NGX_HTTP_WAF_INSPECTION_TYPE_NUM];
+
+
 /**
  * @brief 用来挂载到清理请求资源的函数，主要用来存储和获取 ngx_http_waf_ctx_t。
 */
@@ -150,17 +157,23 @@ void ngx_http_waf_get_ctx_and_conf(ngx_http_request_t* r, ngx_http_waf_loc_conf_
 
 
 /**
- * @brief 测试数组内的所有正则
+ * @brief 将超过 NGX_HTTP_WAF_CC_LOCAL_INTERVAL 秒没有同步的地址在本地累积的访问次数写回共享内存，并归还预留的余量。
+*/
+void ngx_http_waf_flush_cc_local(ngx_http_waf_loc_conf_t* loc_conf);
+
+
+/**
+ * @brief 测试集合内的所有正则
  * @param[in] str 被测试的字符串
- * @param[in] array 包含若干个正则的数组
- * @param[in] rule_type 触发规则时的规则类型
+ * @param[in] rule_set 包含若干个正则的集合
+ * @param[in] inspection_type 检查项目的编号，取值为 NGX_HTTP_WAF_INSPECTION_*，对应的名称就是触发规则时的规则类型。
  * @param[in] cache 检测时所使用的缓存管理器
  * @return 如果匹配到返回 NGX_HTTP_WAF_MATCHED，反之则为 NGX_HTTP_WAF_NOT_MATCHED。
 */
 ngx_int_t ngx_http_waf_regex_exec_arrray_sqli_xss(ngx_http_request_t* r, 
                                                   ngx_str_t* str, 
-                                                  ngx_array_t* array, 
-                                                  const u_char* rule_type, 
+                                                  regex_set_t* rule_set, 
+                                                  ngx_uint_t inspection_type, 
                                                   lru_cache_t* cache, 
                                                   int check_sql_injection,
                                                   int check_xss);
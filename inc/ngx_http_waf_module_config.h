@@ -15,6 +15,7 @@
 #include <ngx_http_waf_module_type.h>
 #include <ngx_http_waf_module_util.h>
 #include <ngx_http_waf_module_ip_trie.h>
+#include <ngx_http_waf_module_regex_set.h>
 #include <ngx_http_waf_module_lru_cache.h>
 #include <ngx_http_waf_module_under_attack.h>
 #include <ngx_http_waf_module_parser.tab.h>
@@ -119,6 +120,13 @@ ngx_int_t ngx_http_waf_rule_deatils_handler(ngx_http_request_t* r, ngx_http_vari
 ngx_int_t ngx_http_waf_spend_handler(ngx_http_request_t* r, ngx_http_variable_value_t* v, uintptr_t data);
 
 
+/**
+ * @brief 当读取 waf_cache_occupancy 变量时的回调函数，这个变量表示当前 worker 的检查缓存中每个检查项目的缓存项数量，
+ *        如 "WHITE-URL=12,BLACK-URL=340,..."。启用了二级缓存时末尾还有二级缓存的命中次数，如 ",SHARED-HITS=56"。
+*/
+ngx_int_t ngx_http_waf_cache_occupancy_handler(ngx_http_request_t* r, ngx_http_variable_value_t* v, uintptr_t data);
+
+
 /**
  * @brief 初始化结构体 ngx_http_waf_main_conf_t
 */
@@ -145,6 +153,13 @@ char* ngx_http_waf_merge_loc_conf(ngx_conf_t *cf, void *prev, void *conf);
 ngx_int_t ngx_http_waf_init_after_load_config(ngx_conf_t* cf);
 
 
+/**
+ * @brief 在 nginx 完成所有正则表达式的 study 之后对规则进行 JIT 编译。
+ * @note 在 master 进程中执行，编译结果由工作进程继承。
+*/
+ngx_int_t ngx_http_waf_init_module(ngx_cycle_t* cycle);
+
+
 /**
  * @brief 用于 CC 防护的共享内存的初始时的回调函数
  * @param[in] zone 正在初始化的共享内存
@@ -153,6 +168,14 @@ ngx_int_t ngx_http_waf_init_after_load_config(ngx_conf_t* cf);
 ngx_int_t ngx_http_waf_shm_zone_cc_deny_init(ngx_shm_zone_t *zone, void *data);
 
 
+/**
+ * @brief 用于二级检查缓存的共享内存的初始时的回调函数，在共享内存中为每个检查缓存建立对应的二级缓存。
+ * @param[in] zone 正在初始化的共享内存
+ * @param[in] data reload 之前的 zone->data，元素类型为 ngx_http_waf_loc_conf_t* 的数组，首次启动时为 NULL。
+*/
+ngx_int_t ngx_http_waf_shm_zone_inspection_cache_init(ngx_shm_zone_t *zone, void *data);
+
+
 /**
  * @brief 初始化结构体 ngx_http_waf_loc_conf_t
 */
@@ -171,6 +194,12 @@ ngx_int_t ngx_http_waf_init_cc_shm(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* conf
 ngx_int_t ngx_http_waf_init_lru_cache(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* conf);
 
 
+/**
+ * @brief 初始化用于二级检查缓存的共享内存。
+*/
+ngx_int_t ngx_http_waf_init_inspection_cache_shm(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* conf);
+
+
 /**
  * @brief 读取所有的规则。
 */
@@ -182,7 +211,7 @@ ngx_int_t ngx_http_waf_load_all_rule(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* co
  * @param[in] file_name 要读取的配置文件完整路径。
  * @param[out] container 存放读取结果的容器。
  * @param[in] mode 读取模式
- * @li 当 mode = 0 时会将读取到文本编译成正则表达式再存储。容器类型为 ngx_array_t。
+ * @li 当 mode = 0 时会将读取到文本编译成正则表达式再存储。容器类型为 regex_set_t。
  * @li 当 mode = 1 时会将读取到的文本转化为 ipv4_t 再存储。容器类型为 ip_trie_t。
  * @li 当 mode = 2 时会将读取到的文本转化为 ipv6_t 再存储。容器类型为 ip_trie_t。
  * @return 读取操作的结果。
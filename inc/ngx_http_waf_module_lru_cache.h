@@ -14,6 +14,53 @@
 void lru_cache_init(lru_cache_t** lru, size_t capacity, mem_pool_type_e pool_type, void* native_pool);
 
 
+/**
+ * @brief 初始化一个使用定长槽位和 CLOCK 算法的缓存，所有的槽位在初始化时一次分配。
+ *        命中时只设置访问位而不移动链表，添加和查找不再分配内存，适合放在共享内存中。
+ *        缓存项的数据区（data_size 字节）位于槽位中，lru_cache_add() 返回的 data 已经指向清零的数据区，不需要再分配。
+ * @param[in] capacity 槽位的数量
+ * @param[in] key_size 关键字最多占用的字节数
+ * @param[in] data_size 每个缓存项的数据区的字节数
+ * @return 成功返回 NGX_HTTP_WAF_SUCCESS，内存不足时返回 NGX_HTTP_WAF_MALLOC_ERROR。
+*/
+ngx_int_t lru_cache_init_clock(lru_cache_t** lru, size_t capacity, size_t key_size, size_t data_size, 
+                               mem_pool_type_e pool_type, void* native_pool);
+
+
+/**
+ * @brief 计算 byte_size 字节的内存能够容纳多少个定长槽位。
+*/
+size_t lru_cache_clock_capacity(size_t byte_size, size_t key_size, size_t data_size);
+
+
+/**
+ * @brief 设置缓存项的分类，用于统计每一类缓存项的数量。只适用于 lru_cache_init_clock() 初始化的缓存。
+ * @param[in] data lru_cache_add() 或 lru_cache_find() 返回的 data
+ * @param[in] tag 小于 NGX_HTTP_WAF_LRU_CACHE_MAX_TAGS 的分类编号，新加入的缓存项的分类为零。
+*/
+void lru_cache_set_tag(lru_cache_t* lru, void** data, ngx_uint_t tag);
+
+
+/**
+ * @brief 返回某一类缓存项的数量。只适用于 lru_cache_init_clock() 初始化的缓存。
+*/
+size_t lru_cache_tag_count(lru_cache_t* lru, ngx_uint_t tag);
+
+
+/**
+ * @brief 为容量有限的缓存启用 TinyLFU 准入过滤器。缓存已满时，只有最近被访问的次数多于将被淘汰的缓存项的关键字才能加入缓存，
+ *        这样大量只出现一次的关键字（比如随机的 URL）就不会把常用的缓存项挤出去。
+ *        访问次数由 lru_cache_find() 记录。只适用于 lru_cache_init() 初始化的缓存。
+ * @return 成功返回 NGX_HTTP_WAF_SUCCESS，内存不足时返回 NGX_HTTP_WAF_MALLOC_ERROR。
+*/
+ngx_int_t lru_cache_enable_admission(lru_cache_t* lru);
+
+
+/**
+ * @brief 加入一个缓存项。
+ * @return 状态为 NGX_HTTP_WAF_SUCCESS 时需要设置返回的 data；NGX_HTTP_WAF_KEY_EXISTS 表示已经存在；
+ *         NGX_HTTP_WAF_KEY_REJECTED 表示被准入过滤器拒绝；NGX_HTTP_WAF_MALLOC_ERROR 表示内存不足。
+*/
 lru_cache_add_result_t lru_cache_add(lru_cache_t* lru, void* key, size_t key_len);
 
 
@@ -32,6 +79,13 @@ void lru_cache_delete(lru_cache_t* lru, void* key, size_t key_len);
 void lru_cache_eliminate(lru_cache_t* lru, size_t count);
 
 
+/**
+ * @brief 依次访问所有的缓存项，不设置访问位。只适用于 lru_cache_init_clock() 初始化的缓存。
+ * @param[in] handler 依次传入关键字、关键字的字节数、数据区和 ctx
+*/
+void lru_cache_foreach(lru_cache_t* lru, void (*handler)(void* key, size_t key_len, void* data, void* ctx), void* ctx);
+
+
 void lru_cache_destory(lru_cache_t* lru);
 
 
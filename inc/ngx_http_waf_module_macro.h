@@ -44,6 +44,8 @@
 
 #define NGX_HTTP_WAF_BAD                     (6)
 
+#define NGX_HTTP_WAF_KEY_REJECTED            (7)
+
 
 /**
  * @def NGX_HTTP_WAF_RULE_MAX_LEN
@@ -71,6 +73,168 @@
 */
 #define NGX_HTTP_WAF_SHARE_MEMORY_CC_DENY_MIN_SIZE               (1024 * 1024 * 20)
 
+/**
+ * @def NGX_HTTP_WAF_CC_SHARD_NUM
+ * @brief IP 访问频率统计表的分片数量，每个分片有各自的互斥锁。
+*/
+#define NGX_HTTP_WAF_CC_SHARD_NUM                                (16)
+
+/**
+ * @def NGX_HTTP_WAF_CC_MODE_FIXED
+ * @brief CC 防护按照固定的一分钟窗口计数，超出限制之后封禁一段时间。
+*/
+#define NGX_HTTP_WAF_CC_MODE_FIXED                               (0)
+
+/**
+ * @def NGX_HTTP_WAF_CC_MODE_GCRA
+ * @brief CC 防护使用 GCRA 算法，只拦截超出速率和突发量的请求。
+*/
+#define NGX_HTTP_WAF_CC_MODE_GCRA                                (1)
+
+/**
+ * @def NGX_HTTP_WAF_CC_MODE_TOKEN_BUCKET
+ * @brief CC 防护为每个地址维护一个令牌桶，令牌耗尽之后封禁一段时间。
+*/
+#define NGX_HTTP_WAF_CC_MODE_TOKEN_BUCKET                        (2)
+
+/**
+ * @def NGX_HTTP_WAF_CC_LOCAL_CAPACITY
+ * @brief 每个 worker 最多在本地为多少个 IP 累积访问次数
+*/
+#define NGX_HTTP_WAF_CC_LOCAL_CAPACITY                           (4096)
+
+/**
+ * @def NGX_HTTP_WAF_CC_LOCAL_BATCH
+ * @brief 每个 worker 在本地最多累积多少次访问之后写入共享内存
+*/
+#define NGX_HTTP_WAF_CC_LOCAL_BATCH                              (16)
+
+/**
+ * @def NGX_HTTP_WAF_CC_LOCAL_INTERVAL
+ * @brief 本地的访问次数最多累积多少秒之后写入共享内存
+*/
+#define NGX_HTTP_WAF_CC_LOCAL_INTERVAL                           (1)
+
+/**
+ * @def NGX_HTTP_WAF_LRU_CACHE_MAX_TAGS
+ * @brief 定长槽位的缓存最多能区分多少类缓存项
+*/
+#define NGX_HTTP_WAF_LRU_CACHE_MAX_TAGS                          (16)
+
+/**
+ * @def NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH
+ * @brief LRU 缓存的准入过滤器中 Count-Min Sketch 的行数
+*/
+#define NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH                      (4)
+
+/**
+ * @def NGX_HTTP_WAF_LRU_CACHE_SKETCH_MAX_COUNT
+ * @brief 准入过滤器中每个计数器的最大值
+*/
+#define NGX_HTTP_WAF_LRU_CACHE_SKETCH_MAX_COUNT                  (15)
+
+/**
+ * @def NGX_HTTP_WAF_LRU_CACHE_SKETCH_SAMPLE_FACTOR
+ * @brief 准入过滤器每记录缓存容量的这么多倍次访问，所有计数器减半。
+*/
+#define NGX_HTTP_WAF_LRU_CACHE_SKETCH_SAMPLE_FACTOR              (10)
+
+/**
+ * @def NGX_HTTP_WAF_SHARE_MEMORY_INSPECTION_CACHE_NAME
+ * @brief 用于二级检查缓存的共享内存的名称
+*/
+#define NGX_HTTP_WAF_SHARE_MEMORY_INSPECTION_CACHE_NAME          ("__ADD-SP_NGX_WAF_INSPECTION_CACHE_SHM__")
+
+/**
+ * @def NGX_HTTP_WAF_SHARE_MEMORY_INSPECTION_CACHE_MIN_SIZE
+ * @brief 用于二级检查缓存的共享内存的最小大小（字节）
+*/
+#define NGX_HTTP_WAF_SHARE_MEMORY_INSPECTION_CACHE_MIN_SIZE      (1024 * 1024)
+
+/**
+ * @def NGX_HTTP_WAF_CACHE_FINGERPRINT_KEY_LEN
+ * @brief 计算检查缓存的关键字（输入的 SipHash 指纹）所用的密钥的长度（字节），等于 crypto_shorthash_KEYBYTES。
+*/
+#define NGX_HTTP_WAF_CACHE_FINGERPRINT_KEY_LEN                   (16)
+
+/**
+ * @def NGX_HTTP_WAF_CACHED_DETAIL_NONE
+ * @brief 缓存的检查结果没有详情
+*/
+#define NGX_HTTP_WAF_CACHED_DETAIL_NONE                          (0)
+
+/**
+ * @def NGX_HTTP_WAF_CACHED_DETAIL_REGEX
+ * @brief 缓存的检查结果的详情是规则集合中的一条正则表达式
+*/
+#define NGX_HTTP_WAF_CACHED_DETAIL_REGEX                         (1)
+
+/**
+ * @def NGX_HTTP_WAF_CACHED_DETAIL_SQLI
+ * @brief 缓存的检查结果的详情是 libinjection 的 SQL 注入指纹
+*/
+#define NGX_HTTP_WAF_CACHED_DETAIL_SQLI                          (2)
+
+/**
+ * @def NGX_HTTP_WAF_CACHED_DETAIL_XSS
+ * @brief 缓存的检查结果的详情是 libinjection 检测到的 XSS
+*/
+#define NGX_HTTP_WAF_CACHED_DETAIL_XSS                           (3)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_TYPE_NUM
+ * @brief 使用检查缓存的检查项目的数量
+*/
+#define NGX_HTTP_WAF_INSPECTION_TYPE_NUM                         (8)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_WHITE_URL
+ * @brief URL 白名单的检查项目编号，检查项目的编号与 ngx_http_waf_inspection_types 的下标一致。
+*/
+#define NGX_HTTP_WAF_INSPECTION_WHITE_URL                        (0)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_BLACK_URL
+ * @brief URL 黑名单的检查项目编号
+*/
+#define NGX_HTTP_WAF_INSPECTION_BLACK_URL                        (1)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_BLACK_ARGS
+ * @brief Query String 黑名单的检查项目编号
+*/
+#define NGX_HTTP_WAF_INSPECTION_BLACK_ARGS                       (2)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_BLACK_UA
+ * @brief User-Agent 黑名单的检查项目编号
+*/
+#define NGX_HTTP_WAF_INSPECTION_BLACK_UA                         (3)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_WHITE_REFERER
+ * @brief Referer 白名单的检查项目编号
+*/
+#define NGX_HTTP_WAF_INSPECTION_WHITE_REFERER                    (4)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_BLACK_REFERER
+ * @brief Referer 黑名单的检查项目编号
+*/
+#define NGX_HTTP_WAF_INSPECTION_BLACK_REFERER                    (5)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_BLACK_COOKIE
+ * @brief Cookie 黑名单的检查项目编号
+*/
+#define NGX_HTTP_WAF_INSPECTION_BLACK_COOKIE                     (6)
+
+/**
+ * @def NGX_HTTP_WAF_INSPECTION_BLACK_POST
+ * @brief 请求体黑名单的检查项目编号
+*/
+#define NGX_HTTP_WAF_INSPECTION_BLACK_POST                       (7)
+
 
 #define NGX_HTTP_WAF_UNDER_ATTACH_UID_LEN                        (64)
 
@@ -87,6 +251,72 @@
 */
 #define NGX_HTTP_WAF_CACHE_ITEM_MIN_NUM                          (50)
 
+/**
+ * @def NGX_HTTP_WAF_REGEX_SET_MAX_CAPTURES
+ * @brief 合并后的正则表达式最多包含的捕获组数量，同时决定了匹配时所用的 ovector 的大小。
+*/
+#define NGX_HTTP_WAF_REGEX_SET_MAX_CAPTURES                      (255)
+
+/**
+ * @def NGX_HTTP_WAF_REGEX_SET_MAX_LEN
+ * @brief 合并后的正则表达式的最大长度（字节），避免超出 PCRE 对编译后模式大小的限制。
+*/
+#define NGX_HTTP_WAF_REGEX_SET_MAX_LEN                           (1024 * 16)
+
+/**
+ * @def NGX_HTTP_WAF_REGEX_SET_MAX_LITERALS
+ * @brief 每条正则表达式最多用于预过滤的必需字面量的数量。
+*/
+#define NGX_HTTP_WAF_REGEX_SET_MAX_LITERALS                      (4)
+
+/**
+ * @def NGX_HTTP_WAF_REGEX_SET_MIN_LITERAL_LEN
+ * @brief 用于预过滤的必需字面量的最小长度（字节）。
+*/
+#define NGX_HTTP_WAF_REGEX_SET_MIN_LITERAL_LEN                   (2)
+
+/**
+ * @def NGX_HTTP_WAF_AC_MAX_LITERALS
+ * @brief 每个 AC 自动机最多包含的字面量的数量，同时决定了扫描时所用的位图的大小。
+*/
+#define NGX_HTTP_WAF_AC_MAX_LITERALS                             (1024 * 64)
+
+/**
+ * @def NGX_HTTP_WAF_REGEX_JIT_STACK_MIN
+ * @brief 每个工作进程的 JIT 栈的初始大小（字节）。
+*/
+#define NGX_HTTP_WAF_REGEX_JIT_STACK_MIN                         (1024 * 32)
+
+/**
+ * @def NGX_HTTP_WAF_REGEX_JIT_STACK_MAX
+ * @brief 每个工作进程的 JIT 栈的最大大小（字节），JIT 栈会在启动时一次性预留。
+*/
+#define NGX_HTTP_WAF_REGEX_JIT_STACK_MAX                         (1024 * 1024)
+
+/**
+ * @def NGX_HTTP_WAF_VM_STACK_SIZE
+ * @brief 虚拟机的栈的深度，加载高级规则时会检查规则所需的深度是否超出了这个值。
+*/
+#define NGX_HTTP_WAF_VM_STACK_SIZE                               (64)
+
+/**
+ * @def NGX_HTTP_WAF_VM_MEMO_SIZE
+ * @brief 每个请求最多记录多少个被多条高级规则共用的谓词的结果，超出的部分每次都会重新求值。
+*/
+#define NGX_HTTP_WAF_VM_MEMO_SIZE                                (1024)
+
+/**
+ * @def NGX_HTTP_WAF_VM_INDEX_MAX_PREFIXES
+ * @brief 高级规则的索引最多支持多少种不同长度的 URL 前缀，超出的规则不会被索引。
+*/
+#define NGX_HTTP_WAF_VM_INDEX_MAX_PREFIXES                       (16)
+
+/**
+ * @def NGX_HTTP_WAF_VM_CACHE_MAX_INPUTS
+ * @brief 高级规则最多读取多少个不同的请求字段时缓存执行结果，读取的字段越多缓存越难命中。
+*/
+#define NGX_HTTP_WAF_VM_CACHE_MAX_INPUTS                         (16)
+
 /**
  * @def NGX_HTTP_WAF_MODE_INSPECT_GET
  * @brief 对 GET 请求进行检查
@@ -262,6 +492,13 @@
                                                             | NGX_HTTP_WAF_MODE_LIB_INJECTION_XSS)
 
 
+/**
+ * @def NGX_HTTP_WAF_MODE_MULTI_REGEX
+ * @brief 将同一个规则文件中的正则表达式合并后再匹配，一次扫描即可检查多条规则。
+*/
+#define NGX_HTTP_WAF_MODE_MULTI_REGEX                        (NGX_HTTP_WAF_MODE_LIB_INJECTION_XSS << 1)
+
+
 /**
  * @def NGX_HTTP_WAF_MODE_CMN_METH
  * @brief 常见的请求方法
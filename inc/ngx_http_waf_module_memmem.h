@@ -0,0 +1,58 @@
+/**
+ * @file ngx_http_waf_module_memmem.h
+ * @brief 基于 SIMD 的子串搜索。
+*/
+
+#ifndef NGX_HTTP_WAF_MODULE_MEMMEM_H
+#define NGX_HTTP_WAF_MODULE_MEMMEM_H
+
+#include <ctype.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http_waf_module_macro.h>
+#include <ngx_http_waf_module_type.h>
+
+/**
+ * @defgroup memmem 子串搜索
+ * @addtogroup memmem 子串搜索
+ * @{
+*/
+
+/**
+ * @brief 预处理一个模式串，选出用于筛选候选位置的两个字符。
+ * @param[out] needle 预处理的结果，只引用 data 而不复制。
+ * @param[in] data 模式串的首地址。
+ * @param[in] len 模式串的长度。
+ * @param[in] caseless 是否大小写不敏感，为 NGX_HTTP_WAF_TRUE 时 data 中的字母应该是小写的。
+*/
+void memmem_needle_init(memmem_needle_t* needle, u_char* data, size_t len, ngx_int_t caseless);
+
+
+/**
+ * @brief 在字符串中搜索预处理过的模式串。
+ * @param[in] needle 预处理过的模式串。
+ * @param[in] data 被搜索的字符串的首地址，不需要以 '\0' 结尾。
+ * @param[in] len 被搜索的字符串的长度。
+ * @return 模式串第一次出现的位置，没有出现时返回 NULL。
+ * @note 首次调用时根据 CPU 支持的指令集选择 AVX2、SSE2 或者普通的实现。
+*/
+u_char* memmem_needle_exec(memmem_needle_t* needle, u_char* data, size_t len);
+
+
+/**
+ * @brief 在字符串中搜索一个没有预处理过的模式串，用于模式串只有在运行时才能确定的场合。
+ * @return 模式串第一次出现的位置，没有出现时返回 NULL。
+*/
+u_char* memmem_find(u_char* data, size_t len, u_char* needle, size_t needle_len);
+
+
+/**
+ * @brief 当前使用的实现的名称，用于输出日志和基准测试。
+*/
+const char* memmem_impl_name(void);
+
+/**
+ * @}
+*/
+
+#endif
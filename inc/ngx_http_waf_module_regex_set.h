@@ -0,0 +1,102 @@
+/**
+ * @file ngx_http_waf_module_regex_set.h
+ * @brief 正则表达式集合，可以将同一个规则文件中的多条正则表达式合并后一次扫描完成匹配。
+*/
+
+#ifndef NGX_HTTP_WAF_MODULE_REGEX_SET_H
+#define NGX_HTTP_WAF_MODULE_REGEX_SET_H
+
+#include <ctype.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_regex.h>
+#include <ngx_http_waf_module_macro.h>
+#include <ngx_http_waf_module_type.h>
+#include <ngx_http_waf_module_util.h>
+#include <ngx_http_waf_module_aho_corasick.h>
+#include <ngx_http_waf_module_memmem.h>
+
+/**
+ * @defgroup regex_set 正则表达式集合
+ * @addtogroup regex_set 正则表达式集合
+ * @{
+*/
+
+/**
+ * @brief 初始化一个正则表达式集合。
+ * @param[out] set 要初始化的集合。
+ * @param[in] pool 编译正则表达式以及存储规则所用的内存池。
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示初始化成功，反之为 NGX_HTTP_WAF_FAIL。
+*/
+ngx_int_t regex_set_init(regex_set_t* set, ngx_pool_t* pool);
+
+
+/**
+ * @brief 编译一条正则表达式并追加到集合的末尾。
+ * @param[in] set 要操作的集合。
+ * @param[in] pattern 正则表达式。
+ * @param[out] err 编译失败时存放错误信息，可以为 NULL。
+ * @return 操作结果。
+ * @retval NGX_HTTP_WAF_SUCCESS 成功。
+ * @retval NGX_HTTP_WAF_FAIL 不是合法的正则表达式。
+ * @retval NGX_HTTP_WAF_MALLOC_ERROR 内存分配失败。
+*/
+ngx_int_t regex_set_add(regex_set_t* set, ngx_str_t* pattern, ngx_str_t* err);
+
+
+/**
+ * @brief 将集合中可以合并的规则按顺序分段合并成若干个正则表达式。
+ * @param[in] set 要操作的集合。
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示成功，反之为 NGX_HTTP_WAF_MALLOC_ERROR。
+ * @note 含有反向引用、递归、\\Q 等无法合并的规则以及合并后编译失败的规则会保留逐条匹配。
+*/
+ngx_int_t regex_set_compile(regex_set_t* set);
+
+
+/**
+ * @brief 用集合中的规则匹配字符串。
+ * @param[in] set 要使用的集合。
+ * @param[in] str 要匹配的字符串。
+ * @param[in] combined 为 NGX_HTTP_WAF_TRUE 时使用合并后的正则表达式，反之逐条匹配。
+ * @param[out] rule 匹配成功时指向规则表中最靠前的一条匹配的规则。
+ * @return 匹配结果。
+ * @retval NGX_HTTP_WAF_MATCHED 匹配成功。
+ * @retval NGX_HTTP_WAF_NOT_MATCHED 匹配失败。
+ * @note 两种方式报告的规则是相同的。
+*/
+ngx_int_t regex_set_exec(regex_set_t* set, ngx_str_t* str, ngx_int_t combined, ngx_regex_elt_t** rule);
+
+
+/**
+ * @brief 对集合中的所有正则表达式进行 JIT 编译，应当在 nginx 完成正则表达式的 study 之后调用。
+ * @param[in] set 要操作的集合。
+ * @param[in] log 用于报告无法进行 JIT 编译的规则。
+ * @param[out] count 完成了 JIT 编译的规则的数量。
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示成功，NGX_HTTP_WAF_FAIL 表示所用的 PCRE 不支持 JIT。
+*/
+ngx_int_t regex_set_jit_compile(regex_set_t* set, ngx_log_t* log, ngx_uint_t* count);
+
+
+/**
+ * @brief 为当前工作进程预先分配 JIT 栈（以及 PCRE2 的匹配上下文），匹配时不再分配内存。
+ * @param[in] log 日志。
+ * @return 操作结果。
+ * @retval NGX_HTTP_WAF_SUCCESS 成功。
+ * @retval NGX_HTTP_WAF_FAIL 所用的 PCRE 不支持 JIT。
+ * @retval NGX_HTTP_WAF_MALLOC_ERROR 内存分配失败。
+*/
+ngx_int_t regex_set_jit_stack_init(ngx_log_t* log);
+
+
+/**
+ * @brief 将当前工作进程的 JIT 栈交给集合中的正则表达式，并逐个执行一次进行预热。
+ * @param[in] set 要操作的集合。
+ * @note 只对已经调用过 regex_set_jit_compile() 的集合生效。
+*/
+void regex_set_jit_warm_up(regex_set_t* set);
+
+/**
+ * @}
+*/
+
+#endif
@@ -67,12 +67,34 @@ typedef struct circular_doublly_linked_list_s {
 */
 typedef struct ip_statis_s {
     ngx_int_t       count;              /**< 访问次数 */
+    ngx_int_t       reserved;           /**< 为各个 worker 预留的、可以在本地累积而暂不写回的访问次数之和 */
     ngx_int_t       is_blocked;         /**< 是否已经被拦截 */
     time_t          record_time;        /**< 何时开始记录 */
     time_t          block_time;         /**< 何时开始拦截 */
 } ip_statis_t;
 
 
+/**
+ * @struct cc_local_statis_t
+ * @brief 每个 worker 在本地累积的访问次数，以及最近一次同步时共享内存中的统计信息。
+*/
+typedef struct cc_local_statis_s {
+    ngx_int_t       pending;            /**< 尚未写入共享内存的访问次数 */
+    ngx_int_t       granted;            /**< 最近一次同步时在共享内存中预留的余量，pending 不会超过它。 */
+    time_t          synced_time;        /**< 最近一次与共享内存同步的时间，为零时表示从未同步。 */
+    ip_statis_t     shared;             /**< 最近一次同步时共享内存中的统计信息 */
+} cc_local_statis_t;
+
+
+/**
+ * @struct cc_gcra_t
+ * @brief GCRA 模式下每个 IP 的状态
+*/
+typedef struct cc_gcra_s {
+    uint64_t        tat;                /**< 理论到达时间（微秒），早于它减去容许的突发量的请求会被拦截。 */
+} cc_gcra_t;
+
+
 /**
  * @struct check_result_t
  * @brief 规则减价结果
@@ -83,6 +105,47 @@ typedef struct check_result_s {
 } check_result_t;
 
 
+/**
+ * @struct inspection_cache_key_t
+ * @brief 检查缓存的关键字，多种检查项目共用一个缓存时用检查项目区分相同的输入。
+*/
+typedef struct inspection_cache_key_s {
+    uint64_t        fingerprint;        /**< 输入的 SipHash 指纹 */
+    uint64_t        type;               /**< 检查项目的编号 */
+    uint64_t        mode;               /**< 检查模式中影响检查结果的部分，即 libinjection 和正则表达式的匹配方式。 */
+    uint32_t        check_sql_injection; /**< 这次检查是否使用 libinjection 检测 SQL 注入 */
+    uint32_t        check_xss;          /**< 这次检查是否使用 libinjection 检测 XSS 攻击 */
+} inspection_cache_key_t;
+
+
+/**
+ * @struct cached_check_result_t
+ * @brief 缓存中的检查结果，不保存详情字符串，而是保存能够还原详情的规则编号。
+*/
+typedef struct cached_check_result_s {
+    uint8_t         is_matched;         /**< 是否被某条规则匹配到 */
+    uint8_t         detail_type;        /**< 详情的类型，取值为 NGX_HTTP_WAF_CACHED_DETAIL_* */
+    uint32_t        rule_index;         /**< 匹配到的正则表达式在规则集合中的下标 */
+    char            fingerprint[8];     /**< libinjection 的 SQL 注入指纹 */
+    uint32_t        generation;         /**< 产生该结果的规则集合的代数，与当前的规则不一致时视为未命中。 */
+} cached_check_result_t;
+
+
+/**
+ * @struct request_verdict_t
+ * @brief 整个请求的检查结果，只包括那些只取决于 URI、参数、User-Agent、Referer 和 Cookie 的检查项目。
+ * @note 规则类型和规则内容紧跟在结构体之后存放。
+*/
+typedef struct request_verdict_s {
+    ngx_int_t           is_matched;         /**< 是否命中了规则 */
+    ngx_uint_t          check_no;           /**< 命中的检查项目是第几个可以缓存的检查项目 */
+    ngx_int_t           blocked;            /**< 是否拦截了请求 */
+    ngx_int_t           http_status;        /**< 要返回的 HTTP 状态码 */
+    u_char             *rule_type;          /**< 触发的规则类型 */
+    u_char             *rule_details;       /**< 触发的规则内容 */
+} request_verdict_t;
+
+
 /**
  * @enum memory_pool_type_e
  * @brief 内存池类型
@@ -101,6 +164,7 @@ typedef enum {
 typedef enum {
     VM_CODE_NOP,                /**< 空指令，什么都不做，继续执行下一条指令。 */
     VM_CODE_PUSH_INT,           /**< 将一个整数压入栈中。 */
+    VM_CODE_PUSH_BOOL,          /**< 将一个布尔值压入栈中，由优化器在常量折叠时生成。 */
     VM_CODE_PUSH_STR,           /**< 将一个字符串压入栈中。 */
     VM_CODE_PUSH_CLIENT_IP,     /**< 将客户端 IP（struct in_addr 或 struct_in6addr）压入栈中。 */
     VM_CODE_PUSH_URL,           /**< 将 URL 压入栈中。 */
@@ -120,6 +184,11 @@ typedef enum {
     VM_CODE_OP_BELONG_TO,       /**< 依次弹出一个 IP 块和一个 IP，判断 IP 是否包含在 IP 块中，并将结果压入栈中。 */
     VM_CODE_OP_SQLI_DETN,       /**< 弹出一个字符串检测其中是否存在 SQL 注入，并将结果压入栈中。 */
     VM_CODE_OP_XSS_DETN,        /**< 弹出一个字符串检测其中是否存在 XSS 攻击，并将结果压入栈中。 */
+    VM_CODE_OP_IN,              /**< 弹出一个字符串或者 IP，判断其是否属于指令参数中的集合，并将结果压入栈中。 */
+    VM_CODE_JMP_FALSE_OR_POP,   /**< 如果栈顶的布尔值为假则向后跳过指定数量的指令，反之将其弹出，用于 and 的短路求值。 */
+    VM_CODE_JMP_TRUE_OR_POP,    /**< 如果栈顶的布尔值为真则向后跳过指定数量的指令，反之将其弹出，用于 or 的短路求值。 */
+    VM_CODE_LOAD_MEMO,          /**< 如果指定的谓词在本次请求中已经求值过，则压入其结果并向后跳过指定数量的指令。 */
+    VM_CODE_STORE_MEMO,         /**< 将栈顶的布尔值记录为指定的谓词在本次请求中的结果。 */
     VM_CODE_ACT_RETURN,         /**< 如果栈顶的布尔值为真则返回指定的 http 状态码。 */
     VM_CODE_ACT_ALLOW           /**< 如果栈顶的布尔值为真则放行本次请求。 */
 } vm_code_type_e;
@@ -134,9 +203,14 @@ typedef enum {
     VM_DATA_STR,                /**< 字符串类型 */
     VM_DATA_INT,                /**< 整数类型 */
     VM_DATA_BOOL,               /**< 布尔类型 */
+    VM_DATA_REGEX,              /**< 加载规则时编译好的正则表达式 */
+    VM_DATA_NEEDLE,             /**< 加载规则时预处理过的子串搜索的模式串 */
+    VM_DATA_SET,                /**< 加载规则时建立的 in 运算符的集合 */
     VM_DATA_IPV4,               /**< IPV4 */
+    VM_DATA_IPV4_BLOCK,         /**< 加载规则时解析好的 IPV4 地址块 */
 #if (NGX_HAVE_INET6)
-    VM_DATA_IPV6                /**< IPV6 */
+    VM_DATA_IPV6,               /**< IPV6 */
+    VM_DATA_IPV6_BLOCK          /**< 加载规则时解析好的 IPV6 地址块 */
 #endif
 } vm_data_type_e;
 
@@ -195,6 +269,52 @@ typedef struct lru_cache_item_s {
 } lru_cache_item_t;
 
 
+/**
+ * @struct lru_cache_sketch_t
+ * @brief LRU 缓存的 TinyLFU 准入过滤器，近似地记录每个关键字最近被访问的次数。
+*/
+typedef struct lru_cache_sketch_s {
+    u_char                           *counters;           /**< Count-Min Sketch，共 NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH 行，每行 width 个计数器。 */
+    u_char                           *doorkeeper;         /**< 布隆过滤器（width * 8 位），关键字第一次被访问时只记录在这里，过滤掉只出现一次的关键字。 */
+    size_t                            width;              /**< 每行计数器的数量，是 2 的幂。 */
+    size_t                            additions;          /**< 上次衰减之后记录的访问次数 */
+    size_t                            sample_size;        /**< 记录的访问次数达到该值时所有计数器减半并清空布隆过滤器 */
+} lru_cache_sketch_t;
+
+
+/**
+ * @struct lru_cache_slot_t
+ * @brief 定长槽位中的一个槽位，关键字和数据紧跟在结构体之后。
+*/
+typedef struct lru_cache_slot_s {
+    uint32_t                          hash;               /**< 关键字的哈希值 */
+    uint32_t                          next_free;          /**< 空闲槽位链表中下一个槽位的下标加一，为零表示没有下一个 */
+    uint32_t                          key_byte_length;    /**< 关键字占用的字节数 */
+    u_char                            used;               /**< 槽位是否正在使用 */
+    u_char                            referenced;         /**< CLOCK 算法的访问位 */
+    u_char                            tag;                /**< 缓存项的分类，用于统计每一类缓存项的数量。 */
+    void                             *data;               /**< 指向槽位中的数据区 */
+} lru_cache_slot_t;
+
+
+/**
+ * @struct lru_cache_clock_t
+ * @brief 使用预先分配的定长槽位和 CLOCK 算法的缓存实现。
+ *        命中时只设置访问位，添加和查找都不需要分配内存。
+*/
+typedef struct lru_cache_clock_s {
+    u_char                           *slots;              /**< 所有的槽位，共 capacity 个 */
+    uint32_t                         *index;              /**< 开放寻址（线性探测）的哈希索引，存放槽位的下标加一，零表示空位 */
+    size_t                            index_mask;         /**< 索引的长度减一，索引的长度是 2 的幂。 */
+    size_t                            slot_size;          /**< 每个槽位占用的字节数 */
+    size_t                            key_size;           /**< 关键字最多占用的字节数 */
+    size_t                            count;              /**< 正在使用的槽位数量 */
+    size_t                            hand;               /**< CLOCK 算法的指针 */
+    uint32_t                          free_head;          /**< 空闲槽位链表的表头（下标加一），为零表示没有空闲槽位 */
+    size_t                            tag_count[NGX_HTTP_WAF_LRU_CACHE_MAX_TAGS]; /**< 每一类缓存项的数量 */
+} lru_cache_clock_t;
+
+
 /**
  * @struct lru_cache_t
  * @brief LRU 缓存管理器
@@ -205,34 +325,45 @@ typedef struct lru_cache_s {
     size_t                            capacity;           /**< 最多嫩容纳多少个缓存项 */
     lru_cache_item_t                 *hash_head;          /**< uthash 的表头 */
     lru_cache_item_t                 *chain_head;         /**< utlist 的表头 */
+    struct lru_cache_s               *shared;             /**< 位于共享内存中的二级缓存，所有 worker 共用，没有时为 NULL。 */
+    lru_cache_sketch_t               *sketch;             /**< 准入过滤器，为 NULL 时不启用。 */
+    lru_cache_clock_t                *clock;              /**< 定长槽位的实现，为 NULL 时使用哈希表加双向链表的实现。 */
+    size_t                            shared_hits;        /**< 作为二级缓存时被命中的次数，在持有共享内存的互斥锁时累加。 */
 } lru_cache_t;
 
 
+/**
+ * @struct cc_shard_t
+ * @brief IP 访问频率统计表的一个分片，位于共享内存中。
+*/
+typedef struct cc_shard_s {
+    ngx_shmtx_sh_t                    lock;               /**< 互斥锁的共享部分 */
+    ngx_shmtx_t                       mutex;              /**< 保护这个分片的互斥锁 */
+    lru_cache_t                      *statistics;         /**< 这个分片中的 IP 访问频率统计表 */
+} cc_shard_t;
+
+
 /**
  * @struct token_bucket_t
  * @brief 令牌桶
+ * @note 存放在 CC 防护的共享内存的统计表中，客户端地址作为统计表的 key。
 */
 typedef struct token_bucket_s{
-    inx_addr_t      inx_addr;           /**< 作为哈希表中的 key */
     ngx_uint_t      count;              /**< 令牌剩余量 */
     ngx_int_t       is_ban;             /**< 令牌桶是否暂时被禁止 */
     time_t          last_ban_time;      /**< 最后一次开始禁止令牌桶的时间 */
-    UT_hash_handle  hh;                 /**< uthash 关键成员 */
+    uint64_t        last_put;           /**< 上次添加令牌的时间（微秒），访问令牌桶时才按照经过的时间补充令牌。 */
 } token_bucket_t;
 
 
 /**
  * @struct token_bucket_set_t
- * @brief 令牌桶集合
+ * @brief 令牌桶集合的参数
 */
 typedef struct token_bucket_set_s{
-    mem_pool_t      pool;               /**< 使用的内存池 */
-    ngx_uint_t      ban_duration;       /**< 当令牌桶为空时自动禁止该桶一段时间（分钟）*/
-    time_t          last_put;           /**< 上次集中添加令牌的时间 */
-    time_t          last_clear;         /**< 上次清空令牌桶的时间 */
-    ngx_uint_t      init_count;         /**< 令牌桶内初始的令牌数量 */
-    ngx_uint_t      bucket_count;       /**< 已经有多少个令牌桶 */
-    token_bucket_t *head;               /**< 哈希表标头 */
+    ngx_uint_t      ban_duration;       /**< 当令牌桶为空时自动禁止该桶一段时间（秒）*/
+    ngx_uint_t      init_count;         /**< 令牌桶内初始的令牌数量，也是令牌桶的容量。 */
+    uint64_t        put_interval;       /**< 每隔多少微秒向令牌桶中添加一个令牌 */
 } token_bucket_set_t;
 
 
@@ -262,6 +393,91 @@ typedef struct ip_trie_s {
 } ip_trie_t;
 
 
+/**
+ * @struct ac_node_t
+ * @brief AC 自动机的节点。
+*/
+typedef struct ac_node_s {
+    u_char                  ch;             /**< 从父节点转移到此节点时的字符 */
+    ngx_int_t               id;             /**< 以此节点结尾的字面量的编号，不是任何字面量的结尾时为 -1 */
+    struct ac_node_s       *child;          /**< 第一个子节点 */
+    struct ac_node_s       *sibling;        /**< 下一个兄弟节点 */
+    struct ac_node_s       *fail;           /**< 失配指针 */
+    struct ac_node_s       *output;         /**< 沿失配指针能到达的最近的一个字面量结尾的节点 */
+    struct ac_node_s       *next;           /**< 构建失配指针时所用的队列 */
+} ac_node_t;
+
+
+/**
+ * @struct ac_automaton_t
+ * @brief 大小写不敏感的 AC 自动机，用于一次扫描找出字符串中出现过的所有字面量。
+*/
+typedef struct ac_automaton_s {
+    ac_node_t              *root;           /**< 根节点 */
+    ac_node_t              *goto_root[256]; /**< 根节点的转移表，避免在最常见的状态上遍历子节点 */
+    ngx_uint_t              size;           /**< 字面量的数量 */
+    ngx_int_t               is_built;       /**< 是否已经构建了失配指针 */
+    mem_pool_t              pool;           /**< 使用的内存池 */
+} ac_automaton_t;
+
+
+/**
+ * @struct memmem_needle_t
+ * @brief 加载规则时预处理过的子串搜索的模式串。
+*/
+typedef struct memmem_needle_s {
+    u_char                 *data;           /**< 模式串，不需要以 '\0' 结尾。 */
+    size_t                  len;            /**< 模式串的长度 */
+    ngx_int_t               caseless;       /**< 是否大小写不敏感 */
+    size_t                  first;          /**< 用于筛选候选位置的第一个字符在模式串中的下标 */
+    size_t                  second;         /**< 用于筛选候选位置的第二个字符在模式串中的下标 */
+    u_char                  filter[2];      /**< 两个筛选字符，大小写不敏感时是小写形式。 */
+    u_char                  filter_mask[2]; /**< 与候选位置上的字符按位或之后再和筛选字符比较 */
+} memmem_needle_t;
+
+
+/**
+ * @struct regex_literals_t
+ * @brief 一条正则表达式匹配成功时字符串中必然出现的字面量。
+*/
+typedef struct regex_literals_s {
+    ngx_uint_t          count;                                          /**< 字面量的数量，为零时代表无法预过滤。 */
+    ngx_uint_t          id[NGX_HTTP_WAF_REGEX_SET_MAX_LITERALS];        /**< 字面量在 AC 自动机中的编号 */
+} regex_literals_t;
+
+
+/**
+ * @struct regex_segment_t
+ * @brief 规则表中一段连续的规则。
+ * @note 当 regex 不为 NULL 时，这段规则被合并成了一个正则表达式，每条规则对应其中的一个捕获组。
+*/
+typedef struct regex_segment_s {
+    ngx_regex_t        *regex;          /**< 合并后的正则表达式，为 NULL 时代表逐条匹配。 */
+    ngx_uint_t          start;          /**< 第一条规则在规则表中的下标。 */
+    ngx_uint_t          end;            /**< 最后一条规则在规则表中的下标加一。 */
+    ngx_uint_t         *group;          /**< 每条规则在合并后的正则表达式中对应的捕获组的编号。 */
+    ngx_int_t           captures;       /**< 合并后的正则表达式的捕获组数量。 */
+} regex_segment_t;
+
+
+/**
+ * @struct regex_set_t
+ * @brief 由一个规则文件编译而来的正则表达式集合。
+*/
+typedef struct regex_set_s {
+    ngx_pool_t         *pool;           /**< 编译正则表达式所用的内存池。 */
+    ngx_array_t        *rules;          /**< 逐条编译的规则，元素类型为 ngx_regex_elt_t。 */
+    ngx_array_t        *captures;       /**< 每条规则自身的捕获组数量，元素类型为 ngx_int_t。 */
+    ngx_array_t        *segments;       /**< 合并后的规则段，元素类型为 regex_segment_t。 */
+    ngx_array_t        *literals;       /**< 每条规则的必需字面量，元素类型为 regex_literals_t。 */
+    ngx_array_t        *needles;        /**< 规则本身只是一个字面量时用于直接搜索的模式串，元素类型为 memmem_needle_t*，不是字面量时为 NULL。 */
+    ac_automaton_t     *prefilter;      /**< 由所有必需字面量构成的 AC 自动机，为 NULL 时不进行预过滤。 */
+    u_char             *name;           /**< 规则文件的路径，用于输出日志。 */
+    uint32_t            generation;     /**< 规则的代数，由所有规则的内容计算得到，规则不变时 reload 前后保持不变，用于判断缓存的检查结果是否仍然有效。 */
+    ngx_int_t           jit;            /**< 是否已经进行了 JIT 编译。 */
+} regex_set_t;
+
+
 /**
  * @struct ngx_http_waf_ctx_t
  * @brief 每个请求的上下文
@@ -279,11 +495,37 @@ typedef struct ngx_http_waf_ctx_s {
 } ngx_http_waf_ctx_t;
 
 
+/**
+ * @struct ip_verdict_t
+ * @brief 缓存在连接上的 IP 白名单或者黑名单的检查结果
+*/
+typedef struct ip_verdict_s {
+    ip_trie_t                      *rules;                                      /**< 产生这个结果的规则，与当前的规则不同时视为未命中。 */
+    inx_addr_t                      inx_addr;                                   /**< 检查的客户端地址，realip 等模块可能会在同一个连接上修改它。 */
+    ngx_int_t                       is_matched;                                 /**< 是否命中了规则 */
+    u_char                         *detail;                                     /**< 命中的规则，指向前缀树节点中的字符串。 */
+} ip_verdict_t;
+
+
+/**
+ * @struct ngx_http_waf_conn_ctx_t
+ * @brief 每个连接的上下文，在同一个连接上的所有请求之间共享。
+*/
+typedef struct ngx_http_waf_conn_ctx_s {
+    ip_verdict_t                    white_ip;                                   /**< IP 白名单的检查结果 */
+    ip_verdict_t                    black_ip;                                   /**< IP 黑名单的检查结果 */
+} ngx_http_waf_conn_ctx_t;
+
+
 /**
  * @struct ngx_http_waf_loc_conf_t
 */
 typedef struct ngx_http_waf_main_conf_s {
     ngx_array_t                    *local_caches;                               /**< 已经启用的所有的缓存管理器数组 */
+    ngx_array_t                    *regex_sets;                                 /**< 所有的正则表达式集合，元素类型为 regex_set_t* */
+    ngx_array_t                    *cc_local_confs;                             /**< 在本地累积 CC 访问次数的配置，元素类型为 ngx_http_waf_loc_conf_t* */
+    ngx_int_t                       waf_regex_jit;                              /**< 是否对规则中的正则表达式进行 JIT 编译 */
+    u_char                          cache_fingerprint_key[NGX_HTTP_WAF_CACHE_FINGERPRINT_KEY_LEN]; /**< 计算检查缓存关键字的密钥，每次启动时随机生成。 */
 } ngx_http_waf_main_conf_t;
 
 
@@ -302,29 +544,45 @@ typedef struct ngx_http_waf_loc_conf_s {
     uint_fast64_t                   waf_mode;                                   /**< 检测模式 */
     ngx_int_t                       waf_cc_deny_limit;                          /**< CC 防御的限制频率 */
     ngx_int_t                       waf_cc_deny_duration;                       /**< CC 防御的拉黑时长（秒） */
+    ngx_int_t                       waf_cc_deny_mode;                           /**< CC 防御的模式，取值为 NGX_HTTP_WAF_CC_MODE_*。 */
+    ngx_int_t                       waf_cc_deny_period;                         /**< CC 防御的限制频率的时间单位（毫秒） */
+    ngx_int_t                       waf_cc_deny_burst;                          /**< GCRA 模式下容许的突发请求数，令牌桶模式下令牌桶的容量。 */
+    ngx_int_t                       waf_cc_deny_ipv4_prefix;                    /**< CC 防御按照多长的 IPv4 前缀统计访问频率 */
+    ngx_int_t                       waf_cc_deny_ipv6_prefix;                    /**< CC 防御按照多长的 IPv6 前缀统计访问频率 */
+    ngx_http_complex_value_t       *waf_cc_deny_key;                            /**< CC 防御在客户端地址之外额外区分的关键字，未设置时为 NULL。 */
     ngx_int_t                       waf_cc_deny_shm_zone_size;                  /**< CC 防御所使用的共享内存的大小（字节） */
     ngx_int_t                       waf_inspection_capacity;                    /**< 用于缓存检查结果的共享内存的大小（字节） */
+    ngx_int_t                       waf_inspection_max_body;                    /**< 请求体不超过多少字节时才缓存请求体的检查结果，未设置时不缓存。 */
+    ngx_int_t                       waf_inspection_verdict;                     /**< 是否缓存 GET 和 HEAD 请求的整个检查结果 */
+    ngx_int_t                       waf_inspection_cache_size;                  /**< 所有检查项目共用的检查缓存的大小（字节），未设置时每个检查项目各自使用一个缓存。 */
+    ngx_int_t                       waf_inspection_shm_zone_size;               /**< 所有 worker 共用的二级检查缓存的共享内存的大小（字节） */
     ngx_int_t                       waf_http_status;                            /**< 常规检测项目拦截后返回的状态码 */
     ngx_int_t                       waf_http_status_cc;                         /**< CC 防护出发后返回的状态码 */
     ip_trie_t                      *black_ipv4;                                 /**< IPV4 黑名单 */
 #if (NGX_HAVE_INET6)
     ip_trie_t                      *black_ipv6;                                 /**< IPV6 黑名单 */
 #endif
-    ngx_array_t                    *black_url;                                  /**< URL 黑名单 */
-    ngx_array_t                    *black_args;                                 /**< args 黑名单 */
-    ngx_array_t                    *black_ua;                                   /**< user-agent 黑名单 */
-    ngx_array_t                    *black_referer;                              /**< Referer 黑名单 */
-    ngx_array_t                    *black_cookie;                               /**< Cookie 黑名单 */
-    ngx_array_t                    *black_post;                                 /**< 请求体内容黑名单 */
+    regex_set_t                    *black_url;                                  /**< URL 黑名单 */
+    regex_set_t                    *black_args;                                 /**< args 黑名单 */
+    regex_set_t                    *black_ua;                                   /**< user-agent 黑名单 */
+    regex_set_t                    *black_referer;                              /**< Referer 黑名单 */
+    regex_set_t                    *black_cookie;                               /**< Cookie 黑名单 */
+    regex_set_t                    *black_post;                                 /**< 请求体内容黑名单 */
     ip_trie_t                      *white_ipv4;                                 /**< IPV4 白名单 */
 #if (NGX_HAVE_INET6)
     ip_trie_t                      *white_ipv6;                                 /**< IPV6 白名单 */
 #endif
-    ngx_array_t                    *white_url;                                  /**< URL 白名单 */
-    ngx_array_t                    *white_referer;                              /**< Referer 白名单 */
+    regex_set_t                    *white_url;                                  /**< URL 白名单 */
+    regex_set_t                    *white_referer;                              /**< Referer 白名单 */
     UT_array                       *advanced_rule;                              /**< 高级规则表 */
+    struct vm_index_s              *advanced_index;                             /**< 按照 URL 对高级规则建立的索引，没有可索引的规则时为 NULL。 */
+    ngx_array_t                    *advanced_inputs;                            /**< 高级规则读取的请求字段（vm_input_t），字段过多时为 NULL，此时不缓存执行结果。 */
+    uint32_t                        advanced_generation;                        /**< 高级规则的代数，即所有指令的 CRC32，作为执行结果的缓存的关键字的一部分。 */
     ngx_shm_zone_t                 *shm_zone_cc_deny;                           /**< 共享内存 */
-    lru_cache_t                    *ip_access_statistics;                       /**< IP 访问频率统计表 */
+    ngx_shm_zone_t                 *shm_zone_inspection_cache;                  /**< 二级检查缓存所使用的共享内存 */
+    lru_cache_t                    *cc_local_statistics;                        /**< 当前 worker 在本地累积的访问次数 */
+    token_bucket_set_t             *cc_token_buckets;                           /**< 令牌桶模式的参数，其他模式下为 NULL。 */
+    cc_shard_t                     *cc_shards;                                  /**< 按照客户端地址分片的 IP 访问频率统计表，共 NGX_HTTP_WAF_CC_SHARD_NUM 个分片。 */
     lru_cache_t                    *black_url_inspection_cache;                 /**< URL 黑名单检查缓存 */
     lru_cache_t                    *black_args_inspection_cache;                /**< ARGS 黑名单检查缓存 */
     lru_cache_t                    *black_ua_inspection_cache;                  /**< User-Agent 黑名单检查缓存 */
@@ -332,6 +590,9 @@ typedef struct ngx_http_waf_loc_conf_s {
     lru_cache_t                    *black_cookie_inspection_cache;              /**< Cookie 黑名单检查缓存 */
     lru_cache_t                    *white_url_inspection_cache;                 /**< URL 白名单检查缓存 */
     lru_cache_t                    *white_referer_inspection_cache;             /**< Referer 白名单检查缓存 */
+    lru_cache_t                    *black_post_inspection_cache;                /**< 请求体黑名单检查缓存 */
+    lru_cache_t                    *advanced_inspection_cache;                  /**< 高级规则的执行结果缓存 */
+    lru_cache_t                    *request_verdict_cache;                      /**< 整个请求的检查结果缓存 */
     ngx_int_t                       is_custom_priority;                         /**< 用户是否自定义了优先级 */
     ngx_http_waf_check_pt           check_proc[20];                             /**< 各种检测流程的启动函数 */
 } ngx_http_waf_loc_conf_t;
@@ -367,6 +628,29 @@ typedef struct ipv6_s {
 
 
 
+/**
+ * @struct vm_set_item_t
+ * @brief in 运算符的字符串集合中的一项
+*/
+typedef struct vm_set_item_s {
+    ngx_str_t                               key;                /**< 集合中的字符串 */
+    UT_hash_handle                          hh;                 /**< uthash 关键成员 */
+} vm_set_item_t;
+
+
+/**
+ * @struct vm_set_t
+ * @brief in 运算符的集合，加载规则时建立，之后不再修改。
+*/
+typedef struct vm_set_s {
+    vm_set_item_t                          *strings;            /**< 字符串集合，左操作数不是 client_ip 时使用。 */
+    ip_trie_t                              *ipv4;               /**< IPV4 地址块的集合，左操作数是 client_ip 时使用。 */
+#if (NGX_HAVE_INET6)
+    ip_trie_t                              *ipv6;               /**< IPV6 地址块的集合，左操作数是 client_ip 时使用。 */
+#endif
+} vm_set_t;
+
+
 /**
  * @struct vm_stack_arg_s
  * @brief 虚拟机指令参数
@@ -383,12 +667,33 @@ typedef struct vm_stack_arg_s {
         ipv6_t      ipv6_val;
 #endif
         inx_addr_t  inx_addr_val;
+        ngx_regex_t *regex_val;
+        memmem_needle_t *needle_val;
+        vm_set_t    *set_val;
     }                                       value[4];           /**< 每个参数的值 */
     struct vm_stack_arg_s                  *utstack_handle;     /**< utstack 关键成员 */
 } vm_stack_arg_t;
 
 
 
+/**
+ * @struct vm_value_t
+ * @brief 虚拟机栈中的值
+ * @note 字符串直接指向请求或者指令中的数据，不会被复制，所以也不保证以 '\0' 结尾。
+*/
+typedef struct vm_value_s {
+    vm_data_type_e                          type;               /**< 值的类型 */
+    union {
+        int         int_val;
+        ngx_str_t   str_val;
+        uint8_t     bool_val;
+        inx_addr_t  inx_addr_val;
+    }                                       value;              /**< 值 */
+    struct vm_stack_arg_s                  *operand;            /**< 压入字面量的指令的参数，包含加载规则时预编译好的操作数，其余情况下为 NULL。 */
+} vm_value_t;
+
+
+
 /**
  * @struct vm_code_t
  * @brief 虚拟机指令
@@ -398,4 +703,96 @@ typedef struct vm_code_s {
     struct vm_stack_arg_s   argv;   /**< 指令参数 */
 } vm_code_t;
 
+
+
+/**
+ * @struct vm_node_t
+ * @brief 高级规则的表达式树的节点，仅在加载规则时用于优化。
+*/
+typedef struct vm_node_s {
+    vm_code_t                              *code;               /**< 节点对应的指令，常量节点为 NULL。 */
+    struct vm_node_s                       *child[2];           /**< 子节点。对于 and 和 or，child[0] 先被求值；对于比较运算，child[0] 是左操作数。 */
+    ngx_int_t                               constant;           /**< 加载规则时就能确定的布尔值，不能确定时为 NGX_CONF_UNSET。 */
+    ngx_uint_t                              cost;               /**< 估计的求值代价 */
+    ngx_uint_t                              refs;               /**< 整个规则集中引用此谓词的次数 */
+    ngx_int_t                               slot;               /**< 谓词的结果在每个请求的备忘录中的位置，不需要记录时为 NGX_CONF_UNSET。 */
+} vm_node_t;
+
+
+/**
+ * @struct vm_predicate_t
+ * @brief 加载规则时用于查找相同谓词的哈希表中的一项
+*/
+typedef struct vm_predicate_s {
+    ngx_str_t                               key;                /**< 谓词及其操作数的指令序列化之后的结果 */
+    vm_node_t                              *node;               /**< 所有相同的谓词共用的节点 */
+    UT_hash_handle                          hh;                 /**< uthash 关键成员 */
+} vm_predicate_t;
+
+
+/**
+ * @struct vm_rule_t
+ * @brief 一条高级规则在指令数组中的范围
+*/
+typedef struct vm_rule_s {
+    ngx_uint_t                              start;              /**< 第一条指令的下标 */
+    ngx_uint_t                              end;                /**< 最后一条指令的下一个下标 */
+} vm_rule_t;
+
+
+/**
+ * @struct vm_index_item_t
+ * @brief 以同一个 URL 或者 URL 前缀为前提的高级规则
+*/
+typedef struct vm_index_item_s {
+    ngx_str_t                               key;                /**< URL 或者 URL 前缀，指向指令中的字符串。 */
+    ngx_array_t                            *rules;              /**< 规则的序号（ngx_uint_t），按照规则在文件中的顺序排列。 */
+    UT_hash_handle                          hh;                 /**< uthash 关键成员 */
+} vm_index_item_t;
+
+
+/**
+ * @struct vm_index_t
+ * @brief 高级规则的索引，执行时只需要运行没有前提的规则和前提可能成立的规则。
+*/
+typedef struct vm_index_s {
+    ngx_array_t                            *rules;              /**< 每条规则的范围（vm_rule_t） */
+    ngx_array_t                            *unguarded;          /**< 没有前提的规则的序号（ngx_uint_t） */
+    vm_index_item_t                        *exact;              /**< 以 url equals "..." 为前提的规则，按照 URL 查找。 */
+    vm_index_item_t                        *prefix;             /**< 以 url matches "^..." 为前提的规则，按照 URL 前缀查找。 */
+    ngx_array_t                            *prefix_lens;        /**< prefix 中出现过的前缀长度（size_t），从小到大排列。 */
+} vm_index_t;
+
+
+/**
+ * @struct vm_index_cursor_t
+ * @brief 执行时用于按顺序合并多组规则的游标
+*/
+typedef struct vm_index_cursor_s {
+    ngx_uint_t                             *elts;               /**< 规则的序号 */
+    ngx_uint_t                              nelts;              /**< 规则的数量 */
+    ngx_uint_t                              next;               /**< 下一条规则在 elts 中的下标 */
+} vm_index_cursor_t;
+
+
+/**
+ * @struct vm_input_t
+ * @brief 高级规则读取的一个请求字段，高级规则的执行结果只取决于这些字段。
+*/
+typedef struct vm_input_s {
+    vm_code_type_e                          type;               /**< 读取这个字段的指令的类型 */
+    ngx_str_t                               key;                /**< query_string、header_in 和 cookie 的 key，指向指令中的字符串。 */
+} vm_input_t;
+
+
+/**
+ * @struct vm_verdict_t
+ * @brief 高级规则的缓存中保存的执行结果
+*/
+typedef struct vm_verdict_s {
+    ngx_int_t                               is_matched;         /**< 是否命中了规则 */
+    ngx_int_t                               http_status;        /**< 命中的规则要返回的 HTTP 状态码，放行时为 NGX_DECLINED。 */
+    u_char                                 *rule_id;            /**< 命中的规则的 ID，指向指令中以 '\0' 结尾的字符串。 */
+} vm_verdict_t;
+
 #endif // !NGX_HTTP_WAF_MODULE_TYPE_H
\ No newline at end of file
@@ -5,8 +5,8 @@
 #include <ngx_http_waf_module_type.h>
 #include <ngx_http_waf_module_check.h>
 #include <ngx_http_waf_module_util.h>
+#include <ngx_http_waf_module_memmem.h>
 #include <ngx_inet.h>
-#include <utstack.h>
 #include <libinjection.h>
 #include <libinjection_sqli.h>
 #include <libinjection_xss.h>
@@ -15,7 +15,63 @@ void ngx_http_waf_print_code(UT_array* array);
 
 
 /**
- * @brief 执行高级规则
+ * @brief 在加载规则时优化指令。折叠只含字面量的子表达式，删除永远不会命中的规则，
+ *        将 and 和 or 编译为短路跳转，并且先计算代价较小的操作数。
+ *        多条规则中相同的谓词会被合并，在每个请求中最多求值一次。
+ * @param[in] array 解析得到的指令数组，优化后的指令会替换其中的内容。
+ * @param[in] pool 折叠 matches 时编译正则表达式所用的内存池
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示成功，
+ *         NGX_HTTP_WAF_MALLOC_ERROR 表示内存不足，
+ *         NGX_HTTP_WAF_FAIL 表示指令的格式不正确。
+*/
+ngx_int_t ngx_http_waf_vm_optimize(UT_array* array, ngx_pool_t* pool);
+
+
+/**
+ * @brief 在加载规则时检查栈的深度并预先编译字面量操作数，包括 matches 的正则表达式、client_ip 的 belong_to 和 equals 的地址，
+ *        以及 in 的集合。字符串集合使用哈希表，client_ip 的集合使用前缀树。
+ * @param[in] array 解析得到的指令数组
+ * @param[in] pool 编译正则表达式和建立集合所用的内存池
+ * @param[in] file_name 高级规则文件的路径，in @"..." 中的相对路径相对于它所在的目录。
+ * @param[out] invalid 存在非法的正则表达式、非法的 IP 地址块或者无法打开的集合文件时指向它，反之为 NULL。
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示成功，
+ *         NGX_HTTP_WAF_MALLOC_ERROR 表示内存不足，
+ *         NGX_HTTP_WAF_FAIL 表示存在非法的操作数或者所需的栈深度超出了 NGX_HTTP_WAF_VM_STACK_SIZE。
+*/
+ngx_int_t ngx_http_waf_vm_precompile(UT_array* array, ngx_pool_t* pool, const char* file_name, u_char** invalid);
+
+
+/**
+ * @brief 按照 URL 为高级规则建立索引。以 url equals "..." 或者 url matches "^..." 为前提的规则会按照 URL 或者 URL 前缀分组，
+ *        执行时只运行前提可能成立的分组以及没有前提的规则。
+ * @param[in] array 优化并预编译后的指令数组
+ * @param[in] pool 分配索引所用的内存池
+ * @param[out] out 建立的索引，没有可以索引的规则时为 NULL。
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示成功，NGX_HTTP_WAF_MALLOC_ERROR 表示内存不足。
+*/
+ngx_int_t ngx_http_waf_vm_build_index(UT_array* array, ngx_pool_t* pool, vm_index_t** out);
+
+
+/**
+ * @brief 找出高级规则读取的所有请求字段。高级规则的执行结果只取决于这些字段，所以可以按照这些字段的值缓存执行结果。
+ * @param[in] array 优化并预编译后的指令数组
+ * @param[in] pool 分配字段数组所用的内存池
+ * @param[out] out 读取的字段（vm_input_t），没有高级规则或者字段的数量超出了 NGX_HTTP_WAF_VM_CACHE_MAX_INPUTS 时为 NULL。
+ * @return 返回 NGX_HTTP_WAF_SUCCESS 表示成功，NGX_HTTP_WAF_MALLOC_ERROR 表示内存不足。
+*/
+ngx_int_t ngx_http_waf_vm_collect_inputs(UT_array* array, ngx_pool_t* pool, ngx_array_t** out);
+
+
+/**
+ * @brief 计算高级规则的代数。只有指令完全相同的规则才有相同的代数，继承了同一个缓存的不同规则不会用到彼此的执行结果。
+ * @param[in] array 优化并预编译后的指令数组
+ * @return 所有指令的类型和字面量参数的 CRC32
+*/
+uint32_t ngx_http_waf_vm_generation(UT_array* array);
+
+
+/**
+ * @brief 执行高级规则，启用了缓存时会先按照规则读取的字段的值查找之前的执行结果。
  * @param[out] out_http_status 要返回的 HTTP 状态码
  * @return 如果命中规则则返回 NGX_HTTP_WAF_MATCHED，反之则为 NGX_HTTP_WAF_NOT_MATCHED。
 */ 
@@ -0,0 +1,171 @@
+#include <ngx_http_waf_module_aho_corasick.h>
+
+
+static ac_node_t* _ac_automaton_goto(ac_automaton_t* ac, ac_node_t* node, u_char ch);
+
+
+ngx_int_t ac_automaton_init(ac_automaton_t* ac, mem_pool_type_e pool_type, void* native_pool) {
+    if (ac == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    if (mem_pool_init(&ac->pool, pool_type, native_pool) != NGX_HTTP_WAF_SUCCESS) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    ngx_memzero(ac->goto_root, sizeof(ac->goto_root));
+    ac->size = 0;
+    ac->is_built = NGX_HTTP_WAF_FALSE;
+    ac->root = (ac_node_t*)mem_pool_calloc(&ac->pool, sizeof(ac_node_t));
+
+    if (ac->root == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    ac->root->id = -1;
+    ac->root->fail = ac->root;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+ngx_int_t ac_automaton_add(ac_automaton_t* ac, u_char* data, size_t len, ngx_uint_t* id) {
+    if (ac == NULL || data == NULL || len == 0 || ac->is_built == NGX_HTTP_WAF_TRUE) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    ac_node_t* cur_node = ac->root;
+
+    for (size_t i = 0; i < len; i++) {
+        u_char ch = ngx_tolower(data[i]);
+        ac_node_t* next_node = _ac_automaton_goto(ac, cur_node, ch);
+
+        if (next_node == NULL) {
+            next_node = (ac_node_t*)mem_pool_calloc(&ac->pool, sizeof(ac_node_t));
+            if (next_node == NULL) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            }
+
+            next_node->ch = ch;
+            next_node->id = -1;
+            next_node->sibling = cur_node->child;
+            cur_node->child = next_node;
+
+            if (cur_node == ac->root) {
+                ac->goto_root[ch] = next_node;
+            }
+        }
+
+        cur_node = next_node;
+    }
+
+    if (cur_node->id < 0) {
+        if (ac->size >= NGX_HTTP_WAF_AC_MAX_LITERALS) {
+            return NGX_HTTP_WAF_FAIL;
+        }
+        cur_node->id = (ngx_int_t)ac->size++;
+    }
+
+    *id = (ngx_uint_t)cur_node->id;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+ngx_int_t ac_automaton_build(ac_automaton_t* ac) {
+    if (ac == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    ac_node_t* head = NULL;
+    ac_node_t* tail = NULL;
+
+    for (ac_node_t* child = ac->root->child; child != NULL; child = child->sibling) {
+        child->fail = ac->root;
+        child->output = NULL;
+        child->next = NULL;
+        if (tail == NULL) {
+            head = child;
+        } else {
+            tail->next = child;
+        }
+        tail = child;
+    }
+
+    /* 按层遍历，每个节点的失配指针都指向比它更浅的节点。 */
+    while (head != NULL) {
+        ac_node_t* cur_node = head;
+        head = head->next;
+        if (head == NULL) {
+            tail = NULL;
+        }
+
+        for (ac_node_t* child = cur_node->child; child != NULL; child = child->sibling) {
+            ac_node_t* fail = cur_node->fail;
+            ac_node_t* target = _ac_automaton_goto(ac, fail, child->ch);
+
+            while (target == NULL && fail != ac->root) {
+                fail = fail->fail;
+                target = _ac_automaton_goto(ac, fail, child->ch);
+            }
+
+            child->fail = target == NULL ? ac->root : target;
+            child->output = child->fail->id >= 0 ? child->fail : child->fail->output;
+            child->next = NULL;
+
+            if (tail == NULL) {
+                head = child;
+            } else {
+                tail->next = child;
+            }
+            tail = child;
+        }
+    }
+
+    ac->is_built = NGX_HTTP_WAF_TRUE;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+void ac_automaton_scan(ac_automaton_t* ac, u_char* data, size_t len, u_char* bitmap) {
+    ac_node_t* root = ac->root;
+    ac_node_t* cur_node = root;
+
+    for (size_t i = 0; i < len; i++) {
+        u_char ch = ngx_tolower(data[i]);
+        ac_node_t* next_node = NULL;
+
+        while (cur_node != root
+            && (next_node = _ac_automaton_goto(ac, cur_node, ch)) == NULL) {
+            cur_node = cur_node->fail;
+        }
+
+        if (cur_node == root) {
+            next_node = ac->goto_root[ch];
+        }
+
+        cur_node = next_node == NULL ? root : next_node;
+
+        for (ac_node_t* node = cur_node->id >= 0 ? cur_node : cur_node->output;
+             node != NULL;
+             node = node->output) {
+            bitmap[node->id / 8] |= (u_char)(1 << (node->id % 8));
+        }
+    }
+}
+
+
+static ac_node_t* _ac_automaton_goto(ac_automaton_t* ac, ac_node_t* node, u_char ch) {
+    if (node == ac->root) {
+        return ac->goto_root[ch];
+    }
+
+    for (ac_node_t* child = node->child; child != NULL; child = child->sibling) {
+        if (child->ch == ch) {
+            return child;
+        }
+    }
+
+    return NULL;
+}
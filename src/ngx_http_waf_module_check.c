@@ -2,6 +2,93 @@
 
 extern ngx_module_t ngx_http_waf_module; /**< 模块详情 */
 
+
+/**
+ * @brief 以输入的指纹为关键字将紧凑的检查结果存入缓存。
+ * @note 如果 cache 位于共享内存中，调用前需要加锁。
+*/
+static void _cache_add(lru_cache_t* cache, inspection_cache_key_t* key, cached_check_result_t* cached);
+
+
+/**
+ * @brief 获取当前请求所在的连接的上下文，不存在时创建一个。HTTP/2 的所有流共用底层连接的上下文。
+ * @return 内存不足时返回 NULL。
+*/
+static ngx_http_waf_conn_ctx_t* _get_conn_ctx(ngx_http_request_t* r);
+
+
+/**
+ * @brief 用于在连接的内存池中标记连接的上下文，不做任何事。
+*/
+static void _conn_ctx_cleanup(void* data);
+
+
+/**
+ * @brief 在前缀树中查找地址，优先使用缓存在连接上的结果。
+ * @param[in] verdict 缓存在连接上的结果，为 NULL 时直接查找。
+ * @param[out] out_detail 命中时指向命中的规则
+ * @return 命中时返回 NGX_HTTP_WAF_MATCHED，反之为 NGX_HTTP_WAF_NOT_MATCHED。
+*/
+static ngx_int_t _ip_trie_find_cached(ip_verdict_t* verdict, ip_trie_t* trie, inx_addr_t* inx_addr, u_char** out_detail);
+
+
+/**
+ * @brief 生成 CC 防护的统计表的关键字
+ * @param[in,out] inx_addr 传入客户端地址，传出按照前缀长度截断并混合了自定义关键字之后的结果。
+ * @return 成功返回 NGX_HTTP_WAF_SUCCESS，反之为 NGX_HTTP_WAF_FAIL。
+*/
+static ngx_int_t _make_cc_key(ngx_http_request_t* r, ngx_http_waf_loc_conf_t* loc_conf, 
+                              ngx_int_t ip_type, inx_addr_t* inx_addr);
+
+
+/**
+ * @brief 获取客户端地址所在的 IP 访问频率统计表的分片
+*/
+static cc_shard_t* _get_cc_shard(ngx_http_waf_loc_conf_t* loc_conf, inx_addr_t* inx_addr);
+
+
+/**
+ * @brief 将一个地址在本地累积的访问次数写回共享内存，并归还预留的余量。用作 lru_cache_foreach() 的回调函数。
+ * @param[in] ctx 本地统计表所属的配置
+*/
+static void _flush_cc_local(void* key, size_t key_len, void* data, void* ctx);
+
+
+/**
+ * @brief 按照 GCRA 算法检查客户端地址的请求速率
+ * @return 超出速率和突发量时返回 NGX_HTTP_WAF_MATCHED，反之为 NGX_HTTP_WAF_NOT_MATCHED。
+*/
+static ngx_int_t _check_cc_gcra(ngx_http_request_t* r, ngx_http_waf_loc_conf_t* loc_conf, 
+                                inx_addr_t* inx_addr, ngx_int_t* out_http_status);
+
+
+/**
+ * @brief 从客户端地址的令牌桶中取出一个令牌
+ * @return 令牌桶为空或者处于封禁状态时返回 NGX_HTTP_WAF_MATCHED，反之为 NGX_HTTP_WAF_NOT_MATCHED。
+*/
+static ngx_int_t _check_cc_token_bucket(ngx_http_request_t* r, ngx_http_waf_loc_conf_t* loc_conf, 
+                                        inx_addr_t* inx_addr, ngx_int_t* out_http_status);
+
+
+/**
+ * @brief 添加 Retry-After 响应头
+ * @param[in] remain 多少秒之后可以重试
+*/
+static void _set_retry_after(ngx_http_request_t* r, time_t remain);
+
+
+const char* ngx_http_waf_inspection_types[NGX_HTTP_WAF_INSPECTION_TYPE_NUM] = {
+    "WHITE-URL",
+    "BLACK-URL",
+    "BLACK-ARGS",
+    "BLACK-UA",
+    "WHITE-REFERER",
+    "BLACK-REFERER",
+    "BLACK-COOKIE",
+    "BLACK-POST"
+};
+
+
 ngx_int_t ngx_http_waf_handler_check_white_ip(ngx_http_request_t* r, ngx_int_t* out_http_status) {
     ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
         "ngx_waf_debug: Start inspecting the IP whitelist.");
@@ -20,15 +107,18 @@ ngx_int_t ngx_http_waf_handler_check_white_ip(ngx_http_request_t* r, ngx_int_t*
         ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
             "ngx_waf_debug: Inspection has begun.");
 
-        ip_trie_node_t* ip_trie_node = NULL;
+        ngx_http_waf_conn_ctx_t* conn_ctx = _get_conn_ctx(r);
+        ip_verdict_t* verdict = conn_ctx == NULL ? NULL : &(conn_ctx->white_ip);
+        u_char* detail = NULL;
         if (r->connection->sockaddr->sa_family == AF_INET) {
             struct sockaddr_in* sin = (struct sockaddr_in*)r->connection->sockaddr;
             inx_addr_t inx_addr;
+            ngx_memzero(&inx_addr, sizeof(inx_addr_t));
             ngx_memcpy(&(inx_addr.ipv4), &(sin->sin_addr), sizeof(struct in_addr));
-            if (ip_trie_find(loc_conf->white_ipv4, &inx_addr, &ip_trie_node) == NGX_HTTP_WAF_SUCCESS) {
+            if (_ip_trie_find_cached(verdict, loc_conf->white_ipv4, &inx_addr, &detail) == NGX_HTTP_WAF_MATCHED) {
                 ctx->blocked = NGX_HTTP_WAF_FALSE;
                 strcpy((char*)ctx->rule_type, "WHITE-IPV4");
-                strcpy((char*)ctx->rule_deatils, (char*)ip_trie_node->data);
+                strcpy((char*)ctx->rule_deatils, (char*)detail);
                 *out_http_status = NGX_DECLINED;
                 ret_value = NGX_HTTP_WAF_MATCHED;
             }
@@ -39,10 +129,10 @@ ngx_int_t ngx_http_waf_handler_check_white_ip(ngx_http_request_t* r, ngx_int_t*
             inx_addr_t inx_addr;
             
             ngx_memcpy(&(inx_addr.ipv6), &(sin6->sin6_addr), sizeof(struct in6_addr));
-            if (ip_trie_find(loc_conf->white_ipv6, &inx_addr, &ip_trie_node) == NGX_HTTP_WAF_SUCCESS) {
+            if (_ip_trie_find_cached(verdict, loc_conf->white_ipv6, &inx_addr, &detail) == NGX_HTTP_WAF_MATCHED) {
                 ctx->blocked = NGX_HTTP_WAF_FALSE;
                 strcpy((char*)ctx->rule_type, "WHITE-IPV6");
-                strcpy((char*)ctx->rule_deatils, (char*)ip_trie_node->data);
+                strcpy((char*)ctx->rule_deatils, (char*)detail);
                 *out_http_status = NGX_DECLINED;
                 ret_value = NGX_HTTP_WAF_MATCHED;
             }
@@ -77,16 +167,18 @@ ngx_int_t ngx_http_waf_handler_check_black_ip(ngx_http_request_t* r, ngx_int_t*
         ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
             "ngx_waf_debug: Inspection has begun.");
 
-        ip_trie_node_t *ip_trie_node = NULL;
+        ngx_http_waf_conn_ctx_t* conn_ctx = _get_conn_ctx(r);
+        ip_verdict_t* verdict = conn_ctx == NULL ? NULL : &(conn_ctx->black_ip);
+        u_char* detail = NULL;
         if (r->connection->sockaddr->sa_family == AF_INET) {
             struct sockaddr_in* sin = (struct sockaddr_in*)r->connection->sockaddr;
             inx_addr_t inx_addr;
-            
+            ngx_memzero(&inx_addr, sizeof(inx_addr_t));
             ngx_memcpy(&(inx_addr.ipv4), &(sin->sin_addr), sizeof(struct in_addr));
-            if (ip_trie_find(loc_conf->black_ipv4, &inx_addr, &ip_trie_node) == NGX_HTTP_WAF_SUCCESS) {
+            if (_ip_trie_find_cached(verdict, loc_conf->black_ipv4, &inx_addr, &detail) == NGX_HTTP_WAF_MATCHED) {
                 ctx->blocked = NGX_HTTP_WAF_TRUE;
                 strcpy((char*)ctx->rule_type, "BLACK-IPV4");
-                strcpy((char*)ctx->rule_deatils, (char*)ip_trie_node->data);
+                strcpy((char*)ctx->rule_deatils, (char*)detail);
                 *out_http_status = NGX_HTTP_FORBIDDEN;
                 ret_value = NGX_HTTP_WAF_MATCHED;
             }
@@ -96,10 +188,10 @@ ngx_int_t ngx_http_waf_handler_check_black_ip(ngx_http_request_t* r, ngx_int_t*
             struct sockaddr_in6* sin6 = (struct sockaddr_in6*)r->connection->sockaddr;
             inx_addr_t inx_addr;
             ngx_memcpy(&(inx_addr.ipv6), &(sin6->sin6_addr), sizeof(struct in6_addr));
-            if (ip_trie_find(loc_conf->black_ipv6, &inx_addr, &ip_trie_node) == NGX_HTTP_WAF_SUCCESS) {
+            if (_ip_trie_find_cached(verdict, loc_conf->black_ipv6, &inx_addr, &detail) == NGX_HTTP_WAF_MATCHED) {
                 ctx->blocked = NGX_HTTP_WAF_TRUE;
                 strcpy((char*)ctx->rule_type, "BLACK-IPV6");
-                strcpy((char*)ctx->rule_deatils, (char*)ip_trie_node->data);
+                strcpy((char*)ctx->rule_deatils, (char*)detail);
                 *out_http_status = loc_conf->waf_http_status;
                 ret_value = NGX_HTTP_WAF_MATCHED;
             }
@@ -154,112 +246,181 @@ ngx_int_t ngx_http_waf_handler_check_cc(ngx_http_request_t* r, ngx_int_t* out_ht
             ngx_memcpy(&(inx_addr.ipv6), &(s_addr_in6->sin6_addr), sizeof(struct in6_addr));
         }
 #endif
+
+        if (_make_cc_key(r, loc_conf, ip_type, &inx_addr) != NGX_HTTP_WAF_SUCCESS) {
+            *out_http_status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            ret_value = NGX_HTTP_WAF_MATCHED;
+            goto done;
+        }
+
+        if (loc_conf->waf_cc_deny_mode == NGX_HTTP_WAF_CC_MODE_GCRA) {
+            ret_value = _check_cc_gcra(r, loc_conf, &inx_addr, out_http_status);
+            goto done;
+        }
+
+        if (loc_conf->waf_cc_deny_mode == NGX_HTTP_WAF_CC_MODE_TOKEN_BUCKET) {
+            ret_value = _check_cc_token_bucket(r, loc_conf, &inx_addr, out_http_status);
+            goto done;
+        }
+
         ngx_int_t limit  = loc_conf->waf_cc_deny_limit;
         ngx_int_t duration = loc_conf->waf_cc_deny_duration;
+        ngx_int_t delta = 1;
         ip_statis_t* statis = NULL;
-        ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)loc_conf->shm_zone_cc_deny->shm.addr;
+        ip_statis_t snapshot;
+        ngx_memzero(&snapshot, sizeof(ip_statis_t));
+
+        /* 
+         * 每个 worker 先在本地累积访问次数，再分批写入共享内存。每次同步时在共享内存中为这个 worker 预留一批余量，
+         * 本地最多累积这么多次，所有 worker 预留的余量之和不超过离上限的余量，所以尚未写回的访问次数加起来也不会超过上限。
+         * 余量不足时每次请求都会同步，被拦截的地址在同步之后的一段时间内直接在本地拦截。
+         * 不再访问的地址累积的次数和预留的余量由定时器调用 ngx_http_waf_flush_cc_local() 写回。
+        */
+        cc_local_statis_t* local = NULL;
+        if (loc_conf->cc_local_statistics != NULL) {
+            lru_cache_find_result_t tmp = lru_cache_find(loc_conf->cc_local_statistics, &inx_addr, sizeof(inx_addr_t));
+            if (tmp.status == NGX_HTTP_WAF_KEY_EXISTS) {
+                local = *(tmp.data);
+            } else {
+                lru_cache_add_result_t tmp1 = lru_cache_add(loc_conf->cc_local_statistics, &inx_addr, sizeof(inx_addr_t));
+                if (tmp1.status == NGX_HTTP_WAF_SUCCESS) {
+                    local = *(tmp1.data);
+                    ngx_memzero(local, sizeof(cc_local_statis_t));
+                }
+            }
+        }
 
-        ngx_shmtx_lock(&shpool->mutex);
+        if (local != NULL 
+            && local->synced_time != 0 
+            && difftime(now, local->synced_time) < NGX_HTTP_WAF_CC_LOCAL_INTERVAL) {
+            ip_statis_t* shared = &(local->shared);
+
+            if (shared->is_blocked == NGX_HTTP_WAF_TRUE && difftime(now, shared->block_time) < duration) {
+                snapshot = *shared;
+                goto matched;
+            }
+
+            if (shared->is_blocked == NGX_HTTP_WAF_FALSE
+                && difftime(now, shared->record_time) <= 60
+                && local->pending < local->granted) {
+                ++(local->pending);
+                goto not_matched;
+            }
+        }
+
+        if (local != NULL) {
+            delta += local->pending;
+        }
+
+        /* 只锁住客户端地址所在的分片 */
+        cc_shard_t* shard = _get_cc_shard(loc_conf, &inx_addr);
+
+        ngx_shmtx_lock(&shard->mutex);
         ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
             "ngx_waf_debug: Shared memory is locked.");
 
-        // randombytes_buf(&inx_addr, sizeof(inx_addr_t));
-
-        lru_cache_find_result_t tmp0 = lru_cache_find(loc_conf->ip_access_statistics, &inx_addr, sizeof(inx_addr_t));
+        lru_cache_find_result_t tmp0 = lru_cache_find(shard->statistics, &inx_addr, sizeof(inx_addr_t));
         if (tmp0.status == NGX_HTTP_WAF_KEY_EXISTS) {
             statis = *(tmp0).data;
         } else {
-            lru_cache_add_result_t tmp1 = lru_cache_add(loc_conf->ip_access_statistics, &inx_addr, sizeof(inx_addr_t));
+            lru_cache_add_result_t tmp1 = lru_cache_add(shard->statistics, &inx_addr, sizeof(inx_addr_t));
             if (tmp1.status == NGX_HTTP_WAF_SUCCESS) {
-                statis = mem_pool_calloc(&loc_conf->ip_access_statistics->pool, sizeof(ip_statis_t));
-                assert(statis != NULL);
+                /* 统计表使用定长槽位，数据区已经位于槽位中，不需要再分配。 */
+                statis = *(tmp1.data);
                 statis->count = 1;
+                statis->reserved = 0;
                 statis->is_blocked = NGX_HTTP_WAF_FALSE;
                 statis->record_time = now;
                 statis->block_time = 0;
-
-                *(tmp1.data) = statis;
             } else {
+                ngx_shmtx_unlock(&shard->mutex);
                 *out_http_status = NGX_HTTP_INTERNAL_SERVER_ERROR;
                 ret_value = NGX_HTTP_WAF_MATCHED;
                 goto exception;
             }
         }
 
+        /* 归还上次预留的余量，统计周期已经重新开始时余量随着之前的周期一起作废。 */
+        if (local != NULL && local->granted != 0 && local->shared.record_time == statis->record_time) {
+            statis->reserved = ngx_max(statis->reserved - local->granted, 0);
+        }
+
         double diff_second_record = difftime(now, statis->record_time);
         double diff_second_block = difftime(now, statis->block_time);
+        ngx_int_t is_matched = NGX_HTTP_WAF_FALSE;
 
         if (statis->is_blocked == NGX_HTTP_WAF_TRUE) {
             if (diff_second_block < duration) {
-                goto matched;
+                is_matched = NGX_HTTP_WAF_TRUE;
             } else {
-                statis->count = 1;
+                statis->count = delta;
+                statis->reserved = 0;
                 statis->is_blocked = NGX_HTTP_WAF_FALSE;
                 statis->record_time = now;
                 statis->block_time = 0;
             }
         } else if (diff_second_record <= 60) {
             if (statis->count > limit) {
-                goto matched;
+                is_matched = NGX_HTTP_WAF_TRUE;
             } else {
-                ++(statis->count);
+                statis->count += delta;
             }
         } else {
-            statis->count = 1;
+            statis->count = delta;
+            statis->reserved = 0;
             statis->is_blocked = NGX_HTTP_WAF_FALSE;
             statis->record_time = now;
             statis->block_time = 0;
         }
 
+        if (is_matched == NGX_HTTP_WAF_TRUE && statis->is_blocked == NGX_HTTP_WAF_FALSE) {
+            statis->is_blocked = NGX_HTTP_WAF_TRUE;
+            statis->block_time = now;
+        }
 
-        goto not_matched;
+        /* 剩下的余量平分给所有的 worker，从中为这个 worker 预留一批。 */
+        ngx_int_t granted = 0;
+        if (local != NULL && statis->is_blocked == NGX_HTTP_WAF_FALSE) {
+            ngx_core_conf_t* ccf = (ngx_core_conf_t*)ngx_get_conf(ngx_cycle->conf_ctx, ngx_core_module);
+            granted = (limit - statis->count - statis->reserved) / ngx_max(ccf->worker_processes, 1);
+            granted = ngx_max(ngx_min(granted, NGX_HTTP_WAF_CC_LOCAL_BATCH), 0);
+            statis->reserved += granted;
+        }
 
-        matched: {
-            
-            if (statis->is_blocked == NGX_HTTP_WAF_FALSE) {
-                statis->is_blocked = NGX_HTTP_WAF_TRUE;
-                statis->block_time = now;
-            }
+        snapshot = *statis;
+
+        ngx_shmtx_unlock(&shard->mutex);
+        ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
+            "ngx_waf_debug: Shared memory is unlocked.");
 
+        if (local != NULL) {
+            local->pending = 0;
+            local->granted = granted;
+            local->synced_time = now;
+            local->shared = snapshot;
+        }
+
+        if (is_matched == NGX_HTTP_WAF_FALSE) {
+            goto not_matched;
+        }
+
+        matched: {
             ctx->blocked = NGX_HTTP_WAF_TRUE;
             strcpy((char*)ctx->rule_type, "CC-DENY");
             strcpy((char*)ctx->rule_deatils, "");
             *out_http_status = loc_conf->waf_http_status_cc;
             ret_value = NGX_HTTP_WAF_MATCHED;
-            time_t remain = duration - (now - statis->block_time);
+            time_t remain = duration - (now - snapshot.block_time);
 
             if (loc_conf->waf_http_status_cc != NGX_HTTP_CLOSE) {
-                ngx_table_elt_t* header = (ngx_table_elt_t*)ngx_list_push(&(r->headers_out.headers));
-                if (header == NULL) {
-                    goto no_action;
-                }
-
-                /* 如果 hash 字段为 0 则会在遍历 HTTP 头的时候被忽略 */
-                header->hash = 1;
-                ngx_str_set(&header->key, "Retry-After");
-                header->value.data = ngx_palloc(r->pool, NGX_TIME_T_LEN + 1);
-                if (header->value.data == NULL) {
-                    goto no_action;
-                }
-
-                #if (NGX_TIME_T_SIZE == 4)
-                    header->value.len = sprintf((char*)header->value.data, "%d", (int)remain);
-                #elif (NGX_TIME_T_SIZE == 8)
-                    header->value.len = sprintf((char*)header->value.data, "%lld", (long long)remain);
-                #else
-                    #error The size of time_t is unexpected
-                #endif
+                _set_retry_after(r, remain);
             }
         }
         
         exception:
-        no_action:
         // no_memory:
         not_matched:
-        
-        ngx_shmtx_unlock(&shpool->mutex);
-        ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
-            "ngx_waf_debug: Shared memory is unlocked.");
+        done:
 
         ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
             "ngx_waf_debug: Detection is over.");
@@ -291,13 +452,13 @@ ngx_int_t ngx_http_waf_handler_check_white_url(ngx_http_request_t* r, ngx_int_t*
             "ngx_waf_debug: Inspection has begun.");
 
         ngx_str_t* p_uri = &r->uri;
-        ngx_array_t* regex_array = loc_conf->white_url;
+        regex_set_t* regex_array = loc_conf->white_url;
         lru_cache_t* cache = loc_conf->white_url_inspection_cache;
 
         ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r,
                                                             p_uri, 
                                                             regex_array, 
-                                                            (u_char*)"WHITE-URL", 
+                                                            NGX_HTTP_WAF_INSPECTION_WHITE_URL, 
                                                             cache, 
                                                             NGX_HTTP_WAF_FALSE, 
                                                             NGX_HTTP_WAF_FALSE);
@@ -336,13 +497,13 @@ ngx_int_t ngx_http_waf_handler_check_black_url(ngx_http_request_t* r, ngx_int_t*
             "ngx_waf_debug: Inspection has begun.");
 
         ngx_str_t* p_uri = &r->uri;
-        ngx_array_t* regex_array = loc_conf->black_url;
+        regex_set_t* regex_array = loc_conf->black_url;
         lru_cache_t* cache = loc_conf->black_url_inspection_cache;
 
         ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                             p_uri, 
                                                             regex_array, 
-                                                            (u_char*)"BLACK-URL", 
+                                                            NGX_HTTP_WAF_INSPECTION_BLACK_URL, 
                                                             cache, 
                                                             NGX_HTTP_WAF_TRUE,
                                                             NGX_HTTP_WAF_FALSE);
@@ -381,13 +542,13 @@ ngx_int_t ngx_http_waf_handler_check_black_args(ngx_http_request_t* r, ngx_int_t
             "ngx_waf_debug: Inspection has begun.");
 
         ngx_str_t* p_args = &r->args;
-        ngx_array_t* regex_array = loc_conf->black_args;
+        regex_set_t* regex_array = loc_conf->black_args;
         lru_cache_t* cache = loc_conf->black_args_inspection_cache;
 
         ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                             p_args, 
                                                             regex_array, 
-                                                            (u_char*)"BLACK-ARGS", 
+                                                            NGX_HTTP_WAF_INSPECTION_BLACK_ARGS, 
                                                             cache, 
                                                             NGX_HTTP_WAF_TRUE,
                                                             NGX_HTTP_WAF_FALSE);
@@ -407,7 +568,7 @@ ngx_int_t ngx_http_waf_handler_check_black_args(ngx_http_request_t* r, ngx_int_t
                     ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                                         key, 
                                                                         regex_array, 
-                                                                        (u_char*)"BLACK-ARGS", 
+                                                                        NGX_HTTP_WAF_INSPECTION_BLACK_ARGS, 
                                                                         cache, 
                                                                         NGX_HTTP_WAF_TRUE,
                                                                         NGX_HTTP_WAF_TRUE);
@@ -418,7 +579,7 @@ ngx_int_t ngx_http_waf_handler_check_black_args(ngx_http_request_t* r, ngx_int_t
                     ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                                         value, 
                                                                         regex_array, 
-                                                                        (u_char*)"BLACK-ARGS", 
+                                                                        NGX_HTTP_WAF_INSPECTION_BLACK_ARGS, 
                                                                         cache, 
                                                                         NGX_HTTP_WAF_TRUE,
                                                                         NGX_HTTP_WAF_TRUE);
@@ -470,13 +631,13 @@ ngx_int_t ngx_http_waf_handler_check_black_user_agent(ngx_http_request_t* r, ngx
             "ngx_waf_debug: Inspection has begun.");
 
         ngx_str_t* p_ua = &r->headers_in.user_agent->value;
-        ngx_array_t* regex_array = loc_conf->black_ua;
+        regex_set_t* regex_array = loc_conf->black_ua;
         lru_cache_t* cache = loc_conf->black_ua_inspection_cache;
 
         ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                             p_ua, 
                                                             regex_array, 
-                                                            (u_char*)"BLACK-UA", 
+                                                            NGX_HTTP_WAF_INSPECTION_BLACK_UA, 
                                                             cache, 
                                                             NGX_HTTP_WAF_FALSE,
                                                             NGX_HTTP_WAF_FALSE);
@@ -519,13 +680,13 @@ ngx_int_t ngx_http_waf_handler_check_white_referer(ngx_http_request_t* r, ngx_in
             "ngx_waf_debug: Inspection has begun.");
 
         ngx_str_t* p_referer = &r->headers_in.referer->value;
-        ngx_array_t* regex_array = loc_conf->white_referer;
+        regex_set_t* regex_array = loc_conf->white_referer;
         lru_cache_t* cache = loc_conf->white_referer_inspection_cache;
 
         ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                             p_referer, 
                                                             regex_array, 
-                                                            (u_char*)"WHITE-REFERER", 
+                                                            NGX_HTTP_WAF_INSPECTION_WHITE_REFERER, 
                                                             cache, 
                                                             NGX_HTTP_WAF_FALSE,
                                                             NGX_HTTP_WAF_FALSE);
@@ -569,13 +730,13 @@ ngx_int_t ngx_http_waf_handler_check_black_referer(ngx_http_request_t* r, ngx_in
             "ngx_waf_debug: Inspection has begun.");
 
         ngx_str_t* p_referer = &r->headers_in.referer->value;
-        ngx_array_t* regex_array = loc_conf->black_referer;
+        regex_set_t* regex_array = loc_conf->black_referer;
         lru_cache_t* cache = loc_conf->black_referer_inspection_cache;
 
         ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                             p_referer, 
                                                             regex_array, 
-                                                            (u_char*)"BLACK-REFERER", 
+                                                            NGX_HTTP_WAF_INSPECTION_BLACK_REFERER, 
                                                             cache, 
                                                             NGX_HTTP_WAF_FALSE,
                                                             NGX_HTTP_WAF_FALSE);
@@ -648,13 +809,13 @@ ngx_int_t ngx_http_waf_handler_check_black_cookie(ngx_http_request_t* r, ngx_int
                 ngx_memcpy(temp.data, key->data, key->len);
                 ngx_memcpy(temp.data + key->len, value->data, sizeof(u_char) * value->len);
 
-                ngx_array_t* regex_array = loc_conf->black_cookie;
+                regex_set_t* regex_array = loc_conf->black_cookie;
                 lru_cache_t* cache = loc_conf->black_cookie_inspection_cache;
 
                 ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                                     &temp, 
                                                                     regex_array, 
-                                                                    (u_char*)"BLACK-COOKIE", 
+                                                                    NGX_HTTP_WAF_INSPECTION_BLACK_COOKIE, 
                                                                     cache, 
                                                                     NGX_HTTP_WAF_TRUE,
                                                                     NGX_HTTP_WAF_TRUE);
@@ -663,7 +824,7 @@ ngx_int_t ngx_http_waf_handler_check_black_cookie(ngx_http_request_t* r, ngx_int
                     ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                                         key, 
                                                                         regex_array, 
-                                                                        (u_char*)"BLACK-COOKIE", 
+                                                                        NGX_HTTP_WAF_INSPECTION_BLACK_COOKIE, 
                                                                         cache, 
                                                                         NGX_HTTP_WAF_TRUE,
                                                                         NGX_HTTP_WAF_TRUE);
@@ -673,7 +834,7 @@ ngx_int_t ngx_http_waf_handler_check_black_cookie(ngx_http_request_t* r, ngx_int
                     ret_value = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                                         value, 
                                                                         regex_array, 
-                                                                        (u_char*)"BLACK-COOKIE", 
+                                                                        NGX_HTTP_WAF_INSPECTION_BLACK_COOKIE, 
                                                                         cache, 
                                                                         NGX_HTTP_WAF_TRUE,
                                                                         NGX_HTTP_WAF_TRUE);
@@ -725,11 +886,21 @@ ngx_int_t ngx_http_waf_handler_check_black_post(ngx_http_request_t* r, ngx_int_t
     body_str.data = ctx->req_body.pos;
     body_str.len = ctx->req_body.last - ctx->req_body.pos;
 
+    /* 
+     * 只缓存不太大的请求体的检查结果，关键字是请求体的 SipHash 指纹，
+     * 大量客户端提交的相同的请求体只需要检查一次。
+    */
+    lru_cache_t* cache = NULL;
+    if (loc_conf->waf_inspection_max_body != NGX_CONF_UNSET
+        && body_str.len <= (size_t)loc_conf->waf_inspection_max_body) {
+        cache = loc_conf->black_post_inspection_cache;
+    }
+
     ngx_int_t rc = ngx_http_waf_regex_exec_arrray_sqli_xss(r, 
                                                            &body_str, 
                                                            loc_conf->black_post, 
-                                                           (u_char*)"BLACK-POST", 
-                                                           NULL,
+                                                           NGX_HTTP_WAF_INSPECTION_BLACK_POST, 
+                                                           cache,
                                                            NGX_HTTP_WAF_TRUE,
                                                            NGX_HTTP_WAF_TRUE);
     if (rc == NGX_HTTP_WAF_MATCHED) {
@@ -764,9 +935,17 @@ void ngx_http_waf_get_ctx_and_conf(ngx_http_request_t* r, ngx_http_waf_loc_conf_
         while ((*conf)->waf_cc_deny_limit == NGX_CONF_UNSET && parent != NULL) {
             (*conf)->waf_cc_deny_limit = parent->waf_cc_deny_limit;
             (*conf)->waf_cc_deny_duration = parent->waf_cc_deny_duration;
+            (*conf)->waf_cc_deny_mode = parent->waf_cc_deny_mode;
+            (*conf)->waf_cc_deny_period = parent->waf_cc_deny_period;
+            (*conf)->waf_cc_deny_burst = parent->waf_cc_deny_burst;
             (*conf)->waf_cc_deny_shm_zone_size = parent->waf_cc_deny_shm_zone_size;
             (*conf)->shm_zone_cc_deny = parent->shm_zone_cc_deny;
-            (*conf)->ip_access_statistics = parent->ip_access_statistics;
+            (*conf)->cc_shards = parent->cc_shards;
+            (*conf)->cc_local_statistics = parent->cc_local_statistics;
+            (*conf)->cc_token_buckets = parent->cc_token_buckets;
+            (*conf)->waf_cc_deny_ipv4_prefix = parent->waf_cc_deny_ipv4_prefix;
+            (*conf)->waf_cc_deny_ipv6_prefix = parent->waf_cc_deny_ipv6_prefix;
+            (*conf)->waf_cc_deny_key = parent->waf_cc_deny_key;
             parent = parent->parent;
         }
         ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
@@ -777,37 +956,115 @@ void ngx_http_waf_get_ctx_and_conf(ngx_http_request_t* r, ngx_http_waf_loc_conf_
 
 ngx_int_t ngx_http_waf_regex_exec_arrray_sqli_xss(ngx_http_request_t* r, 
                                                         ngx_str_t* str, 
-                                                        ngx_array_t* array, 
-                                                        const u_char* rule_type, 
+                                                        regex_set_t* rule_set, 
+                                                        ngx_uint_t inspection_type, 
                                                         lru_cache_t* cache, 
                                                         int check_sql_injection,
                                                         int check_xss) {
     char s_no_memory[] = "No Memory";
 
+    ngx_http_waf_main_conf_t* main_conf = ngx_http_get_module_main_conf(r, ngx_http_waf_module);
     ngx_http_waf_loc_conf_t* loc_conf = NULL;
     ngx_http_waf_ctx_t* ctx = NULL;
     ngx_http_waf_get_ctx_and_conf(r, &loc_conf, &ctx);
     ngx_int_t cache_hit = NGX_HTTP_WAF_FAIL;
+    ngx_int_t shared_cache_hit = NGX_HTTP_WAF_FAIL;
+    inspection_cache_key_t key;
+    ngx_memzero(&key, sizeof(inspection_cache_key_t));
+    cached_check_result_t cached;
+    ngx_memzero(&cached, sizeof(cached_check_result_t));
     check_result_t result;
     result.is_matched = NGX_HTTP_WAF_NOT_MATCHED;
     result.detail = NULL;
 
-    if (str == NULL || str->data == NULL || str->len == 0 || array == NULL) {
+    if (str == NULL || str->data == NULL || str->len == 0 || rule_set == NULL) {
         return NGX_HTTP_WAF_NOT_MATCHED;
     }
 
-    if (ngx_http_waf_check_flag(loc_conf->waf_mode, NGX_HTTP_WAF_MODE_EXTRA_CACHE) == NGX_HTTP_WAF_TRUE
-        && loc_conf->waf_inspection_capacity != NGX_CONF_UNSET
-        && cache != NULL) {
+    if (ngx_http_waf_check_flag(loc_conf->waf_mode, NGX_HTTP_WAF_MODE_EXTRA_CACHE) != NGX_HTTP_WAF_TRUE
+        || loc_conf->waf_inspection_capacity == NGX_CONF_UNSET) {
+        cache = NULL;
+    }
 
-        lru_cache_find_result_t tmp = lru_cache_find(cache, str->data, sizeof(u_char) * str->len);
+    if (cache != NULL) {
+        /* 
+         * 以输入的 SipHash 指纹作为关键字，而不是复制整个输入。
+         * 密钥在每次启动时随机生成，所以无法针对性地构造碰撞。
+        */
+        crypto_shorthash((u_char*)&key.fingerprint, str->data, str->len, main_conf->cache_fingerprint_key);
+
+        /* 各个检查项目可能共用一个缓存，所以关键字中还要包括检查项目。 */
+        key.type = inspection_type;
+
+        /* 
+         * 相同的规则在不同的检查模式下可能得到不同的结果，比如启用 libinjection 之后，
+         * 子块继承的缓存和 reload 之后沿用的二级缓存中的旧结果都不能再使用。
+        */
+        key.mode = loc_conf->waf_mode & (NGX_HTTP_WAF_MODE_LIB_INJECTION | NGX_HTTP_WAF_MODE_MULTI_REGEX);
+
+        /* 同一个检查项目也会用不同的检测方式检查相同的输入，比如整个 Query String 不检测 XSS 攻击，而每个参数都要检测。 */
+        key.check_sql_injection = check_sql_injection ? 1 : 0;
+        key.check_xss = check_xss ? 1 : 0;
+
+        lru_cache_find_result_t tmp = lru_cache_find(cache, &key, sizeof(inspection_cache_key_t));
         if (tmp.status == NGX_HTTP_WAF_KEY_EXISTS) {
             cache_hit = NGX_HTTP_WAF_SUCCESS;
-            ngx_memcpy(&result, *(tmp.data), sizeof(check_result_t));
+            ngx_memcpy(&cached, *(tmp.data), sizeof(cached_check_result_t));
         }
     }
 
-    if (cache_hit != NGX_HTTP_WAF_SUCCESS) {
+    /* 一级缓存未命中时查找所有 worker 共用的二级缓存，命中的结果会被复制到一级缓存中。 */
+    if (cache != NULL && cache_hit != NGX_HTTP_WAF_SUCCESS && cache->shared != NULL) {
+        ngx_slab_pool_t* shpool = cache->shared->pool.native_pool.slab_pool;
+        ngx_shmtx_lock(&shpool->mutex);
+
+        lru_cache_find_result_t tmp = lru_cache_find(cache->shared, &key, sizeof(inspection_cache_key_t));
+        if (tmp.status == NGX_HTTP_WAF_KEY_EXISTS) {
+            shared_cache_hit = NGX_HTTP_WAF_SUCCESS;
+            ngx_memcpy(&cached, *(tmp.data), sizeof(cached_check_result_t));
+            if (cached.generation == rule_set->generation) {
+                ++(cache->shared->shared_hits);
+            }
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+    /* 由旧的规则产生的结果视为未命中，之后会被新的结果覆盖。 */
+    if ((cache_hit == NGX_HTTP_WAF_SUCCESS || shared_cache_hit == NGX_HTTP_WAF_SUCCESS)
+        && cached.generation != rule_set->generation) {
+        cache_hit = NGX_HTTP_WAF_FAIL;
+        shared_cache_hit = NGX_HTTP_WAF_FAIL;
+        ngx_memzero(&cached, sizeof(cached_check_result_t));
+    }
+
+    if (cache_hit == NGX_HTTP_WAF_SUCCESS || shared_cache_hit == NGX_HTTP_WAF_SUCCESS) {
+        result.is_matched = cached.is_matched;
+
+        switch (cached.detail_type) {
+            case NGX_HTTP_WAF_CACHED_DETAIL_REGEX:
+                if (cached.rule_index < rule_set->rules->nelts) {
+                    result.detail = ((ngx_regex_elt_t*)(rule_set->rules->elts))[cached.rule_index].name;
+                } else {
+                    result.detail = (u_char*)"";
+                }
+                break;
+            case NGX_HTTP_WAF_CACHED_DETAIL_SQLI:
+                result.detail = ngx_pnalloc(r->pool, sizeof(u_char) * 64);
+                if (result.detail != NULL) {
+                    sprintf((char*)result.detail, "libinjection_sqli - %s", cached.fingerprint);
+                } else {
+                    result.detail = (u_char*)s_no_memory;
+                }
+                break;
+            case NGX_HTTP_WAF_CACHED_DETAIL_XSS:
+                result.detail = (u_char*)"libinjection_xss";
+                break;
+            default:
+                break;
+        }
+
+    } else {
         if (check_sql_injection == NGX_HTTP_WAF_TRUE
             && ngx_http_waf_check_flag(loc_conf->waf_mode, NGX_HTTP_WAF_MODE_LIB_INJECTION_SQLI) == NGX_HTTP_WAF_TRUE) {
             sfilter sf;
@@ -823,6 +1080,9 @@ ngx_int_t ngx_http_waf_regex_exec_arrray_sqli_xss(ngx_http_request_t* r,
                 } else {
                     result.detail = (u_char*)s_no_memory;
                 }
+
+                cached.detail_type = NGX_HTTP_WAF_CACHED_DETAIL_SQLI;
+                ngx_memcpy(cached.fingerprint, sf.fingerprint, sizeof(cached.fingerprint) - 1);
             }
         }
 
@@ -836,37 +1096,401 @@ ngx_int_t ngx_http_waf_regex_exec_arrray_sqli_xss(ngx_http_request_t* r,
                 } else {
                     result.detail = (u_char*)s_no_memory;
                 }
+
+                cached.detail_type = NGX_HTTP_WAF_CACHED_DETAIL_XSS;
             }
         }
 
         if (result.detail == NULL) {
-            ngx_regex_elt_t* p = (ngx_regex_elt_t*)(array->elts);
-            for (size_t i = 0; i < array->nelts; i++, p++) {
-                ngx_int_t rc = ngx_regex_exec(p->regex, str, NULL, 0);
-                if (rc >= 0) {
-                    result.is_matched = NGX_HTTP_WAF_MATCHED;
-                    result.detail = p->name;
-                    break;
-                }
+            ngx_regex_elt_t* p = NULL;
+            if (regex_set_exec(rule_set, 
+                               str, 
+                               ngx_http_waf_check_flag(loc_conf->waf_mode, NGX_HTTP_WAF_MODE_MULTI_REGEX), 
+                               &p) == NGX_HTTP_WAF_MATCHED) {
+                result.is_matched = NGX_HTTP_WAF_MATCHED;
+                result.detail = p->name;
+
+                cached.detail_type = NGX_HTTP_WAF_CACHED_DETAIL_REGEX;
+                cached.rule_index = (uint32_t)(p - (ngx_regex_elt_t*)(rule_set->rules->elts));
             }
         }
+
+        cached.is_matched = (uint8_t)result.is_matched;
+        cached.generation = rule_set->generation;
     }
 
-    if (ngx_http_waf_check_flag(loc_conf->waf_mode, NGX_HTTP_WAF_MODE_EXTRA_CACHE) == NGX_HTTP_WAF_TRUE
-        && loc_conf->waf_inspection_capacity != NGX_CONF_UNSET
-        && cache != NULL) {
-        // lru_cache_manager_add(cache, str->data, str->len * sizeof(u_char), is_matched, rule_detail);
-        lru_cache_add_result_t tmp = lru_cache_add(cache, str->data, str->len * sizeof(u_char));
-        if (tmp.status == NGX_HTTP_WAF_SUCCESS) {
-            *(tmp.data) = lru_cache_calloc(cache, sizeof(check_result_t));
-            ngx_memcpy(*(tmp.data), &result, sizeof(check_result_t));
+    if (cache != NULL && cache_hit != NGX_HTTP_WAF_SUCCESS) {
+        _cache_add(cache, &key, &cached);
+
+        if (cache->shared != NULL && shared_cache_hit != NGX_HTTP_WAF_SUCCESS) {
+            ngx_slab_pool_t* shpool = cache->shared->pool.native_pool.slab_pool;
+            ngx_shmtx_lock(&shpool->mutex);
+            _cache_add(cache->shared, &key, &cached);
+            ngx_shmtx_unlock(&shpool->mutex);
         }
     }
 
     if (result.is_matched == NGX_HTTP_WAF_MATCHED) {
-        strcpy((char*)ctx->rule_type, (char*)rule_type);
+        strcpy((char*)ctx->rule_type, ngx_http_waf_inspection_types[inspection_type]);
         strcpy((char*)ctx->rule_deatils, (char*)result.detail);
     }
 
     return result.is_matched;
 }
+
+
+static void _cache_add(lru_cache_t* cache, inspection_cache_key_t* key, cached_check_result_t* cached) {
+    lru_cache_add_result_t tmp = lru_cache_add(cache, key, sizeof(inspection_cache_key_t));
+
+    /* 已经存在的缓存项是由旧的规则产生的，直接覆盖。 */
+    if (tmp.status != NGX_HTTP_WAF_SUCCESS && tmp.status != NGX_HTTP_WAF_KEY_EXISTS) {
+        return;
+    }
+
+    /* 使用定长槽位的缓存自带数据区，不需要再分配，同时按检查项目统计缓存项的数量。 */
+    if (cache->clock != NULL) {
+        lru_cache_set_tag(cache, tmp.data, key->type);
+    } else if (*(tmp.data) == NULL) {
+        *(tmp.data) = lru_cache_calloc(cache, sizeof(cached_check_result_t));
+        if (*(tmp.data) == NULL) {
+            lru_cache_delete(cache, key, sizeof(inspection_cache_key_t));
+            return;
+        }
+    }
+
+    ngx_memcpy(*(tmp.data), cached, sizeof(cached_check_result_t));
+}
+
+
+static ngx_http_waf_conn_ctx_t* _get_conn_ctx(ngx_http_request_t* r) {
+    ngx_connection_t* c = r->connection;
+
+#if (NGX_HTTP_V2)
+    /* HTTP/2 的每个流都有自己的连接结构，所以使用底层的连接。 */
+    if (r->stream != NULL) {
+        c = r->stream->connection->connection;
+    }
+#endif
+
+    for (ngx_pool_cleanup_t* cln = c->pool->cleanup; cln != NULL; cln = cln->next) {
+        if (cln->handler == _conn_ctx_cleanup) {
+            return cln->data;
+        }
+    }
+
+    ngx_pool_cleanup_t* cln = ngx_pool_cleanup_add(c->pool, sizeof(ngx_http_waf_conn_ctx_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = _conn_ctx_cleanup;
+    ngx_memzero(cln->data, sizeof(ngx_http_waf_conn_ctx_t));
+
+    return cln->data;
+}
+
+
+static void _conn_ctx_cleanup(void* data) {
+    (void)data;
+}
+
+
+static ngx_int_t _ip_trie_find_cached(ip_verdict_t* verdict, ip_trie_t* trie, inx_addr_t* inx_addr, u_char** out_detail) {
+    /* 
+     * 规则只会在 reload 时改变，而旧的连接仍然使用旧的配置，所以只需要比较规则和地址。
+     * 同一个连接上的请求可能位于不同的 location，它们的规则不一定相同。
+    */
+    if (verdict != NULL 
+        && verdict->rules == trie
+        && ngx_memcmp(&(verdict->inx_addr), inx_addr, sizeof(inx_addr_t)) == 0) {
+        *out_detail = verdict->detail;
+        return verdict->is_matched;
+    }
+
+    ngx_int_t is_matched = NGX_HTTP_WAF_NOT_MATCHED;
+    ip_trie_node_t* ip_trie_node = NULL;
+    if (ip_trie_find(trie, inx_addr, &ip_trie_node) == NGX_HTTP_WAF_SUCCESS) {
+        is_matched = NGX_HTTP_WAF_MATCHED;
+        *out_detail = ip_trie_node->data;
+    }
+
+    if (verdict != NULL) {
+        verdict->rules = trie;
+        ngx_memcpy(&(verdict->inx_addr), inx_addr, sizeof(inx_addr_t));
+        verdict->is_matched = is_matched;
+        verdict->detail = *out_detail;
+    }
+
+    return is_matched;
+}
+
+
+static ngx_int_t _make_cc_key(ngx_http_request_t* r, ngx_http_waf_loc_conf_t* loc_conf, 
+                              ngx_int_t ip_type, inx_addr_t* inx_addr) {
+    /* 同一个网段内的地址共用一个计数器，轮换地址的攻击者也只占用一个表项。 */
+    size_t prefix = 0, len = 0;
+    if (ip_type == AF_INET) {
+        prefix = (size_t)loc_conf->waf_cc_deny_ipv4_prefix;
+        len = sizeof(struct in_addr);
+    }
+#if (NGX_HAVE_INET6)
+    else if (ip_type == AF_INET6) {
+        prefix = (size_t)loc_conf->waf_cc_deny_ipv6_prefix;
+        len = sizeof(struct in6_addr);
+    }
+#endif
+
+    u_char* bytes = (u_char*)inx_addr;
+    if (prefix < len * 8) {
+        if (prefix % 8 != 0) {
+            bytes[prefix / 8] &= (u_char)(0xff << (8 - prefix % 8));
+            prefix += 8 - prefix % 8;
+        }
+        ngx_memzero(bytes + prefix / 8, len - prefix / 8);
+    }
+
+    if (loc_conf->waf_cc_deny_key == NULL) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    /* 
+     * 自定义关键字的长度不固定，所以和截断之后的地址一起取 SipHash 指纹，
+     * 指纹放在关键字的开头，其余部分填零，以便继续使用定长的统计表。
+    */
+    ngx_str_t value;
+    if (ngx_http_complex_value(r, loc_conf->waf_cc_deny_key, &value) != NGX_OK) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    u_char* buf = ngx_pnalloc(r->pool, sizeof(inx_addr_t) + value.len);
+    if (buf == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+    ngx_memcpy(buf, inx_addr, sizeof(inx_addr_t));
+    ngx_memcpy(buf + sizeof(inx_addr_t), value.data, value.len);
+
+    ngx_http_waf_main_conf_t* main_conf = ngx_http_get_module_main_conf(r, ngx_http_waf_module);
+    uint64_t fingerprint = 0;
+    crypto_shorthash((u_char*)&fingerprint, buf, sizeof(inx_addr_t) + value.len, main_conf->cache_fingerprint_key);
+
+    ngx_memzero(inx_addr, sizeof(inx_addr_t));
+    ngx_memcpy(inx_addr, &fingerprint, ngx_min(sizeof(fingerprint), sizeof(inx_addr_t)));
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+static cc_shard_t* _get_cc_shard(ngx_http_waf_loc_conf_t* loc_conf, inx_addr_t* inx_addr) {
+    /* 分片与统计表内部使用不同的哈希函数，以免同一个分片中的地址聚集在一起。 */
+    return loc_conf->cc_shards + ngx_crc32_short((u_char*)inx_addr, sizeof(inx_addr_t)) % NGX_HTTP_WAF_CC_SHARD_NUM;
+}
+
+
+void ngx_http_waf_flush_cc_local(ngx_http_waf_loc_conf_t* loc_conf) {
+    if (loc_conf->cc_local_statistics == NULL || loc_conf->cc_shards == NULL) {
+        return;
+    }
+
+    lru_cache_foreach(loc_conf->cc_local_statistics, _flush_cc_local, loc_conf);
+}
+
+
+static void _flush_cc_local(void* key, size_t key_len, void* data, void* ctx) {
+    ngx_http_waf_loc_conf_t* loc_conf = ctx;
+    cc_local_statis_t* local = data;
+    time_t now = time(NULL);
+
+    /* 仍在访问的地址会在下一次请求时自己同步 */
+    if (local->synced_time == 0 
+        || difftime(now, local->synced_time) < NGX_HTTP_WAF_CC_LOCAL_INTERVAL
+        || (local->pending == 0 && local->granted == 0)) {
+        return;
+    }
+
+    cc_shard_t* shard = _get_cc_shard(loc_conf, (inx_addr_t*)key);
+    ngx_shmtx_lock(&shard->mutex);
+
+    /* 统计周期已经重新开始时，累积的次数和预留的余量都随着之前的周期一起作废。 */
+    lru_cache_find_result_t tmp = lru_cache_find(shard->statistics, key, key_len);
+    if (tmp.status == NGX_HTTP_WAF_KEY_EXISTS) {
+        ip_statis_t* statis = *(tmp.data);
+        if (statis->record_time == local->shared.record_time) {
+            statis->count += local->pending;
+            statis->reserved = ngx_max(statis->reserved - local->granted, 0);
+        }
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    /* 下一次请求时重新同步 */
+    local->pending = 0;
+    local->granted = 0;
+    local->synced_time = 0;
+}
+
+
+static ngx_int_t _check_cc_gcra(ngx_http_request_t* r, ngx_http_waf_loc_conf_t* loc_conf, 
+                                inx_addr_t* inx_addr, ngx_int_t* out_http_status) {
+    ngx_http_waf_ctx_t* ctx = NULL;
+    ngx_http_waf_get_ctx_and_conf(r, NULL, &ctx);
+
+    /* 
+     * 每个请求占用 interval 微秒，理论到达时间每次向后推移 interval，
+     * 请求最多可以比理论到达时间提前 tolerance 微秒，即容许 burst 个突发请求。
+    */
+    uint64_t interval = (uint64_t)loc_conf->waf_cc_deny_period * 1000 / loc_conf->waf_cc_deny_limit;
+    interval = ngx_max(interval, 1);
+    uint64_t tolerance = interval * loc_conf->waf_cc_deny_burst;
+    uint64_t now = (uint64_t)ngx_current_msec * 1000;
+    uint64_t wait = 0;
+    ngx_int_t ret_value = NGX_HTTP_WAF_NOT_MATCHED;
+
+    cc_shard_t* shard = _get_cc_shard(loc_conf, inx_addr);
+    ngx_shmtx_lock(&shard->mutex);
+
+    cc_gcra_t* state = NULL;
+    lru_cache_find_result_t tmp0 = lru_cache_find(shard->statistics, inx_addr, sizeof(inx_addr_t));
+    if (tmp0.status == NGX_HTTP_WAF_KEY_EXISTS) {
+        state = *(tmp0.data);
+    } else {
+        lru_cache_add_result_t tmp1 = lru_cache_add(shard->statistics, inx_addr, sizeof(inx_addr_t));
+        if (tmp1.status != NGX_HTTP_WAF_SUCCESS) {
+            ngx_shmtx_unlock(&shard->mutex);
+            *out_http_status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            return NGX_HTTP_WAF_MATCHED;
+        }
+        state = *(tmp1.data);
+        state->tat = now;
+    }
+
+    uint64_t tat = ngx_max(state->tat, now);
+    if (tat - now > tolerance) {
+        wait = tat - now - tolerance;
+        ret_value = NGX_HTTP_WAF_MATCHED;
+    } else {
+        state->tat = tat + interval;
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    if (ret_value == NGX_HTTP_WAF_MATCHED) {
+        ctx->blocked = NGX_HTTP_WAF_TRUE;
+        strcpy((char*)ctx->rule_type, "CC-DENY");
+        strcpy((char*)ctx->rule_deatils, "");
+        *out_http_status = loc_conf->waf_http_status_cc;
+
+        if (loc_conf->waf_http_status_cc != NGX_HTTP_CLOSE) {
+            _set_retry_after(r, (time_t)((wait + 999999) / 1000000));
+        }
+    }
+
+    return ret_value;
+}
+
+
+static ngx_int_t _check_cc_token_bucket(ngx_http_request_t* r, ngx_http_waf_loc_conf_t* loc_conf, 
+                                        inx_addr_t* inx_addr, ngx_int_t* out_http_status) {
+    ngx_http_waf_ctx_t* ctx = NULL;
+    ngx_http_waf_get_ctx_and_conf(r, NULL, &ctx);
+
+    token_bucket_set_t* set = loc_conf->cc_token_buckets;
+    uint64_t now = (uint64_t)ngx_current_msec * 1000;
+    time_t remain = 0;
+    ngx_int_t ret_value = NGX_HTTP_WAF_NOT_MATCHED;
+
+    cc_shard_t* shard = _get_cc_shard(loc_conf, inx_addr);
+    ngx_shmtx_lock(&shard->mutex);
+
+    token_bucket_t* bucket = NULL;
+    lru_cache_find_result_t tmp0 = lru_cache_find(shard->statistics, inx_addr, sizeof(inx_addr_t));
+    if (tmp0.status == NGX_HTTP_WAF_KEY_EXISTS) {
+        bucket = *(tmp0.data);
+    } else {
+        lru_cache_add_result_t tmp1 = lru_cache_add(shard->statistics, inx_addr, sizeof(inx_addr_t));
+        if (tmp1.status != NGX_HTTP_WAF_SUCCESS) {
+            ngx_shmtx_unlock(&shard->mutex);
+            *out_http_status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            return NGX_HTTP_WAF_MATCHED;
+        }
+        bucket = *(tmp1.data);
+        bucket->count = set->init_count;
+        bucket->is_ban = NGX_HTTP_WAF_FALSE;
+        bucket->last_ban_time = 0;
+        bucket->last_put = now;
+    }
+
+    /* 封禁结束之后令牌桶重新装满 */
+    if (bucket->is_ban == NGX_HTTP_WAF_TRUE) {
+        time_t diff = ngx_time() - bucket->last_ban_time;
+        if (diff < (time_t)set->ban_duration) {
+            remain = (time_t)set->ban_duration - diff;
+            ret_value = NGX_HTTP_WAF_MATCHED;
+            goto unlock;
+        }
+
+        bucket->is_ban = NGX_HTTP_WAF_FALSE;
+        bucket->count = set->init_count;
+        bucket->last_put = now;
+    }
+
+    /* 不需要定时向所有的令牌桶中添加令牌，访问令牌桶时按照经过的时间一次补齐。 */
+    if (now > bucket->last_put) {
+        uint64_t put = (now - bucket->last_put) / set->put_interval;
+        if (bucket->count + put >= set->init_count) {
+            bucket->count = set->init_count;
+            bucket->last_put = now;
+        } else {
+            bucket->count += (ngx_uint_t)put;
+            bucket->last_put += put * set->put_interval;
+        }
+    }
+
+    if (bucket->count == 0) {
+        bucket->is_ban = NGX_HTTP_WAF_TRUE;
+        bucket->last_ban_time = ngx_time();
+        remain = (time_t)set->ban_duration;
+        ret_value = NGX_HTTP_WAF_MATCHED;
+    } else {
+        --(bucket->count);
+    }
+
+    unlock:
+    ngx_shmtx_unlock(&shard->mutex);
+
+    if (ret_value == NGX_HTTP_WAF_MATCHED) {
+        ctx->blocked = NGX_HTTP_WAF_TRUE;
+        strcpy((char*)ctx->rule_type, "CC-DENY");
+        strcpy((char*)ctx->rule_deatils, "");
+        *out_http_status = loc_conf->waf_http_status_cc;
+
+        if (loc_conf->waf_http_status_cc != NGX_HTTP_CLOSE) {
+            _set_retry_after(r, remain);
+        }
+    }
+
+    return ret_value;
+}
+
+
+static void _set_retry_after(ngx_http_request_t* r, time_t remain) {
+    ngx_table_elt_t* header = (ngx_table_elt_t*)ngx_list_push(&(r->headers_out.headers));
+    if (header == NULL) {
+        return;
+    }
+
+    /* 如果 hash 字段为 0 则会在遍历 HTTP 头的时候被忽略 */
+    header->hash = 1;
+    ngx_str_set(&header->key, "Retry-After");
+    header->value.data = ngx_palloc(r->pool, NGX_TIME_T_LEN + 1);
+    if (header->value.data == NULL) {
+        return;
+    }
+
+    #if (NGX_TIME_T_SIZE == 4)
+        header->value.len = sprintf((char*)header->value.data, "%d", (int)remain);
+    #elif (NGX_TIME_T_SIZE == 8)
+        header->value.len = sprintf((char*)header->value.data, "%lld", (long long)remain);
+    #else
+        #error The size of time_t is unexpected
+    #endif
+}
@@ -8,6 +8,13 @@ extern FILE* ngx_http_waf_in;
 static void _cleanup_lru_cache(void* data);
 
 
+/**
+ * @brief 将二级检查缓存接到每个配置的各个检查缓存上
+ * @param[in] confs 使用同一块共享内存的配置，元素类型为 ngx_http_waf_loc_conf_t*
+*/
+static void _set_shared_inspection_cache(ngx_array_t* confs, lru_cache_t* shared);
+
+
 char* ngx_http_waf_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
     if (ngx_conf_set_flag_slot(cf, cmd, conf) != NGX_CONF_OK) {
         return NGX_CONF_ERROR;
@@ -101,6 +108,7 @@ char* ngx_http_waf_mode_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
         ngx_http_waf_parse_mode("LIB-INJECTION", "!LIB-INJECTION", NGX_HTTP_WAF_MODE_LIB_INJECTION);
         ngx_http_waf_parse_mode("LIB-INJECTION-SQLI", "!LIB-INJECTION-SQLI", NGX_HTTP_WAF_MODE_LIB_INJECTION_SQLI);
         ngx_http_waf_parse_mode("LIB-INJECTION-XSS", "!LIB-INJECTION-XSS", NGX_HTTP_WAF_MODE_LIB_INJECTION_XSS);
+        ngx_http_waf_parse_mode("MULTI-REGEX", "!MULTI-REGEX", NGX_HTTP_WAF_MODE_MULTI_REGEX);
 
         #undef ngx_http_waf_parse_mode
 
@@ -119,10 +127,39 @@ char* ngx_http_waf_cc_deny_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
 
     /* 默认封禁 60 分钟 */
     loc_conf->waf_cc_deny_duration = 1 * 60 * 60;
+    loc_conf->waf_cc_deny_mode = NGX_HTTP_WAF_CC_MODE_FIXED;
+    loc_conf->waf_cc_deny_period = 60 * 1000;
+    loc_conf->waf_cc_deny_burst = 0;
+    loc_conf->waf_cc_deny_ipv4_prefix = 32;
+    loc_conf->waf_cc_deny_ipv6_prefix = 128;
+    loc_conf->waf_cc_deny_key = NULL;
+    ngx_int_t has_duration = NGX_HTTP_WAF_FALSE;
+    ngx_int_t has_burst = NGX_HTTP_WAF_FALSE;
     /* 设置默认的共享内存大小 */
     loc_conf->waf_cc_deny_shm_zone_size = NGX_HTTP_WAF_SHARE_MEMORY_CC_DENY_MIN_SIZE;
 
     for (size_t i = 1; i < cf->args->nelts; i++) {
+        /* 自定义关键字中可能含有等号，所以单独处理。 */
+        if (p_str[i].len > 4 && ngx_strncmp(p_str[i].data, "key=", 4) == 0) {
+            ngx_http_compile_complex_value_t ccv;
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+            ngx_str_t value = { p_str[i].len - 4, p_str[i].data + 4 };
+
+            loc_conf->waf_cc_deny_key = ngx_pcalloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if (loc_conf->waf_cc_deny_key == NULL) {
+                goto error;
+            }
+
+            ccv.cf = cf;
+            ccv.value = &value;
+            ccv.complex_value = loc_conf->waf_cc_deny_key;
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                goto error;
+            }
+
+            continue;
+        }
+
         UT_array* array = NULL;
         if (ngx_http_waf_str_split(p_str + i, '=', 256, &array) != NGX_HTTP_WAF_SUCCESS) {
             goto error;
@@ -158,7 +195,14 @@ char* ngx_http_waf_cc_deny_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
             }
 
             q = (ngx_str_t*)utarray_next(temp, q);
-            if (q->data[0] != 'm' || q->len != 1) {
+            if (q->len != 1) {
+                goto error;
+            }
+            if (q->data[0] == 'm') {
+                loc_conf->waf_cc_deny_period = 60 * 1000;
+            } else if (q->data[0] == 's') {
+                loc_conf->waf_cc_deny_period = 1000;
+            } else {
                 goto error;
             }
 
@@ -170,6 +214,41 @@ char* ngx_http_waf_cc_deny_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
             if (loc_conf->waf_cc_deny_duration == NGX_ERROR) {
                 goto error;
             }
+            has_duration = NGX_HTTP_WAF_TRUE;
+
+        } else if (ngx_strcmp("mode", p->data) == 0) {
+            p = (ngx_str_t*)utarray_next(array, p);
+            if (ngx_strcmp("fixed", p->data) == 0) {
+                loc_conf->waf_cc_deny_mode = NGX_HTTP_WAF_CC_MODE_FIXED;
+            } else if (ngx_strcmp("gcra", p->data) == 0) {
+                loc_conf->waf_cc_deny_mode = NGX_HTTP_WAF_CC_MODE_GCRA;
+            } else if (ngx_strcmp("token_bucket", p->data) == 0) {
+                loc_conf->waf_cc_deny_mode = NGX_HTTP_WAF_CC_MODE_TOKEN_BUCKET;
+            } else {
+                goto error;
+            }
+
+        } else if (ngx_strcmp("burst", p->data) == 0) {
+            p = (ngx_str_t*)utarray_next(array, p);
+            loc_conf->waf_cc_deny_burst = ngx_atoi(p->data, p->len);
+            if (loc_conf->waf_cc_deny_burst == NGX_ERROR) {
+                goto error;
+            }
+            has_burst = NGX_HTTP_WAF_TRUE;
+
+        } else if (ngx_strcmp("ipv4_prefix", p->data) == 0) {
+            p = (ngx_str_t*)utarray_next(array, p);
+            loc_conf->waf_cc_deny_ipv4_prefix = ngx_atoi(p->data, p->len);
+            if (loc_conf->waf_cc_deny_ipv4_prefix == NGX_ERROR || loc_conf->waf_cc_deny_ipv4_prefix > 32) {
+                goto error;
+            }
+
+        } else if (ngx_strcmp("ipv6_prefix", p->data) == 0) {
+            p = (ngx_str_t*)utarray_next(array, p);
+            loc_conf->waf_cc_deny_ipv6_prefix = ngx_atoi(p->data, p->len);
+            if (loc_conf->waf_cc_deny_ipv6_prefix == NGX_ERROR || loc_conf->waf_cc_deny_ipv6_prefix > 128) {
+                goto error;
+            }
 
         } else if (ngx_strcmp("size", p->data) == 0) {
             p = (ngx_str_t*)utarray_next(array, p);
@@ -190,6 +269,37 @@ char* ngx_http_waf_cc_deny_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf)
         goto error;
     }
 
+    /* 固定窗口只支持每分钟的频率，GCRA 模式不封禁，所以不能设置封禁时长。 */
+    if (loc_conf->waf_cc_deny_mode == NGX_HTTP_WAF_CC_MODE_FIXED
+        && (loc_conf->waf_cc_deny_period != 60 * 1000 || has_burst == NGX_HTTP_WAF_TRUE)) {
+        goto error;
+    }
+
+    if (loc_conf->waf_cc_deny_mode == NGX_HTTP_WAF_CC_MODE_GCRA && has_duration == NGX_HTTP_WAF_TRUE) {
+        goto error;
+    }
+
+    /* 令牌桶的容量默认为一个时间单位内允许的请求数，每隔 period / limit 补充一个令牌。 */
+    if (loc_conf->waf_cc_deny_mode == NGX_HTTP_WAF_CC_MODE_TOKEN_BUCKET) {
+        token_bucket_set_t* set = ngx_pcalloc(cf->pool, sizeof(token_bucket_set_t));
+        if (set == NULL) {
+            goto error;
+        }
+
+        set->ban_duration = (ngx_uint_t)loc_conf->waf_cc_deny_duration;
+        set->init_count = (ngx_uint_t)loc_conf->waf_cc_deny_limit;
+        if (has_burst == NGX_HTTP_WAF_TRUE) {
+            set->init_count = (ngx_uint_t)loc_conf->waf_cc_deny_burst;
+        }
+        if (set->init_count == 0) {
+            goto error;
+        }
+
+        set->put_interval = (uint64_t)loc_conf->waf_cc_deny_period * 1000 / loc_conf->waf_cc_deny_limit;
+        set->put_interval = ngx_max(set->put_interval, 1);
+        loc_conf->cc_token_buckets = set;
+    }
+
     if (ngx_http_waf_init_cc_shm(cf, loc_conf) != NGX_HTTP_WAF_SUCCESS) {
         goto error;
     }
@@ -228,6 +338,41 @@ char* ngx_http_waf_cache_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
                 goto error;
             }
 
+        } else if (ngx_strcmp("size", p->data) == 0) {
+            p = (ngx_str_t*)utarray_next(array, p);
+            loc_conf->waf_inspection_cache_size = ngx_http_waf_parse_size(p->data);
+            if (loc_conf->waf_inspection_cache_size == NGX_ERROR
+                || loc_conf->waf_inspection_cache_size <= 0) {
+                goto error;
+            }
+
+        } else if (ngx_strcmp("max_body", p->data) == 0) {
+            p = (ngx_str_t*)utarray_next(array, p);
+            loc_conf->waf_inspection_max_body = ngx_http_waf_parse_size(p->data);
+            if (loc_conf->waf_inspection_max_body == NGX_ERROR
+                || loc_conf->waf_inspection_max_body <= 0) {
+                goto error;
+            }
+
+        } else if (ngx_strcmp("verdict", p->data) == 0) {
+            p = (ngx_str_t*)utarray_next(array, p);
+            if (ngx_strcmp("on", p->data) == 0) {
+                loc_conf->waf_inspection_verdict = 1;
+            } else if (ngx_strcmp("off", p->data) == 0) {
+                loc_conf->waf_inspection_verdict = 0;
+            } else {
+                goto error;
+            }
+
+        } else if (ngx_strcmp("shared", p->data) == 0) {
+            p = (ngx_str_t*)utarray_next(array, p);
+            loc_conf->waf_inspection_shm_zone_size = ngx_http_waf_parse_size(p->data);
+            if (loc_conf->waf_inspection_shm_zone_size == NGX_ERROR) {
+                goto error;
+            }
+            loc_conf->waf_inspection_shm_zone_size = ngx_max(NGX_HTTP_WAF_SHARE_MEMORY_INSPECTION_CACHE_MIN_SIZE, 
+                                                             loc_conf->waf_inspection_shm_zone_size);
+
         } else if (ngx_strcmp("interval", p->data) == 0) {
             ngx_conf_log_error(NGX_LOG_WARN, cf, NGX_EINVAL, 
                 "Since v6.0.1, the parameter 'interval' is deprecated and it is recommended that you remove this parameter.");
@@ -242,6 +387,18 @@ char* ngx_http_waf_cache_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
         utarray_free(array);
     }
 
+    /* capacity 和 size 只能设置一个 */
+    if (loc_conf->waf_inspection_cache_size != NGX_CONF_UNSET) {
+        if (loc_conf->waf_inspection_capacity != NGX_CONF_UNSET) {
+            goto error;
+        }
+
+        loc_conf->waf_inspection_capacity = lru_cache_clock_capacity(loc_conf->waf_inspection_cache_size, 
+                                                                     sizeof(inspection_cache_key_t), 
+                                                                     sizeof(cached_check_result_t));
+        loc_conf->waf_inspection_capacity = ngx_max(NGX_HTTP_WAF_CACHE_ITEM_MIN_NUM, loc_conf->waf_inspection_capacity);
+    }
+
     if (loc_conf->waf_inspection_capacity == NGX_CONF_UNSET) {
         goto error;
     }
@@ -250,6 +407,11 @@ char* ngx_http_waf_cache_conf(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
         goto error;
     }
 
+    if (loc_conf->waf_inspection_shm_zone_size != NGX_CONF_UNSET
+        && ngx_http_waf_init_inspection_cache_shm(cf, loc_conf) != NGX_HTTP_WAF_SUCCESS) {
+        goto error;
+    }
+
     return NGX_CONF_OK;
 
     error:
@@ -431,8 +593,23 @@ void* ngx_http_waf_create_main_conf(ngx_conf_t* cf) {
     }
 
     main_conf->local_caches = ngx_array_create(cf->pool, 20, sizeof(lru_cache_t*));
+    main_conf->regex_sets = ngx_array_create(cf->pool, 20, sizeof(regex_set_t*));
+    main_conf->cc_local_confs = ngx_array_create(cf->pool, 5, sizeof(ngx_http_waf_loc_conf_t*));
+    main_conf->waf_regex_jit = NGX_CONF_UNSET;
+
+    /* 
+     * 在 master 进程中生成，所有 worker 使用同一个密钥，这样才能共用二级检查缓存。
+     * 同一个 master 进程在 reload 之后继续使用之前的密钥，这样共享内存中的二级缓存在 reload 之后仍然可用。
+    */
+    static u_char cache_fingerprint_key[NGX_HTTP_WAF_CACHE_FINGERPRINT_KEY_LEN];
+    static ngx_int_t has_cache_fingerprint_key = NGX_HTTP_WAF_FALSE;
+    if (has_cache_fingerprint_key == NGX_HTTP_WAF_FALSE) {
+        crypto_shorthash_keygen(cache_fingerprint_key);
+        has_cache_fingerprint_key = NGX_HTTP_WAF_TRUE;
+    }
+    ngx_memcpy(main_conf->cache_fingerprint_key, cache_fingerprint_key, sizeof(cache_fingerprint_key));
 
-    if (main_conf->local_caches == NULL) {
+    if (main_conf->local_caches == NULL || main_conf->regex_sets == NULL || main_conf->cc_local_confs == NULL) {
         return NULL;
     }
 
@@ -476,6 +653,9 @@ char* ngx_http_waf_merge_loc_conf(ngx_conf_t *cf, void *prev, void *conf) {
         child->black_cookie = parent->black_cookie;
         child->black_referer = parent->black_referer;
         child->advanced_rule = parent->advanced_rule;
+        child->advanced_index = parent->advanced_index;
+        child->advanced_inputs = parent->advanced_inputs;
+        child->advanced_generation = parent->advanced_generation;
     }
     
 
@@ -497,6 +677,7 @@ char* ngx_http_waf_merge_loc_conf(ngx_conf_t *cf, void *prev, void *conf) {
     ngx_int_t tmp1 = child->waf_inspection_capacity;
     ngx_conf_merge_value(child->waf_inspection_capacity, parent->waf_inspection_capacity, NGX_CONF_UNSET);
     if (tmp1 == NGX_CONF_UNSET && child->waf_inspection_capacity != NGX_CONF_UNSET) {
+        child->waf_inspection_cache_size = parent->waf_inspection_cache_size;
         child->black_url_inspection_cache = parent->black_url_inspection_cache;
         child->black_args_inspection_cache = parent->black_args_inspection_cache;
         child->black_ua_inspection_cache = parent->black_ua_inspection_cache;
@@ -504,6 +685,11 @@ char* ngx_http_waf_merge_loc_conf(ngx_conf_t *cf, void *prev, void *conf) {
         child->black_cookie_inspection_cache = parent->black_cookie_inspection_cache;
         child->white_url_inspection_cache = parent->white_url_inspection_cache;
         child->white_referer_inspection_cache = parent->white_referer_inspection_cache;
+        child->black_post_inspection_cache = parent->black_post_inspection_cache;
+        child->advanced_inspection_cache = parent->advanced_inspection_cache;
+        child->request_verdict_cache = parent->request_verdict_cache;
+        child->waf_inspection_verdict = parent->waf_inspection_verdict;
+        child->waf_inspection_max_body = parent->waf_inspection_max_body;
     }
 
     if (parent->is_custom_priority == NGX_HTTP_WAF_TRUE
@@ -722,6 +908,65 @@ ngx_int_t ngx_http_waf_spend_handler(ngx_http_request_t* r, ngx_http_variable_va
 }
 
 
+ngx_int_t ngx_http_waf_cache_occupancy_handler(ngx_http_request_t* r, ngx_http_variable_value_t* v, uintptr_t data) {
+    ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
+            "ngx_waf_debug: Start the variable calculation process (waf_cache_occupancy).");
+
+    ngx_http_waf_loc_conf_t* loc_conf = NULL;
+    ngx_http_waf_get_ctx_and_conf(r, &loc_conf, NULL);
+
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+
+    if (loc_conf->waf_inspection_capacity == NGX_CONF_UNSET || loc_conf->black_url_inspection_cache == NULL) {
+        v->len = 0;
+        v->data = NULL;
+        ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
+            "ngx_waf_debug: No cache.");
+    }
+    else {
+        /* 下标与 ngx_http_waf_inspection_types 一致 */
+        lru_cache_t* caches[NGX_HTTP_WAF_INSPECTION_TYPE_NUM] = {
+            loc_conf->white_url_inspection_cache,
+            loc_conf->black_url_inspection_cache,
+            loc_conf->black_args_inspection_cache,
+            loc_conf->black_ua_inspection_cache,
+            loc_conf->white_referer_inspection_cache,
+            loc_conf->black_referer_inspection_cache,
+            loc_conf->black_cookie_inspection_cache,
+            loc_conf->black_post_inspection_cache
+        };
+
+        size_t len = 512;
+        u_char* buf = ngx_pnalloc(r->pool, sizeof(u_char) * len);
+        u_char* last = buf;
+
+        for (ngx_uint_t i = 0; buf != NULL && i < NGX_HTTP_WAF_INSPECTION_TYPE_NUM; i++) {
+            size_t count = 0;
+            if (caches[i] != NULL) {
+                count = caches[i]->clock != NULL ? lru_cache_tag_count(caches[i], i) : HASH_COUNT(caches[i]->hash_head);
+            }
+            last = ngx_snprintf(last, buf + len - last, "%s%s=%uz", 
+                                i == 0 ? "" : ",", ngx_http_waf_inspection_types[i], count);
+        }
+
+        /* 所有 worker 共用的二级缓存只读取命中次数，不加锁，允许读到稍旧的值。 */
+        lru_cache_t* shared = loc_conf->black_url_inspection_cache->shared;
+        if (buf != NULL && shared != NULL) {
+            last = ngx_snprintf(last, buf + len - last, ",SHARED-HITS=%uz", shared->shared_hits);
+        }
+
+        v->data = buf;
+        v->len = buf == NULL ? 0 : last - buf;
+    }
+
+    ngx_log_debug(NGX_LOG_DEBUG_CORE, r->connection->log, 0, 
+            "ngx_waf_debug: The variable calculation process is fully completed (waf_cache_occupancy).");
+    return NGX_OK;
+}
+
+
 ngx_int_t ngx_http_waf_init_after_load_config(ngx_conf_t* cf) {
     ngx_http_handler_pt* h;
     ngx_http_core_main_conf_t* cmcf;
@@ -763,6 +1008,42 @@ ngx_int_t ngx_http_waf_init_after_load_config(ngx_conf_t* cf) {
     waf_spend->get_handler = ngx_http_waf_spend_handler;
     waf_spend->set_handler = NULL;
 
+    ngx_str_t waf_cache_occupancy_name = ngx_string("waf_cache_occupancy");
+    ngx_http_variable_t* waf_cache_occupancy = ngx_http_add_variable(cf, &waf_cache_occupancy_name, NGX_HTTP_VAR_NOCACHEABLE);
+    waf_cache_occupancy->get_handler = ngx_http_waf_cache_occupancy_handler;
+    waf_cache_occupancy->set_handler = NULL;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t ngx_http_waf_init_module(ngx_cycle_t* cycle) {
+    ngx_http_waf_main_conf_t* main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_waf_module);
+
+    if (main_conf == NULL || main_conf->waf_regex_jit != 1) {
+        return NGX_OK;
+    }
+
+    /* nginx 在 init module 阶段才会 study 所有的正则表达式，在此之前编译的 JIT 代码会被覆盖。 */
+    regex_set_t** sets = main_conf->regex_sets->elts;
+    for (ngx_uint_t i = 0; i < main_conf->regex_sets->nelts; i++) {
+        regex_set_t* set = sets[i];
+        ngx_uint_t count = 0;
+
+        if (set->rules->nelts == 0) {
+            continue;
+        }
+
+        if (regex_set_jit_compile(set, cycle->log, &count) != NGX_HTTP_WAF_SUCCESS) {
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0, 
+                "ngx_waf: waf_regex_jit is ignored because PCRE is built without JIT support.");
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, 
+            "ngx_waf: In %s, %ui of %ui regexes are JIT-compiled.", set->name, count, set->rules->nelts);
+    }
+
     return NGX_OK;
 }
 
@@ -771,12 +1052,109 @@ ngx_int_t ngx_http_waf_shm_zone_cc_deny_init(ngx_shm_zone_t *zone, void *data) {
     ngx_slab_pool_t  *shpool = (ngx_slab_pool_t *) zone->shm.addr;
     ngx_http_waf_loc_conf_t* loc_conf = (ngx_http_waf_loc_conf_t*)(zone->data);
 
-    lru_cache_init(&loc_conf->ip_access_statistics, SIZE_MAX, slab_pool, shpool);
+    /* 
+     * 统计表按照客户端地址分成若干个分片，每个分片有各自的互斥锁，
+     * 各个 worker 同时检查不同的地址时很少会争用同一把锁。
+    */
+    cc_shard_t* shards = ngx_slab_calloc(shpool, sizeof(cc_shard_t) * NGX_HTTP_WAF_CC_SHARD_NUM);
+    if (shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* 
+     * 统计表的槽位在这里一次分配，之后每次请求都不再分配共享内存，所以也不需要 slab 的互斥锁。
+     * 剩下的四分之一留给 slab 的页描述符等管理结构。
+    */
+    size_t data_size = sizeof(ip_statis_t);
+    if (loc_conf->waf_cc_deny_mode == NGX_HTTP_WAF_CC_MODE_GCRA) {
+        data_size = sizeof(cc_gcra_t);
+    } else if (loc_conf->waf_cc_deny_mode == NGX_HTTP_WAF_CC_MODE_TOKEN_BUCKET) {
+        data_size = sizeof(token_bucket_t);
+    }
+
+    size_t capacity = lru_cache_clock_capacity(zone->shm.size / 4 * 3 / NGX_HTTP_WAF_CC_SHARD_NUM, 
+                                               sizeof(inx_addr_t), data_size);
+    for (size_t i = 0; i < NGX_HTTP_WAF_CC_SHARD_NUM; i++) {
+        if (ngx_shmtx_create(&shards[i].mutex, &shards[i].lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (lru_cache_init_clock(&shards[i].statistics, capacity, 
+                                 sizeof(inx_addr_t), data_size, 
+                                 slab_pool, shpool) != NGX_HTTP_WAF_SUCCESS) {
+            return NGX_ERROR;
+        }
+    }
+
+    loc_conf->cc_shards = shards;
 
     return NGX_OK;
 }
 
 
+ngx_int_t ngx_http_waf_shm_zone_inspection_cache_init(ngx_shm_zone_t *zone, void *data) {
+    ngx_slab_pool_t  *shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    ngx_array_t* confs = zone->data;
+
+    /* 
+     * 在 master 进程中 fork 之前执行，所以每个 worker 的一级缓存都指向同一个二级缓存。
+     * 关键字和检查结果都是定长的，所以二级缓存使用定长槽位，所有的检查项目共用四分之三的共享内存。
+    */
+    lru_cache_t* shared = NULL;
+
+    /* 
+     * reload 时 nginx 会沿用名称和大小都没有变化的共享内存，此时 data 是旧的配置，
+     * 直接沿用旧的二级缓存，由旧的规则产生的缓存项会在查找时因为规则的代数不同而被替换，
+     * 检查模式变化之后关键字也会不同，旧的缓存项不会再被命中，之后会被逐渐淘汰。
+    */
+    if (data != NULL) {
+        ngx_array_t* old_confs = data;
+        ngx_http_waf_loc_conf_t* old_loc_conf = ((ngx_http_waf_loc_conf_t**)(old_confs->elts))[0];
+        if (old_loc_conf->black_url_inspection_cache != NULL 
+            && old_loc_conf->black_url_inspection_cache->shared != NULL) {
+            shared = old_loc_conf->black_url_inspection_cache->shared;
+            _set_shared_inspection_cache(confs, shared);
+            return NGX_OK;
+        }
+    }
+
+    size_t capacity = lru_cache_clock_capacity(zone->shm.size / 4 * 3, 
+                                               sizeof(inspection_cache_key_t), sizeof(cached_check_result_t));
+    if (lru_cache_init_clock(&shared, capacity, 
+                             sizeof(inspection_cache_key_t), sizeof(cached_check_result_t), 
+                             slab_pool, shpool) != NGX_HTTP_WAF_SUCCESS) {
+        return NGX_ERROR;
+    }
+
+    _set_shared_inspection_cache(confs, shared);
+
+    return NGX_OK;
+}
+
+
+static void _set_shared_inspection_cache(ngx_array_t* confs, lru_cache_t* shared) {
+    ngx_http_waf_loc_conf_t** elts = confs->elts;
+
+    for (ngx_uint_t i = 0; i < confs->nelts; i++) {
+        ngx_http_waf_loc_conf_t* loc_conf = elts[i];
+        lru_cache_t* caches[] = {
+            loc_conf->black_url_inspection_cache,
+            loc_conf->black_args_inspection_cache,
+            loc_conf->black_ua_inspection_cache,
+            loc_conf->black_referer_inspection_cache,
+            loc_conf->black_cookie_inspection_cache,
+            loc_conf->white_url_inspection_cache,
+            loc_conf->white_referer_inspection_cache,
+            loc_conf->black_post_inspection_cache
+        };
+
+        for (size_t j = 0; j < sizeof(caches) / sizeof(caches[0]); j++) {
+            caches[j]->shared = shared;
+        }
+    }
+}
+
+
 ngx_int_t load_into_container(ngx_conf_t* cf, const char* file_name, void* container, ngx_int_t mode) {
     FILE* fp = fopen(file_name, "r");
     ngx_int_t line_number = 0;
@@ -791,12 +1169,31 @@ ngx_int_t load_into_container(ngx_conf_t* cf, const char* file_name, void* conta
         if (ngx_http_waf_parse(container, cf->pool) != 0) {
             return NGX_HTTP_WAF_FAIL;
         }
+
+        if (ngx_http_waf_vm_optimize(container, cf->pool) != NGX_HTTP_WAF_SUCCESS) {
+            ngx_conf_log_error(NGX_LOG_ERR, (cf), 0, 
+                "ngx_waf: In %s, failed to optimize the advanced rules.", file_name);
+            return NGX_HTTP_WAF_FAIL;
+        }
+
+        u_char* invalid = NULL;
+        ngx_int_t ret = ngx_http_waf_vm_precompile(container, cf->pool, file_name, &invalid);
+        if (ret != NGX_HTTP_WAF_SUCCESS) {
+            if (ret == NGX_HTTP_WAF_MALLOC_ERROR) {
+                ngx_conf_log_error(NGX_LOG_ERR, (cf), 0, 
+                    "ngx_waf: In %s, the rules cannot be stored because the memory allocation failed.", file_name);
+            } else if (invalid != NULL) {
+                ngx_conf_log_error(NGX_LOG_ERR, (cf), 0, 
+                    "ngx_waf: In %s, [%s] is not a valid regex string, IP address block or readable set file.", file_name, invalid);
+            } else {
+                ngx_conf_log_error(NGX_LOG_ERR, (cf), 0, 
+                    "ngx_waf: In %s, the conditions are nested too deeply.", file_name);
+            }
+            return NGX_HTTP_WAF_FAIL;
+        }
         // print_code(container);
     } else {
         while (fgets(str, NGX_HTTP_WAF_RULE_MAX_LEN - 16, fp) != NULL) {
-            ngx_regex_compile_t   regex_compile;
-            u_char                errstr[NGX_MAX_CONF_ERRSTR];
-            ngx_regex_elt_t* ngx_regex_elt;
             ipv4_t ipv4;
             inx_addr_t inx_addr;
 #if (NGX_HAVE_INET6)
@@ -839,22 +1236,13 @@ ngx_int_t load_into_container(ngx_conf_t* cf, const char* file_name, void* conta
 
             switch (mode) {
             case 0:
-                ngx_memzero(&regex_compile, sizeof(ngx_regex_compile_t));
-                regex_compile.pattern = line;
-                regex_compile.pool = cf->pool;
-                regex_compile.err.len = NGX_MAX_CONF_ERRSTR;
-                regex_compile.err.data = errstr;
-                if (ngx_regex_compile(&regex_compile) != NGX_OK) {
+                if (regex_set_add((regex_set_t*)container, &line, NULL) != NGX_HTTP_WAF_SUCCESS) {
                     char temp[NGX_HTTP_WAF_RULE_MAX_LEN] = { 0 };
                     ngx_http_waf_to_c_str((u_char*)temp, line);
                     ngx_conf_log_error(NGX_LOG_ERR, (cf), 0, 
                         "ngx_waf: In %s:%d, [%s] is not a valid regex string.", file_name, line_number, temp);
                     return NGX_HTTP_WAF_FAIL;
                 }
-                ngx_regex_elt = ngx_array_push((ngx_array_t*)container);
-                ngx_regex_elt->name = ngx_palloc(cf->pool, sizeof(u_char) * NGX_HTTP_WAF_RULE_MAX_LEN);
-                ngx_http_waf_to_c_str(ngx_regex_elt->name, line);
-                ngx_regex_elt->regex = regex_compile.regex;
                 break;
             case 1:
                 if (ngx_http_waf_parse_ipv4(line, &ipv4) != NGX_HTTP_WAF_SUCCESS) {
@@ -900,6 +1288,23 @@ ngx_int_t load_into_container(ngx_conf_t* cf, const char* file_name, void* conta
 #endif
             }
         }
+
+        if (mode == 0) {
+            regex_set_t* set = (regex_set_t*)container;
+            set->name = ngx_pnalloc(cf->pool, ngx_strlen(file_name) + 1);
+            if (set->name == NULL) {
+                ngx_conf_log_error(NGX_LOG_ERR, (cf), 0, 
+                    "ngx_waf: In %s, the rules cannot be stored because the memory allocation failed.", file_name);
+                return NGX_HTTP_WAF_FAIL;
+            }
+            ngx_cpystrn(set->name, (u_char*)file_name, ngx_strlen(file_name) + 1);
+        }
+
+        if (mode == 0 && regex_set_compile((regex_set_t*)container) != NGX_HTTP_WAF_SUCCESS) {
+            ngx_conf_log_error(NGX_LOG_ERR, (cf), 0, 
+                "ngx_waf: In %s, the rules cannot be combined because the memory allocation failed.", file_name);
+            return NGX_HTTP_WAF_FAIL;
+        }
     }
 
     
@@ -931,12 +1336,25 @@ ngx_http_waf_loc_conf_t* ngx_http_waf_init_conf(ngx_conf_t* cf) {
     conf->waf_under_attack_uri.len = NGX_CONF_UNSET_SIZE;
     conf->waf_cc_deny_limit = NGX_CONF_UNSET;
     conf->waf_cc_deny_duration = NGX_CONF_UNSET;
+    conf->waf_cc_deny_mode = NGX_CONF_UNSET;
+    conf->waf_cc_deny_period = NGX_CONF_UNSET;
+    conf->waf_cc_deny_burst = NGX_CONF_UNSET;
+    conf->waf_cc_deny_ipv4_prefix = NGX_CONF_UNSET;
+    conf->waf_cc_deny_ipv6_prefix = NGX_CONF_UNSET;
+    conf->waf_cc_deny_key = NULL;
     conf->waf_cc_deny_shm_zone_size =  NGX_CONF_UNSET;
     conf->waf_inspection_capacity = NGX_CONF_UNSET;
+    conf->waf_inspection_shm_zone_size = NGX_CONF_UNSET;
+    conf->waf_inspection_cache_size = NGX_CONF_UNSET;
+    conf->waf_inspection_max_body = NGX_CONF_UNSET;
+    conf->waf_inspection_verdict = NGX_CONF_UNSET;
     conf->waf_http_status = NGX_CONF_UNSET;
     conf->waf_http_status_cc = NGX_CONF_UNSET;
     conf->shm_zone_cc_deny = NULL;
-    conf->ip_access_statistics = NULL;
+    conf->shm_zone_inspection_cache = NULL;
+    conf->cc_shards = NULL;
+    conf->cc_local_statistics = NULL;
+    conf->cc_token_buckets = NULL;
     conf->is_custom_priority = NGX_HTTP_WAF_FALSE;
 
     conf->check_proc[0] = ngx_http_waf_handler_check_white_ip;
@@ -979,6 +1397,32 @@ ngx_int_t ngx_http_waf_init_cc_shm(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* conf
     conf->shm_zone_cc_deny->init = ngx_http_waf_shm_zone_cc_deny_init;
     conf->shm_zone_cc_deny->data = conf;
 
+    /* GCRA 模式和令牌桶模式的每次请求都要读取最新的状态，所以不在本地累积。 */
+    if (conf->waf_cc_deny_mode != NGX_HTTP_WAF_CC_MODE_FIXED) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    /* 在 master 进程中创建，fork 之后每个 worker 各有一份，用于在本地累积访问次数。 */
+    ngx_http_waf_main_conf_t* main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_waf_module);
+    if (lru_cache_init_clock(&conf->cc_local_statistics, NGX_HTTP_WAF_CC_LOCAL_CAPACITY, 
+                             sizeof(inx_addr_t), sizeof(cc_local_statis_t), 
+                             std, NULL) != NGX_HTTP_WAF_SUCCESS) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    lru_cache_t** p = ngx_array_push(main_conf->local_caches);
+    if (p == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+    *p = conf->cc_local_statistics;
+
+    /* 由定时器将不再访问的地址累积的次数写回共享内存 */
+    ngx_http_waf_loc_conf_t** q = ngx_array_push(main_conf->cc_local_confs);
+    if (q == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+    *q = conf;
+
     return NGX_HTTP_WAF_SUCCESS;
 }
 
@@ -993,9 +1437,60 @@ ngx_int_t ngx_http_waf_init_lru_cache(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* c
     conf->black_cookie_inspection_cache = NULL;
     conf->white_url_inspection_cache = NULL;
     conf->white_referer_inspection_cache = NULL;
+    conf->black_post_inspection_cache = NULL;
+    conf->advanced_inspection_cache = NULL;
 
     lru_cache_t** p = NULL;
 
+    /* 高级规则的缓存的关键字是规则读取的所有字段的指纹，和执行结果一样是定长的。 */
+    if (lru_cache_init_clock(&conf->advanced_inspection_cache, conf->waf_inspection_capacity, 
+                             sizeof(uint64_t), sizeof(vm_verdict_t), 
+                             std, NULL) != NGX_HTTP_WAF_SUCCESS) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    p = ngx_array_push(main_conf->local_caches);
+    *p = conf->advanced_inspection_cache;
+
+    /* 整个请求的检查结果中包含变长的规则内容，所以使用链表实现的缓存。 */
+    conf->request_verdict_cache = NULL;
+    if (conf->waf_inspection_verdict == 1) {
+        lru_cache_init(&conf->request_verdict_cache, conf->waf_inspection_capacity, std, NULL);
+        if (lru_cache_enable_admission(conf->request_verdict_cache) != NGX_HTTP_WAF_SUCCESS) {
+            return NGX_HTTP_WAF_FAIL;
+        }
+
+        p = ngx_array_push(main_conf->local_caches);
+        *p = conf->request_verdict_cache;
+    }
+
+    /* 
+     * 设置了 size 时所有的检查项目共用一个按字节数确定容量的缓存，全局地淘汰缓存项，
+     * 繁忙的检查项目可以使用空闲的检查项目的空间。
+    */
+    if (conf->waf_inspection_cache_size != NGX_CONF_UNSET) {
+        lru_cache_t* cache = NULL;
+        if (lru_cache_init_clock(&cache, conf->waf_inspection_capacity, 
+                                 sizeof(inspection_cache_key_t), sizeof(cached_check_result_t), 
+                                 std, NULL) != NGX_HTTP_WAF_SUCCESS) {
+            return NGX_HTTP_WAF_FAIL;
+        }
+
+        p = ngx_array_push(main_conf->local_caches);
+        *p = cache;
+
+        conf->black_url_inspection_cache = cache;
+        conf->black_args_inspection_cache = cache;
+        conf->black_ua_inspection_cache = cache;
+        conf->black_referer_inspection_cache = cache;
+        conf->black_cookie_inspection_cache = cache;
+        conf->white_url_inspection_cache = cache;
+        conf->white_referer_inspection_cache = cache;
+        conf->black_post_inspection_cache = cache;
+
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
     lru_cache_init(&conf->black_url_inspection_cache, 
                     conf->waf_inspection_capacity, std, NULL);
     p = ngx_array_push(main_conf->local_caches);
@@ -1031,6 +1526,79 @@ ngx_int_t ngx_http_waf_init_lru_cache(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* c
     p = ngx_array_push(main_conf->local_caches);
     *p = conf->white_referer_inspection_cache;
 
+    lru_cache_init(&conf->black_post_inspection_cache, 
+                    conf->waf_inspection_capacity, std, NULL);
+    p = ngx_array_push(main_conf->local_caches);
+    *p = conf->black_post_inspection_cache;
+
+    lru_cache_t* caches[] = {
+        conf->black_url_inspection_cache,
+        conf->black_args_inspection_cache,
+        conf->black_ua_inspection_cache,
+        conf->black_referer_inspection_cache,
+        conf->black_cookie_inspection_cache,
+        conf->white_url_inspection_cache,
+        conf->white_referer_inspection_cache,
+        conf->black_post_inspection_cache
+    };
+
+    for (size_t i = 0; i < sizeof(caches) / sizeof(lru_cache_t*); i++) {
+        if (lru_cache_enable_admission(caches[i]) != NGX_HTTP_WAF_SUCCESS) {
+            return NGX_HTTP_WAF_FAIL;
+        }
+    }
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+ngx_int_t ngx_http_waf_init_inspection_cache_shm(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* conf) {
+    ngx_str_t name;
+    u_char* raw_name = ngx_pnalloc(cf->pool, sizeof(u_char) * 512);
+    if (raw_name == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    /* 名称由指令所在的位置决定而不是随机生成，这样 reload 之后 nginx 才会沿用这块共享内存。 */
+    u_char* last = ngx_snprintf(raw_name, 511, "%08xD-%ui%s", 
+                                ngx_crc32_short(cf->conf_file->file.name.data, cf->conf_file->file.name.len),
+                                cf->conf_file->line,
+                                NGX_HTTP_WAF_SHARE_MEMORY_INSPECTION_CACHE_NAME);
+    *last = '\0';
+    name.data = raw_name;
+    name.len = last - raw_name;
+
+    conf->shm_zone_inspection_cache = ngx_shared_memory_add(cf, &name, 
+                                                            conf->waf_inspection_shm_zone_size, 
+                                                            &ngx_http_waf_module);
+
+    if (conf->shm_zone_inspection_cache == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, NGX_ENOMOREFILES, 
+                "ngx_waf: failed to add shared memory");
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    /* 
+     * 被 include 到多个块中的同一行指令会得到同一块共享内存，
+     * 所以记录下所有使用这块共享内存的配置，初始化时为它们都接上二级缓存。
+    */
+    ngx_array_t* confs = conf->shm_zone_inspection_cache->data;
+    if (confs == NULL) {
+        confs = ngx_array_create(cf->pool, 2, sizeof(ngx_http_waf_loc_conf_t*));
+        if (confs == NULL) {
+            return NGX_HTTP_WAF_FAIL;
+        }
+    }
+
+    ngx_http_waf_loc_conf_t** p = ngx_array_push(confs);
+    if (p == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+    *p = conf;
+
+    conf->shm_zone_inspection_cache->init = ngx_http_waf_shm_zone_inspection_cache_init;
+    conf->shm_zone_inspection_cache->data = confs;
+
     return NGX_HTTP_WAF_SUCCESS;
 }
 
@@ -1056,6 +1624,18 @@ ngx_int_t ngx_http_waf_load_all_rule(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* co
     ngx_http_waf_check_and_load_conf(cf, full_path, end, NGX_HTTP_WAF_WHITE_URL_FILE, conf->white_url, 0);
     ngx_http_waf_check_and_load_conf(cf, full_path, end, NGX_HTTP_WAF_WHITE_REFERER_FILE, conf->white_referer, 0);
     ngx_http_waf_check_and_load_conf(cf, full_path, end, NGX_HTTP_WAF_ADVANCED_FILE, conf->advanced_rule, 3);
+
+    if (ngx_http_waf_vm_build_index(conf->advanced_rule, cf->pool, &conf->advanced_index) != NGX_HTTP_WAF_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, cf->log, 0, "ngx_waf: failed to index the advanced rules.");
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    if (ngx_http_waf_vm_collect_inputs(conf->advanced_rule, cf->pool, &conf->advanced_inputs) != NGX_HTTP_WAF_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, cf->log, 0, "ngx_waf: failed to analyze the advanced rules.");
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    conf->advanced_generation = ngx_http_waf_vm_generation(conf->advanced_rule);
     
 
     ngx_pfree(cf->pool, full_path);
@@ -1069,14 +1649,14 @@ ngx_int_t ngx_http_waf_alloc_memory(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* con
         return NGX_HTTP_WAF_SUCCESS;
     }
 
-    conf->black_url = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
-    conf->black_args = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
-    conf->black_ua = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
-    conf->black_referer = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
-    conf->black_cookie = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
-    conf->black_post = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
-    conf->white_url = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
-    conf->white_referer = ngx_array_create(cf->pool, 1, sizeof(ngx_regex_elt_t));
+    conf->black_url = ngx_pcalloc(cf->pool, sizeof(regex_set_t));
+    conf->black_args = ngx_pcalloc(cf->pool, sizeof(regex_set_t));
+    conf->black_ua = ngx_pcalloc(cf->pool, sizeof(regex_set_t));
+    conf->black_referer = ngx_pcalloc(cf->pool, sizeof(regex_set_t));
+    conf->black_cookie = ngx_pcalloc(cf->pool, sizeof(regex_set_t));
+    conf->black_post = ngx_pcalloc(cf->pool, sizeof(regex_set_t));
+    conf->white_url = ngx_pcalloc(cf->pool, sizeof(regex_set_t));
+    conf->white_referer = ngx_pcalloc(cf->pool, sizeof(regex_set_t));
     conf->black_ipv4 = ngx_pcalloc(cf->pool, sizeof(ip_trie_t));
     conf->white_ipv4 = ngx_pcalloc(cf->pool, sizeof(ip_trie_t));
 #if (NGX_HAVE_INET6)
@@ -1108,6 +1688,34 @@ ngx_int_t ngx_http_waf_alloc_memory(ngx_conf_t* cf, ngx_http_waf_loc_conf_t* con
     utarray_init(conf->advanced_rule, &icd);
 
 
+    if (regex_set_init(conf->black_url, cf->pool) != NGX_HTTP_WAF_SUCCESS
+    ||  regex_set_init(conf->black_args, cf->pool) != NGX_HTTP_WAF_SUCCESS
+    ||  regex_set_init(conf->black_ua, cf->pool) != NGX_HTTP_WAF_SUCCESS
+    ||  regex_set_init(conf->black_referer, cf->pool) != NGX_HTTP_WAF_SUCCESS
+    ||  regex_set_init(conf->black_cookie, cf->pool) != NGX_HTTP_WAF_SUCCESS
+    ||  regex_set_init(conf->black_post, cf->pool) != NGX_HTTP_WAF_SUCCESS
+    ||  regex_set_init(conf->white_url, cf->pool) != NGX_HTTP_WAF_SUCCESS
+    ||  regex_set_init(conf->white_referer, cf->pool) != NGX_HTTP_WAF_SUCCESS) {
+        ngx_log_error(NGX_LOG_ERR, cf->log, 0, "ngx_waf: initialization failed");
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    ngx_http_waf_main_conf_t* main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_waf_module);
+    regex_set_t* regex_sets[] = {
+        conf->black_url, conf->black_args, conf->black_ua, conf->black_referer,
+        conf->black_cookie, conf->black_post, conf->white_url, conf->white_referer
+    };
+
+    for (size_t i = 0; i < sizeof(regex_sets) / sizeof(regex_set_t*); i++) {
+        regex_set_t** p = ngx_array_push(main_conf->regex_sets);
+        if (p == NULL) {
+            ngx_log_error(NGX_LOG_ERR, cf->log, 0, "ngx_waf: initialization failed");
+            return NGX_HTTP_WAF_FAIL;
+        }
+        *p = regex_sets[i];
+    }
+
+
     if (ip_trie_init(conf->white_ipv4, gernal_pool, cf->pool, AF_INET) != NGX_HTTP_WAF_SUCCESS) {
         ngx_log_error(NGX_LOG_ERR, cf->log, 0, "ngx_waf: initialization failed");
         return NGX_HTTP_WAF_FAIL;
@@ -54,6 +54,14 @@ static ngx_command_t ngx_http_waf_commands[] = {
         0,
         NULL
    },
+   {
+        ngx_string("waf_regex_jit"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_FLAG,
+        ngx_conf_set_flag_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_waf_main_conf_t, waf_regex_jit),
+        NULL
+   },
    {
         ngx_string("waf_priority"),
         NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
@@ -92,7 +100,7 @@ ngx_module_t ngx_http_waf_module = {
     ngx_http_waf_commands,          /* module directives */
     NGX_HTTP_MODULE,                /* module type */
     NULL,                           /* init master */
-    NULL,                           /* init module */
+    ngx_http_waf_init_module,       /* init module */
     ngx_http_waf_init_process,      /* init process */
     NULL,                           /* init thread */
     NULL,                           /* exit thread */
@@ -105,15 +113,77 @@ ngx_module_t ngx_http_waf_module = {
 static ngx_int_t _read_request_body(ngx_http_request_t* r);
 
 
+/**
+ * @brief 定时将各个配置在本地累积的 CC 访问次数写回共享内存
+*/
+static void _cc_flush_handler(ngx_event_t* ev);
+
+
 static void _handler_read_request_body(ngx_http_request_t* r);
 
 
+/**
+ * @brief 判断检查项目的结果是否只取决于 URI、参数、User-Agent、Referer 和 Cookie。
+*/
+static ngx_int_t _is_verdict_cacheable(ngx_http_waf_check_pt check);
+
+
+/**
+ * @brief 计算整个请求的检查结果的缓存关键字，包括被检查的所有字段以及当前的规则和配置。
+*/
+static uint64_t _verdict_cache_key(ngx_http_request_t* r, ngx_http_waf_loc_conf_t* loc_conf);
+
+
+/**
+ * @brief 将整个请求的检查结果存入缓存
+ * @param[in] check_no 命中的检查项目是第几个可以缓存的检查项目
+*/
+static void _verdict_cache_add(lru_cache_t* cache, uint64_t key, ngx_http_waf_ctx_t* ctx, 
+                               ngx_int_t is_matched, ngx_uint_t check_no, ngx_int_t http_status);
+
+
 ngx_int_t ngx_http_waf_init_process(ngx_cycle_t *cycle) {
     randombytes_stir();
+
+    ngx_http_waf_main_conf_t* main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_waf_module);
+
+    if (main_conf != NULL && main_conf->waf_regex_jit == 1) {
+        /* 即使没能分配 JIT 栈，JIT 代码也能使用默认的栈，只是更容易超出栈的上限。 */
+        regex_set_jit_stack_init(cycle->log);
+
+        regex_set_t** sets = main_conf->regex_sets->elts;
+        for (ngx_uint_t i = 0; i < main_conf->regex_sets->nelts; i++) {
+            regex_set_jit_warm_up(sets[i]);
+        }
+    }
+
+    if (main_conf != NULL && main_conf->cc_local_confs->nelts > 0) {
+        static ngx_event_t cc_flush_event;
+        cc_flush_event.handler = _cc_flush_handler;
+        cc_flush_event.data = main_conf;
+        cc_flush_event.log = cycle->log;
+        cc_flush_event.cancelable = 1;
+        ngx_add_timer(&cc_flush_event, NGX_HTTP_WAF_CC_LOCAL_INTERVAL * 1000);
+    }
+
     return NGX_OK;
 }
 
 
+static void _cc_flush_handler(ngx_event_t* ev) {
+    ngx_http_waf_main_conf_t* main_conf = ev->data;
+
+    ngx_http_waf_loc_conf_t** confs = main_conf->cc_local_confs->elts;
+    for (ngx_uint_t i = 0; i < main_conf->cc_local_confs->nelts; i++) {
+        ngx_http_waf_flush_cc_local(confs[i]);
+    }
+
+    if (!ngx_exiting) {
+        ngx_add_timer(ev, NGX_HTTP_WAF_CC_LOCAL_INTERVAL * 1000);
+    }
+}
+
+
 ngx_int_t ngx_http_waf_handler_access_phase(ngx_http_request_t* r) {
     return ngx_http_waf_check_all(r, NGX_HTTP_WAF_TRUE);
 }
@@ -213,12 +283,64 @@ ngx_int_t ngx_http_waf_check_all(ngx_http_request_t* r, ngx_int_t is_check_cc) {
 
     } else {
         ctx->checked = NGX_HTTP_WAF_TRUE;
+
+        /* 
+         * GET 和 HEAD 请求中只取决于 URI、参数、User-Agent、Referer 和 Cookie 的检查项目的结果可以整体缓存，
+         * 命中时这些检查项目只需要一次查找，IP、CC 等其它检查项目仍然照常执行。
+        */
+        lru_cache_t* verdict_cache = NULL;
+        uint64_t verdict_key = 0;
+        request_verdict_t* verdict = NULL;
+        if (ngx_http_waf_check_flag(loc_conf->waf_mode, NGX_HTTP_WAF_MODE_EXTRA_CACHE) == NGX_HTTP_WAF_TRUE
+            && loc_conf->waf_inspection_capacity != NGX_CONF_UNSET
+            && loc_conf->request_verdict_cache != NULL
+            && (r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)) != 0) {
+            verdict_cache = loc_conf->request_verdict_cache;
+            verdict_key = _verdict_cache_key(r, loc_conf);
+
+            lru_cache_find_result_t tmp = lru_cache_find(verdict_cache, &verdict_key, sizeof(uint64_t));
+            if (tmp.status == NGX_HTTP_WAF_KEY_EXISTS) {
+                verdict = *(tmp.data);
+            }
+        }
+
         ngx_http_waf_check_pt* funcs = loc_conf->check_proc;
+        ngx_uint_t check_no = 0;
+        ngx_int_t is_cacheable = NGX_HTTP_WAF_FALSE;
         for (size_t i = 0; funcs[i] != NULL; i++) {
+            is_cacheable = _is_verdict_cacheable(funcs[i]);
+
+            /* 缓存的结果在原先命中的位置生效，排在它之前的其它检查项目照常执行。 */
+            if (is_cacheable == NGX_HTTP_WAF_TRUE && verdict != NULL) {
+                if (verdict->is_matched == NGX_HTTP_WAF_MATCHED && verdict->check_no == check_no) {
+                    ctx->blocked = verdict->blocked;
+                    ngx_strcpy(ctx->rule_type, verdict->rule_type);
+                    ngx_strcpy(ctx->rule_deatils, verdict->rule_details);
+                    http_status = verdict->http_status;
+                    is_matched = NGX_HTTP_WAF_MATCHED;
+                    break;
+                }
+                ++check_no;
+                continue;
+            }
+
             is_matched = funcs[i](r, &http_status);
             if (is_matched == NGX_HTTP_WAF_MATCHED) {
                 break;
             }
+
+            if (is_cacheable == NGX_HTTP_WAF_TRUE) {
+                ++check_no;
+            }
+        }
+
+        /* 只有命中了可以缓存的检查项目或者没有命中任何检查项目时，这些检查项目的结果才是完整的。 */
+        if (verdict_cache != NULL && verdict == NULL) {
+            if (is_matched != NGX_HTTP_WAF_MATCHED) {
+                _verdict_cache_add(verdict_cache, verdict_key, ctx, NGX_HTTP_WAF_NOT_MATCHED, 0, NGX_DECLINED);
+            } else if (is_cacheable == NGX_HTTP_WAF_TRUE) {
+                _verdict_cache_add(verdict_cache, verdict_key, ctx, NGX_HTTP_WAF_MATCHED, check_no, http_status);
+            }
         }
     }
 
@@ -302,6 +424,123 @@ static void _handler_read_request_body(ngx_http_request_t* r) {
 }
 
 
+static ngx_int_t _is_verdict_cacheable(ngx_http_waf_check_pt check) {
+    static ngx_http_waf_check_pt s_cacheable[] = {
+        ngx_http_waf_handler_check_white_url,
+        ngx_http_waf_handler_check_black_url,
+        ngx_http_waf_handler_check_black_args,
+        ngx_http_waf_handler_check_black_user_agent,
+        ngx_http_waf_handler_check_white_referer,
+        ngx_http_waf_handler_check_black_referer,
+        ngx_http_waf_handler_check_black_cookie
+    };
+
+    for (size_t i = 0; i < sizeof(s_cacheable) / sizeof(ngx_http_waf_check_pt); i++) {
+        if (s_cacheable[i] == check) {
+            return NGX_HTTP_WAF_TRUE;
+        }
+    }
+
+    return NGX_HTTP_WAF_FALSE;
+}
+
+
+static uint64_t _verdict_cache_key(ngx_http_request_t* r, ngx_http_waf_loc_conf_t* loc_conf) {
+    ngx_http_waf_main_conf_t* main_conf = ngx_http_get_module_main_conf(r, ngx_http_waf_module);
+    u_char* fingerprint_key = main_conf->cache_fingerprint_key;
+
+    /* 
+     * 子配置块可能继承了父配置块的缓存但是使用不同的规则，
+     * 所以规则的代数以及影响检查结果的配置也要计入关键字。
+    */
+    struct {
+        uint64_t        fields[5];
+        uint32_t        generations[7];
+        uint64_t        waf_mode;
+        int64_t         http_status;
+        uint64_t        method;
+    } material;
+    ngx_memzero(&material, sizeof(material));
+
+    ngx_str_t* fields[4] = { &(r->uri), &(r->args), NULL, NULL };
+    if (r->headers_in.user_agent != NULL) {
+        fields[2] = &(r->headers_in.user_agent->value);
+    }
+    if (r->headers_in.referer != NULL) {
+        fields[3] = &(r->headers_in.referer->value);
+    }
+
+    /* 每个字段分别计算指纹，这样字段之间的边界不会混淆。 */
+    for (size_t i = 0; i < 4; i++) {
+        if (fields[i] != NULL) {
+            crypto_shorthash((u_char*)&(material.fields[i]), fields[i]->data, fields[i]->len, fingerprint_key);
+        }
+    }
+
+    ngx_table_elt_t** cookies = r->headers_in.cookies.elts;
+    for (ngx_uint_t i = 0; i < r->headers_in.cookies.nelts; i++) {
+        uint64_t pair[2] = { material.fields[4], 0 };
+        crypto_shorthash((u_char*)&(pair[1]), cookies[i]->value.data, cookies[i]->value.len, fingerprint_key);
+        crypto_shorthash((u_char*)&(material.fields[4]), (u_char*)pair, sizeof(pair), fingerprint_key);
+    }
+
+    regex_set_t* rule_sets[7] = {
+        loc_conf->white_url,
+        loc_conf->black_url,
+        loc_conf->black_args,
+        loc_conf->black_ua,
+        loc_conf->white_referer,
+        loc_conf->black_referer,
+        loc_conf->black_cookie
+    };
+    for (size_t i = 0; i < 7; i++) {
+        material.generations[i] = rule_sets[i] == NULL ? 0 : rule_sets[i]->generation;
+    }
+
+    material.waf_mode = loc_conf->waf_mode;
+    material.http_status = loc_conf->waf_http_status;
+    material.method = r->method;
+
+    uint64_t key;
+    crypto_shorthash((u_char*)&key, (u_char*)&material, sizeof(material), fingerprint_key);
+
+    return key;
+}
+
+
+static void _verdict_cache_add(lru_cache_t* cache, uint64_t key, ngx_http_waf_ctx_t* ctx, 
+                               ngx_int_t is_matched, ngx_uint_t check_no, ngx_int_t http_status) {
+    lru_cache_add_result_t tmp = lru_cache_add(cache, &key, sizeof(uint64_t));
+    if (tmp.status != NGX_HTTP_WAF_SUCCESS) {
+        return;
+    }
+
+    size_t type_len = 0, details_len = 0;
+    if (is_matched == NGX_HTTP_WAF_MATCHED) {
+        type_len = ngx_strlen(ctx->rule_type);
+        details_len = ngx_strlen(ctx->rule_deatils);
+    }
+
+    /* 规则类型和规则内容紧跟在结构体之后，一起分配和释放。 */
+    request_verdict_t* verdict = lru_cache_calloc(cache, sizeof(request_verdict_t) + type_len + details_len + 2);
+    if (verdict == NULL) {
+        lru_cache_delete(cache, &key, sizeof(uint64_t));
+        return;
+    }
+
+    verdict->is_matched = is_matched;
+    verdict->check_no = check_no;
+    verdict->blocked = ctx->blocked;
+    verdict->http_status = http_status;
+    verdict->rule_type = (u_char*)(verdict + 1);
+    verdict->rule_details = verdict->rule_type + type_len + 1;
+    ngx_memcpy(verdict->rule_type, ctx->rule_type, type_len);
+    ngx_memcpy(verdict->rule_details, ctx->rule_deatils, details_len);
+
+    *(tmp.data) = verdict;
+}
+
+
 void ngx_http_waf_handler_cleanup(void *data) {
     return;
 }
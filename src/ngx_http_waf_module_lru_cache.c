@@ -16,6 +16,24 @@ void* _lru_cache_hash_calloc(lru_cache_t* lru, size_t n);
 void _lru_cache_hash_free(lru_cache_t* lru, void* addr);
 
 
+void _lru_cache_sketch_increment(lru_cache_sketch_t* sketch, void* key, size_t key_len);
+
+
+ngx_uint_t _lru_cache_sketch_estimate(lru_cache_sketch_t* sketch, void* key, size_t key_len);
+
+
+size_t _lru_cache_clock_slot_size(size_t key_size, size_t data_size);
+
+
+lru_cache_slot_t* _lru_cache_clock_find(lru_cache_t* lru, void* key, size_t key_len, uint32_t hash, size_t* pos);
+
+
+void _lru_cache_clock_remove(lru_cache_t* lru, size_t pos);
+
+
+void _lru_cache_clock_evict(lru_cache_t* lru);
+
+
 void lru_cache_init(lru_cache_t** lru, size_t capacity, mem_pool_type_e pool_type, void* native_pool) {
     assert(lru != NULL);
 
@@ -43,6 +61,108 @@ void lru_cache_init(lru_cache_t** lru, size_t capacity, mem_pool_type_e pool_typ
 }
 
 
+ngx_int_t lru_cache_init_clock(lru_cache_t** lru, size_t capacity, size_t key_size, size_t data_size, 
+                               mem_pool_type_e pool_type, void* native_pool) {
+    assert(capacity != 0);
+    assert(capacity < UINT32_MAX);
+    assert(key_size != 0);
+
+    lru_cache_init(lru, capacity, pool_type, native_pool);
+
+    lru_cache_t* _lru = *lru;
+
+    lru_cache_clock_t* clock = mem_pool_calloc(&_lru->pool, sizeof(lru_cache_clock_t));
+    if (clock == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    /* 索引的负载因子不超过二分之一，保证线性探测的长度很短。 */
+    size_t index_len = 2;
+    while (index_len < capacity * 2) {
+        index_len <<= 1;
+    }
+
+    clock->slot_size = _lru_cache_clock_slot_size(key_size, data_size);
+    clock->key_size = key_size;
+    clock->index_mask = index_len - 1;
+    clock->slots = mem_pool_calloc(&_lru->pool, clock->slot_size * capacity);
+    clock->index = mem_pool_calloc(&_lru->pool, sizeof(uint32_t) * index_len);
+
+    if (clock->slots == NULL || clock->index == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        lru_cache_slot_t* slot = (lru_cache_slot_t*)(clock->slots + i * clock->slot_size);
+        slot->next_free = (i + 1 < capacity) ? (uint32_t)(i + 2) : 0;
+        slot->data = (u_char*)slot + clock->slot_size - ngx_align(data_size, sizeof(void*));
+    }
+
+    clock->free_head = 1;
+    _lru->clock = clock;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+size_t lru_cache_clock_capacity(size_t byte_size, size_t key_size, size_t data_size) {
+    /* 每个槽位在索引中平均占用两项 */
+    return byte_size / (_lru_cache_clock_slot_size(key_size, data_size) + sizeof(uint32_t) * 2);
+}
+
+
+void lru_cache_set_tag(lru_cache_t* lru, void** data, ngx_uint_t tag) {
+    assert(lru != NULL);
+    assert(lru->clock != NULL);
+    assert(data != NULL);
+    assert(tag < NGX_HTTP_WAF_LRU_CACHE_MAX_TAGS);
+
+    lru_cache_slot_t* slot = (lru_cache_slot_t*)((u_char*)data - offsetof(lru_cache_slot_t, data));
+    --(lru->clock->tag_count[slot->tag]);
+    ++(lru->clock->tag_count[tag]);
+    slot->tag = (u_char)tag;
+}
+
+
+size_t lru_cache_tag_count(lru_cache_t* lru, ngx_uint_t tag) {
+    assert(lru != NULL);
+    assert(lru->clock != NULL);
+    assert(tag < NGX_HTTP_WAF_LRU_CACHE_MAX_TAGS);
+
+    return lru->clock->tag_count[tag];
+}
+
+
+ngx_int_t lru_cache_enable_admission(lru_cache_t* lru) {
+    assert(lru != NULL);
+    assert(lru->clock == NULL);
+
+    lru_cache_sketch_t* sketch = mem_pool_calloc(&lru->pool, sizeof(lru_cache_sketch_t));
+    if (sketch == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    /* 每行的计数器数量不少于缓存容量，以减少冲突。 */
+    size_t width = 64;
+    while (width < lru->capacity) {
+        width <<= 1;
+    }
+
+    sketch->width = width;
+    sketch->sample_size = lru->capacity * NGX_HTTP_WAF_LRU_CACHE_SKETCH_SAMPLE_FACTOR;
+    sketch->counters = mem_pool_calloc(&lru->pool, sizeof(u_char) * width * NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH);
+    sketch->doorkeeper = mem_pool_calloc(&lru->pool, sizeof(u_char) * width);
+
+    if (sketch->counters == NULL || sketch->doorkeeper == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    lru->sketch = sketch;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
 lru_cache_add_result_t lru_cache_add(lru_cache_t* lru, void* key, size_t key_len) {
     assert(lru != NULL);
     assert(key != NULL);
@@ -50,6 +170,48 @@ lru_cache_add_result_t lru_cache_add(lru_cache_t* lru, void* key, size_t key_len
 
     lru_cache_add_result_t ret;
 
+    if (lru->clock != NULL) {
+        lru_cache_clock_t* clock = lru->clock;
+        uint32_t hash = ngx_murmur_hash2(key, key_len);
+        size_t pos = 0;
+
+        assert(key_len <= clock->key_size);
+
+        lru_cache_slot_t* slot = _lru_cache_clock_find(lru, key, key_len, hash, &pos);
+        if (slot != NULL) {
+            slot->referenced = 1;
+            ret.status = NGX_HTTP_WAF_KEY_EXISTS;
+            ret.data = &slot->data;
+            return ret;
+        }
+
+        if (clock->free_head == 0) {
+            _lru_cache_clock_evict(lru);
+            /* 删除时索引中的项可能向前移动过，需要重新确定插入的位置。 */
+            _lru_cache_clock_find(lru, key, key_len, hash, &pos);
+        }
+
+        slot = (lru_cache_slot_t*)(clock->slots + (clock->free_head - 1) * clock->slot_size);
+        ngx_memzero(slot->data, clock->slot_size - ((u_char*)slot->data - (u_char*)slot));
+        ngx_memcpy((u_char*)(slot + 1), key, key_len);
+        slot->hash = hash;
+        slot->key_byte_length = (uint32_t)key_len;
+        slot->used = 1;
+        slot->referenced = 0;
+        slot->tag = 0;
+        ++(clock->tag_count[0]);
+
+        /* 查找失败时 pos 停在探测序列的第一个空位上 */
+        clock->index[pos] = clock->free_head;
+        clock->free_head = slot->next_free;
+        slot->next_free = 0;
+        ++(clock->count);
+
+        ret.status = NGX_HTTP_WAF_SUCCESS;
+        ret.data = &slot->data;
+        return ret;
+    }
+
     lru_cache_item_t* item = _lru_cache_hash_find(lru, key, key_len);
     if (item != NULL) {
         CDL_DELETE(lru->chain_head, item);
@@ -60,6 +222,17 @@ lru_cache_add_result_t lru_cache_add(lru_cache_t* lru, void* key, size_t key_len
     }
 
     if (HASH_COUNT(lru->hash_head) >= lru->capacity) {
+        /* 新的关键字只有比将被淘汰的缓存项更常被访问时才能取代它 */
+        if (lru->sketch != NULL && lru->chain_head != NULL) {
+            lru_cache_item_t* victim = lru->chain_head->prev;
+            if (_lru_cache_sketch_estimate(lru->sketch, key, key_len) 
+                <= _lru_cache_sketch_estimate(lru->sketch, victim->key_ptr, victim->key_byte_length)) {
+                ret.status = NGX_HTTP_WAF_KEY_REJECTED;
+                ret.data = NULL;
+                return ret;
+            }
+        }
+
         lru_cache_eliminate(lru, 1);
     }
 
@@ -108,6 +281,26 @@ lru_cache_find_result_t lru_cache_find(lru_cache_t* lru, void* key, size_t key_l
 
     lru_cache_find_result_t ret;
 
+    if (lru->clock != NULL) {
+        lru_cache_slot_t* slot = _lru_cache_clock_find(lru, key, key_len, ngx_murmur_hash2(key, key_len), NULL);
+        if (slot != NULL) {
+            /* 命中时只设置访问位，已经设置过时不写内存。 */
+            if (slot->referenced == 0) {
+                slot->referenced = 1;
+            }
+            ret.status = NGX_HTTP_WAF_KEY_EXISTS;
+            ret.data = &slot->data;
+        } else {
+            ret.status = NGX_HTTP_WAF_KEY_NOT_EXISTS;
+            ret.data = NULL;
+        }
+        return ret;
+    }
+
+    if (lru->sketch != NULL) {
+        _lru_cache_sketch_increment(lru->sketch, key, key_len);
+    }
+
     lru_cache_item_t* item = _lru_cache_hash_find(lru, key, key_len);
     if (item != NULL) {
         CDL_DELETE(lru->chain_head, item);
@@ -143,6 +336,14 @@ void lru_cache_delete(lru_cache_t* lru, void* key, size_t key_len) {
     assert(key != NULL);
     assert(key_len != 0);
 
+    if (lru->clock != NULL) {
+        size_t pos = 0;
+        if (_lru_cache_clock_find(lru, key, key_len, ngx_murmur_hash2(key, key_len), &pos) != NULL) {
+            _lru_cache_clock_remove(lru, pos);
+        }
+        return;
+    }
+
     lru_cache_item_t* item = _lru_cache_hash_find(lru, key, key_len);
     if (item != NULL) {
         _lru_cache_hash_delete(lru, item);
@@ -163,7 +364,11 @@ void lru_cache_eliminate(lru_cache_t* lru, size_t count) {
     assert(count != 0);
 
     for (size_t i = 0; i < count; i++) {
-        if (lru->chain_head != NULL) {
+        if (lru->clock != NULL) {
+            if (lru->clock->count != 0) {
+                _lru_cache_clock_evict(lru);
+            }
+        } else if (lru->chain_head != NULL) {
             lru_cache_item_t* tail = lru->chain_head->prev;
             lru_cache_delete(lru, tail->key_ptr, tail->key_byte_length);
         }
@@ -171,7 +376,32 @@ void lru_cache_eliminate(lru_cache_t* lru, size_t count) {
 }
 
 
+void lru_cache_foreach(lru_cache_t* lru, void (*handler)(void* key, size_t key_len, void* data, void* ctx), void* ctx) {
+    assert(lru != NULL);
+    assert(lru->clock != NULL);
+    assert(handler != NULL);
+
+    lru_cache_clock_t* clock = lru->clock;
+    for (size_t i = 0; i < lru->capacity; i++) {
+        lru_cache_slot_t* slot = (lru_cache_slot_t*)(clock->slots + i * clock->slot_size);
+        if (slot->used) {
+            handler((u_char*)(slot + 1), slot->key_byte_length, slot->data, ctx);
+        }
+    }
+}
+
+
 void lru_cache_destory(lru_cache_t* lru) {
+    if (lru->clock != NULL) {
+        mem_pool_free(&lru->pool, lru->clock->slots);
+        mem_pool_free(&lru->pool, lru->clock->index);
+        mem_pool_free(&lru->pool, lru->clock);
+    }
+    if (lru->sketch != NULL) {
+        mem_pool_free(&lru->pool, lru->sketch->counters);
+        mem_pool_free(&lru->pool, lru->sketch->doorkeeper);
+        mem_pool_free(&lru->pool, lru->sketch);
+    }
     mem_pool_free(&lru->pool, lru);
 }
 
@@ -221,4 +451,173 @@ void* _lru_cache_hash_calloc(lru_cache_t* lru, size_t n) {
 
 void _lru_cache_hash_free(lru_cache_t* lru, void* addr) {
     mem_pool_free(&lru->pool, addr);
-}
\ No newline at end of file
+}
+
+
+size_t _lru_cache_clock_slot_size(size_t key_size, size_t data_size) {
+    return sizeof(lru_cache_slot_t) + ngx_align(key_size, sizeof(void*)) + ngx_align(data_size, sizeof(void*));
+}
+
+
+#define _lru_cache_clock_slot(clock, i) ((lru_cache_slot_t*)((clock)->slots + (i) * (clock)->slot_size))
+
+
+lru_cache_slot_t* _lru_cache_clock_find(lru_cache_t* lru, void* key, size_t key_len, uint32_t hash, size_t* pos) {
+    lru_cache_clock_t* clock = lru->clock;
+    size_t i = hash & clock->index_mask;
+
+    while (clock->index[i] != 0) {
+        lru_cache_slot_t* slot = _lru_cache_clock_slot(clock, clock->index[i] - 1);
+        if (slot->hash == hash 
+            && slot->key_byte_length == key_len 
+            && ngx_memcmp((u_char*)(slot + 1), key, key_len) == 0) {
+            if (pos != NULL) {
+                *pos = i;
+            }
+            return slot;
+        }
+        i = (i + 1) & clock->index_mask;
+    }
+
+    if (pos != NULL) {
+        *pos = i;
+    }
+
+    return NULL;
+}
+
+
+void _lru_cache_clock_remove(lru_cache_t* lru, size_t pos) {
+    lru_cache_clock_t* clock = lru->clock;
+    uint32_t slot_no = clock->index[pos];
+    lru_cache_slot_t* slot = _lru_cache_clock_slot(clock, slot_no - 1);
+
+    slot->used = 0;
+    slot->referenced = 0;
+    --(clock->tag_count[slot->tag]);
+    slot->next_free = clock->free_head;
+    clock->free_head = slot_no;
+    --(clock->count);
+
+    /* 
+     * 向后移动删除（backward shift deletion），不使用墓碑标记，
+     * 所以探测序列的长度不会随着删除次数增加。
+    */
+    size_t i = pos;
+    size_t j = pos;
+    for (;;) {
+        clock->index[i] = 0;
+
+        for (;;) {
+            j = (j + 1) & clock->index_mask;
+            if (clock->index[j] == 0) {
+                return;
+            }
+
+            size_t home = _lru_cache_clock_slot(clock, clock->index[j] - 1)->hash & clock->index_mask;
+            
+            /* 如果 home 循环地位于 (i, j] 之间则这一项不能移动到 i */
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+                continue;
+            }
+
+            break;
+        }
+
+        clock->index[i] = clock->index[j];
+        i = j;
+    }
+}
+
+
+void _lru_cache_clock_evict(lru_cache_t* lru) {
+    lru_cache_clock_t* clock = lru->clock;
+
+    for (;;) {
+        lru_cache_slot_t* slot = _lru_cache_clock_slot(clock, clock->hand);
+        clock->hand = (clock->hand + 1) % lru->capacity;
+
+        if (slot->used == 0) {
+            continue;
+        }
+
+        if (slot->referenced != 0) {
+            slot->referenced = 0;
+            continue;
+        }
+
+        size_t pos = 0;
+        if (_lru_cache_clock_find(lru, (u_char*)(slot + 1), slot->key_byte_length, slot->hash, &pos) == slot) {
+            _lru_cache_clock_remove(lru, pos);
+        }
+
+        return;
+    }
+}
+
+
+#undef _lru_cache_clock_slot
+
+
+/* 
+ * 由一个 32 位哈希值派生出每一行的下标（Kirsch-Mitzenmacher），
+ * 最后一行之后的下标用于布隆过滤器。
+*/
+#define _lru_cache_sketch_index(h1, h2, i, width) (((h1) + (i) * (h2)) & ((width) - 1))
+
+
+void _lru_cache_sketch_increment(lru_cache_sketch_t* sketch, void* key, size_t key_len) {
+    uint32_t h1 = ngx_murmur_hash2(key, key_len);
+    uint32_t h2 = (h1 >> 17) | (h1 << 15);
+
+    /* 第一次出现的关键字只记录在布隆过滤器中 */
+    size_t bit = _lru_cache_sketch_index(h1, h2, NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH, sketch->width * 8);
+    if ((sketch->doorkeeper[bit >> 3] & (1 << (bit & 7))) == 0) {
+        sketch->doorkeeper[bit >> 3] |= (u_char)(1 << (bit & 7));
+    } else {
+        /* 只增加最小的计数器（conservative update），减少冲突带来的高估。 */
+        u_char* counters[NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH];
+        u_char min = NGX_HTTP_WAF_LRU_CACHE_SKETCH_MAX_COUNT;
+        for (size_t i = 0; i < NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH; i++) {
+            counters[i] = sketch->counters + i * sketch->width + _lru_cache_sketch_index(h1, h2, i, sketch->width);
+            min = ngx_min(min, *counters[i]);
+        }
+
+        for (size_t i = 0; i < NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH; i++) {
+            if (*counters[i] == min && min < NGX_HTTP_WAF_LRU_CACHE_SKETCH_MAX_COUNT) {
+                ++(*counters[i]);
+            }
+        }
+    }
+
+    /* 定期衰减，让过去的热点逐渐失去优势。 */
+    if (++(sketch->additions) >= sketch->sample_size) {
+        for (size_t i = 0; i < sketch->width * NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH; i++) {
+            sketch->counters[i] >>= 1;
+        }
+        ngx_memzero(sketch->doorkeeper, sketch->width);
+        sketch->additions /= 2;
+    }
+}
+
+
+ngx_uint_t _lru_cache_sketch_estimate(lru_cache_sketch_t* sketch, void* key, size_t key_len) {
+    uint32_t h1 = ngx_murmur_hash2(key, key_len);
+    uint32_t h2 = (h1 >> 17) | (h1 << 15);
+
+    size_t bit = _lru_cache_sketch_index(h1, h2, NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH, sketch->width * 8);
+    if ((sketch->doorkeeper[bit >> 3] & (1 << (bit & 7))) == 0) {
+        return 0;
+    }
+
+    ngx_uint_t min = NGX_HTTP_WAF_LRU_CACHE_SKETCH_MAX_COUNT;
+    for (size_t i = 0; i < NGX_HTTP_WAF_LRU_CACHE_SKETCH_DEPTH; i++) {
+        u_char count = sketch->counters[i * sketch->width + _lru_cache_sketch_index(h1, h2, i, sketch->width)];
+        min = ngx_min(min, count);
+    }
+
+    return min + 1;
+}
+
+
+#undef _lru_cache_sketch_index
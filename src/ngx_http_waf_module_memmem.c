@@ -0,0 +1,322 @@
+#include <ngx_http_waf_module_memmem.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define NGX_HTTP_WAF_MEMMEM_X86 1
+#include <immintrin.h>
+#endif
+
+typedef u_char* (*memmem_impl_pt)(memmem_needle_t* needle, u_char* data, size_t len);
+
+
+static ngx_uint_t _memmem_byte_rank(u_char ch);
+
+
+static void _memmem_filter(memmem_needle_t* needle);
+
+
+static ngx_int_t _memmem_equals(memmem_needle_t* needle, u_char* data);
+
+
+static u_char* _memmem_scalar(memmem_needle_t* needle, u_char* data, size_t len);
+
+
+static u_char* _memmem_resolve(memmem_needle_t* needle, u_char* data, size_t len);
+
+
+#if (NGX_HTTP_WAF_MEMMEM_X86)
+
+static u_char* _memmem_sse2(memmem_needle_t* needle, u_char* data, size_t len);
+
+
+static u_char* _memmem_avx2(memmem_needle_t* needle, u_char* data, size_t len);
+
+
+static u_char* _memmem_verify(memmem_needle_t* needle, u_char* data, unsigned int mask);
+
+#endif
+
+
+/* 第一次调用时才检测 CPU，之后直接调用选中的实现。 */
+static memmem_impl_pt _memmem_impl = _memmem_resolve;
+
+
+static const char* _memmem_impl_name = "scalar";
+
+
+void memmem_needle_init(memmem_needle_t* needle, u_char* data, size_t len, ngx_int_t caseless) {
+    needle->data = data;
+    needle->len = len;
+    needle->caseless = caseless;
+    needle->first = 0;
+    needle->second = len == 0 ? 0 : len - 1;
+
+    if (len < 2) {
+        _memmem_filter(needle);
+        return;
+    }
+
+    /* 
+     * 用模式串中最少见的两个不同的字符筛选候选位置，比固定使用首尾两个字符的误报更少。
+     * 比如对于 "/admin/"，用 'a' 和 'm' 比用两个 '/' 好得多。
+    */
+    size_t first = 0;
+    for (size_t i = 1; i < len; i++) {
+        if (_memmem_byte_rank(data[i]) < _memmem_byte_rank(data[first])) {
+            first = i;
+        }
+    }
+
+    size_t second = first == len - 1 ? 0 : len - 1;
+    for (size_t i = 0; i < len; i++) {
+        if (i == first || data[i] == data[first]) {
+            continue;
+        }
+
+        if (data[second] == data[first] || _memmem_byte_rank(data[i]) < _memmem_byte_rank(data[second])) {
+            second = i;
+        }
+    }
+
+    needle->first = ngx_min(first, second);
+    needle->second = ngx_max(first, second);
+    _memmem_filter(needle);
+}
+
+
+u_char* memmem_needle_exec(memmem_needle_t* needle, u_char* data, size_t len) {
+    if (needle->len == 0) {
+        return data;
+    }
+
+    if (needle->len > len) {
+        return NULL;
+    }
+
+    if (needle->len == 1 && needle->caseless == NGX_HTTP_WAF_FALSE) {
+        return (u_char*)memchr(data, needle->data[0], len);
+    }
+
+    return _memmem_impl(needle, data, len);
+}
+
+
+u_char* memmem_find(u_char* data, size_t len, u_char* needle, size_t needle_len) {
+    memmem_needle_t preprocessed;
+
+    /* 运行时的模式串不值得挑选字符，直接使用首尾两个字符。 */
+    preprocessed.data = needle;
+    preprocessed.len = needle_len;
+    preprocessed.caseless = NGX_HTTP_WAF_FALSE;
+    preprocessed.first = 0;
+    preprocessed.second = needle_len == 0 ? 0 : needle_len - 1;
+    _memmem_filter(&preprocessed);
+
+    return memmem_needle_exec(&preprocessed, data, len);
+}
+
+
+const char* memmem_impl_name(void) {
+    if (_memmem_impl == _memmem_resolve) {
+        _memmem_resolve(NULL, NULL, 0);
+    }
+
+    return _memmem_impl_name;
+}
+
+
+/**
+ * @brief 估计一个字符在 URL、User-Agent 等字符串中出现的频率，数值越小越少见。
+*/
+static ngx_uint_t _memmem_byte_rank(u_char ch) {
+    if (islower(ch) || ch == '/' || ch == '.' || ch == '=' || ch == '&') {
+        return 3;
+    }
+
+    if (isupper(ch) || isdigit(ch) || ch == ' ' || ch == '-' || ch == '_' || ch == '%') {
+        return 2;
+    }
+
+    if (isprint(ch)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief 计算两个筛选字符的比较方式：当 (c | mask) == ch 时 c 可能与模式串中的字符相同。
+ * @note 大小写不敏感时字母的第 5 位被忽略，其它字符因此产生的误报会在比较整个模式串时排除。
+*/
+static void _memmem_filter(memmem_needle_t* needle) {
+    size_t index[2] = { needle->first, needle->second };
+
+    for (int i = 0; i < 2; i++) {
+        needle->filter[i] = needle->len == 0 ? 0 : needle->data[index[i]];
+        needle->filter_mask[i] = 0;
+
+        if (needle->caseless == NGX_HTTP_WAF_TRUE && isalpha(needle->filter[i])) {
+            needle->filter[i] = (u_char)tolower(needle->filter[i]);
+            needle->filter_mask[i] = 0x20;
+        }
+    }
+}
+
+
+static ngx_int_t _memmem_equals(memmem_needle_t* needle, u_char* data) {
+    if (needle->caseless == NGX_HTTP_WAF_TRUE) {
+        return ngx_strncasecmp(data, needle->data, needle->len) == 0;
+    }
+
+    return ngx_memcmp(data, needle->data, needle->len) == 0;
+}
+
+
+static u_char* _memmem_scalar(memmem_needle_t* needle, u_char* data, size_t len) {
+    u_char first = needle->filter[0], first_mask = needle->filter_mask[0];
+    u_char second = needle->filter[1], second_mask = needle->filter_mask[1];
+    size_t last = len - needle->len;
+
+    for (size_t i = 0; i <= last; i++) {
+        if (first_mask == 0) {
+            u_char* p = (u_char*)memchr(data + i + needle->first, first, last - i + 1);
+            if (p == NULL) {
+                return NULL;
+            }
+            i = p - data - needle->first;
+
+        } else if ((data[i + needle->first] | first_mask) != first) {
+            continue;
+        }
+
+        if ((data[i + needle->second] | second_mask) == second && _memmem_equals(needle, data + i)) {
+            return data + i;
+        }
+    }
+
+    return NULL;
+}
+
+
+static u_char* _memmem_resolve(memmem_needle_t* needle, u_char* data, size_t len) {
+    _memmem_impl = _memmem_scalar;
+    _memmem_impl_name = "scalar";
+
+#if (NGX_HTTP_WAF_MEMMEM_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        _memmem_impl = _memmem_avx2;
+        _memmem_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        _memmem_impl = _memmem_sse2;
+        _memmem_impl_name = "sse2";
+    }
+#endif
+
+    if (needle == NULL) {
+        return NULL;
+    }
+
+    return _memmem_impl(needle, data, len);
+}
+
+
+#if (NGX_HTTP_WAF_MEMMEM_X86)
+
+/*
+ * 同时比较 16 或 32 个候选位置上的两个筛选字符，只对两个字符都相同的位置比较整个模式串。
+ * 最后一块与前一块重叠，重复检查的位置都已经确认不匹配，所以不影响结果。所有的读取都不会越过 data + len。
+*/
+
+__attribute__((target("sse2")))
+static u_char* _memmem_sse2(memmem_needle_t* needle, u_char* data, size_t len) {
+    size_t candidates = len - needle->len + 1;
+    if (candidates < 16) {
+        return _memmem_scalar(needle, data, len);
+    }
+
+    const __m128i first = _mm_set1_epi8((char)needle->filter[0]);
+    const __m128i first_mask = _mm_set1_epi8((char)needle->filter_mask[0]);
+    const __m128i second = _mm_set1_epi8((char)needle->filter[1]);
+    const __m128i second_mask = _mm_set1_epi8((char)needle->filter_mask[1]);
+
+    u_char* p = data;
+    u_char* last = data + candidates - 16;
+
+    for (;;) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + needle->first)), first_mask);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + needle->second)), second_mask);
+        unsigned int bits = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second)));
+
+        if (bits != 0) {
+            u_char* found = _memmem_verify(needle, p, bits);
+            if (found != NULL) {
+                return found;
+            }
+        }
+
+        if (p == last) {
+            return NULL;
+        }
+
+        p = p + 16 > last ? last : p + 16;
+    }
+}
+
+
+__attribute__((target("avx2")))
+static u_char* _memmem_avx2(memmem_needle_t* needle, u_char* data, size_t len) {
+    size_t candidates = len - needle->len + 1;
+    if (candidates < 32) {
+        return _memmem_sse2(needle, data, len);
+    }
+
+    const __m256i first = _mm256_set1_epi8((char)needle->filter[0]);
+    const __m256i first_mask = _mm256_set1_epi8((char)needle->filter_mask[0]);
+    const __m256i second = _mm256_set1_epi8((char)needle->filter[1]);
+    const __m256i second_mask = _mm256_set1_epi8((char)needle->filter_mask[1]);
+
+    u_char* p = data;
+    u_char* last = data + candidates - 32;
+
+    for (;;) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + needle->first)), first_mask);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p + needle->second)), second_mask);
+        unsigned int bits = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, second)));
+
+        if (bits != 0) {
+            u_char* found = _memmem_verify(needle, p, bits);
+            if (found != NULL) {
+                return found;
+            }
+        }
+
+        if (p == last) {
+            return NULL;
+        }
+
+        p = p + 32 > last ? last : p + 32;
+    }
+}
+
+
+/**
+ * @brief 逐个检查 bits 中标出的候选位置。
+ * @note 不能内联，否则调用 ngx_memcmp 会迫使编译器在热循环中把向量寄存器溢出到栈上。
+*/
+__attribute__((noinline))
+static u_char* _memmem_verify(memmem_needle_t* needle, u_char* data, unsigned int bits) {
+    while (bits != 0) {
+        unsigned int offset = (unsigned int)__builtin_ctz(bits);
+        if (_memmem_equals(needle, data + offset)) {
+            return data + offset;
+        }
+        bits &= bits - 1;
+    }
+
+    return NULL;
+}
+
+#endif
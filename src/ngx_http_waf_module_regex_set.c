@@ -0,0 +1,1121 @@
+#include <ngx_http_waf_module_regex_set.h>
+
+
+static ngx_int_t _regex_set_is_combinable(u_char* pattern);
+
+
+static ngx_int_t _regex_set_add_segment(regex_set_t* set, ngx_uint_t start, ngx_uint_t end, ngx_int_t combine);
+
+
+static ngx_int_t _regex_set_build_needles(regex_set_t* set);
+
+
+static memmem_needle_t* _regex_set_parse_literal(ngx_pool_t* pool, u_char* pattern);
+
+
+static ngx_int_t _regex_set_exec_range(regex_set_t* set, 
+                                       ngx_str_t* str, 
+                                       ngx_uint_t start, 
+                                       ngx_uint_t end, 
+                                       u_char* bitmap, 
+                                       ngx_regex_elt_t** rule);
+
+
+static ngx_int_t _regex_set_is_possible(regex_set_t* set, ngx_uint_t index, u_char* bitmap);
+
+
+static ngx_int_t _regex_set_build_prefilter(regex_set_t* set);
+
+
+static ngx_int_t _regex_set_extract_literals(ngx_pool_t* pool, u_char* begin, u_char* end, ngx_array_t* literals);
+
+
+static ngx_int_t _regex_set_quantifier(u_char* p, u_char* end, u_char** next);
+
+
+static u_char* _regex_set_skip_escape(u_char* p, u_char* end);
+
+
+static u_char* _regex_set_skip_class(u_char* p, u_char* end);
+
+
+static u_char* _regex_set_skip_group(u_char* p, u_char* end);
+
+
+static ngx_int_t _regex_set_regex_exec(regex_set_t* set, ngx_regex_t* regex, ngx_str_t* str, int* captures, ngx_uint_t size);
+
+
+static ngx_int_t _regex_set_jit_compile_one(ngx_regex_t* regex);
+
+
+static void _regex_set_jit_warm_up_one(regex_set_t* set, ngx_regex_t* regex);
+
+
+/* 以下变量属于每个工作进程，在 regex_set_jit_stack_init() 中创建。 */
+#if (NGX_PCRE2)
+static pcre2_jit_stack*         _regex_set_jit_stack = NULL;
+static pcre2_match_context*     _regex_set_match_context = NULL;
+static pcre2_match_data*        _regex_set_match_data = NULL;
+#elif (NGX_HAVE_PCRE_JIT)
+static pcre_jit_stack*          _regex_set_jit_stack = NULL;
+#endif
+
+
+ngx_int_t regex_set_init(regex_set_t* set, ngx_pool_t* pool) {
+    if (set == NULL || pool == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    set->pool = pool;
+    set->rules = ngx_array_create(pool, 1, sizeof(ngx_regex_elt_t));
+    set->captures = ngx_array_create(pool, 1, sizeof(ngx_int_t));
+    set->segments = NULL;
+    set->literals = NULL;
+    set->needles = NULL;
+    set->prefilter = NULL;
+    set->name = (u_char*)"";
+    set->jit = NGX_HTTP_WAF_FALSE;
+    ngx_crc32_init(set->generation);
+
+    if (set->rules == NULL || set->captures == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+ngx_int_t regex_set_add(regex_set_t* set, ngx_str_t* pattern, ngx_str_t* err) {
+    ngx_regex_compile_t   regex_compile;
+    u_char                errstr[NGX_MAX_CONF_ERRSTR];
+
+    ngx_memzero(&regex_compile, sizeof(ngx_regex_compile_t));
+    regex_compile.pattern = *pattern;
+    regex_compile.pool = set->pool;
+    regex_compile.err.len = NGX_MAX_CONF_ERRSTR;
+    regex_compile.err.data = errstr;
+
+    if (ngx_regex_compile(&regex_compile) != NGX_OK) {
+        if (err != NULL) {
+            err->len = ngx_min(err->len, regex_compile.err.len);
+            ngx_memcpy(err->data, regex_compile.err.data, err->len);
+        }
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    ngx_regex_elt_t* ngx_regex_elt = ngx_array_push(set->rules);
+    ngx_int_t* captures = ngx_array_push(set->captures);
+    if (ngx_regex_elt == NULL || captures == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    ngx_regex_elt->name = ngx_palloc(set->pool, sizeof(u_char) * NGX_HTTP_WAF_RULE_MAX_LEN);
+    if (ngx_regex_elt->name == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+    ngx_http_waf_to_c_str(ngx_regex_elt->name, *pattern);
+    ngx_regex_elt->regex = regex_compile.regex;
+    *captures = regex_compile.captures;
+
+    /* 规则的代数包括每条规则的内容和顺序，因为缓存中保存的是规则的下标。 */
+    ngx_crc32_update(&set->generation, pattern->data, pattern->len);
+    ngx_crc32_update(&set->generation, (u_char*)"\n", 1);
+
+    /* 规则表发生了变化，之前合并的结果和预过滤器已经失效。 */
+    set->segments = NULL;
+    set->literals = NULL;
+    set->needles = NULL;
+    set->prefilter = NULL;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+ngx_int_t regex_set_compile(regex_set_t* set) {
+    set->segments = ngx_array_create(set->pool, 1, sizeof(regex_segment_t));
+    if (set->segments == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    if (_regex_set_build_needles(set) != NGX_HTTP_WAF_SUCCESS) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    ngx_regex_elt_t* rules = set->rules->elts;
+    ngx_int_t* captures = set->captures->elts;
+    memmem_needle_t** needles = set->needles->elts;
+    ngx_uint_t start = 0;
+    ngx_int_t total_captures = 0;
+    size_t total_len = 0;
+
+    for (ngx_uint_t i = 0; i < set->rules->nelts; i++) {
+        size_t len = ngx_strlen(rules[i].name) + sizeof("()|") - 1;
+
+        /* 连续的字面量规则单独成段并逐条搜索，不参与合并。 */
+        if (needles[i] != NULL) {
+            ngx_uint_t end = i + 1;
+            while (end < set->rules->nelts && needles[end] != NULL) {
+                ++end;
+            }
+
+            if (_regex_set_add_segment(set, start, i, NGX_HTTP_WAF_TRUE) != NGX_HTTP_WAF_SUCCESS
+                || _regex_set_add_segment(set, i, end, NGX_HTTP_WAF_FALSE) != NGX_HTTP_WAF_SUCCESS) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            }
+            start = end;
+            i = end - 1;
+            total_captures = 0;
+            total_len = 0;
+            continue;
+        }
+
+        if (_regex_set_is_combinable(rules[i].name) != NGX_HTTP_WAF_TRUE
+            || captures[i] + 1 > NGX_HTTP_WAF_REGEX_SET_MAX_CAPTURES
+            || len > NGX_HTTP_WAF_REGEX_SET_MAX_LEN) {
+            if (_regex_set_add_segment(set, start, i, NGX_HTTP_WAF_TRUE) != NGX_HTTP_WAF_SUCCESS
+                || _regex_set_add_segment(set, i, i + 1, NGX_HTTP_WAF_TRUE) != NGX_HTTP_WAF_SUCCESS) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            }
+            start = i + 1;
+            total_captures = 0;
+            total_len = 0;
+            continue;
+        }
+
+        if (total_captures + captures[i] + 1 > NGX_HTTP_WAF_REGEX_SET_MAX_CAPTURES
+            || total_len + len > NGX_HTTP_WAF_REGEX_SET_MAX_LEN) {
+            if (_regex_set_add_segment(set, start, i, NGX_HTTP_WAF_TRUE) != NGX_HTTP_WAF_SUCCESS) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            }
+            start = i;
+            total_captures = 0;
+            total_len = 0;
+        }
+
+        total_captures += captures[i] + 1;
+        total_len += len;
+    }
+
+    if (_regex_set_add_segment(set, start, set->rules->nelts, NGX_HTTP_WAF_TRUE) != NGX_HTTP_WAF_SUCCESS) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    return _regex_set_build_prefilter(set);
+}
+
+
+ngx_int_t regex_set_exec(regex_set_t* set, ngx_str_t* str, ngx_int_t combined, ngx_regex_elt_t** rule) {
+    if (set == NULL || set->rules == NULL || str == NULL) {
+        return NGX_HTTP_WAF_NOT_MATCHED;
+    }
+
+    /* 先用一次线性扫描找出出现过的字面量，缺少必需字面量的规则不可能匹配成功，也就不必执行。 */
+    u_char seen[NGX_HTTP_WAF_AC_MAX_LITERALS / 8];
+    u_char* bitmap = NULL;
+    if (set->prefilter != NULL) {
+        bitmap = seen;
+        ngx_memzero(bitmap, (set->prefilter->size + 7) / 8);
+        ac_automaton_scan(set->prefilter, str->data, str->len, bitmap);
+    }
+
+    if (combined != NGX_HTTP_WAF_TRUE || set->segments == NULL) {
+        return _regex_set_exec_range(set, str, 0, set->rules->nelts, bitmap, rule);
+    }
+
+    ngx_regex_elt_t* rules = set->rules->elts;
+    regex_segment_t* segment = set->segments->elts;
+
+    for (ngx_uint_t i = 0; i < set->segments->nelts; i++, segment++) {
+        if (segment->regex == NULL) {
+            if (_regex_set_exec_range(set, str, segment->start, segment->end, bitmap, rule) == NGX_HTTP_WAF_MATCHED) {
+                return NGX_HTTP_WAF_MATCHED;
+            }
+            continue;
+        }
+
+        ngx_uint_t possible = segment->start;
+        while (possible < segment->end 
+            && _regex_set_is_possible(set, possible, bitmap) != NGX_HTTP_WAF_TRUE) {
+            ++possible;
+        }
+
+        if (possible == segment->end) {
+            continue;
+        }
+
+        int ovector[(NGX_HTTP_WAF_REGEX_SET_MAX_CAPTURES + 1) * 3];
+        ngx_int_t rc = _regex_set_regex_exec(set, segment->regex, str, ovector, (segment->captures + 1) * 3);
+
+        if (rc == NGX_REGEX_NO_MATCHED) {
+            continue;
+        }
+
+        /* 匹配出错（比如超出了回溯次数的上限），退回到逐条匹配。 */
+        if (rc <= 0) {
+            if (_regex_set_exec_range(set, str, segment->start, segment->end, bitmap, rule) == NGX_HTTP_WAF_MATCHED) {
+                return NGX_HTTP_WAF_MATCHED;
+            }
+            continue;
+        }
+
+        for (ngx_uint_t j = segment->start; j < segment->end; j++) {
+            ngx_int_t group = (ngx_int_t)segment->group[j - segment->start];
+            if (group >= rc || ovector[group * 2] < 0) {
+                continue;
+            }
+
+            /*
+             * 合并后的正则表达式报告的是字符串中最靠左的匹配，
+             * 而逐条匹配报告的是规则表中最靠前的规则，所以还要检查本段中更靠前的规则。
+            */
+            if (_regex_set_exec_range(set, str, segment->start, j, bitmap, rule) != NGX_HTTP_WAF_MATCHED) {
+                *rule = &rules[j];
+            }
+            return NGX_HTTP_WAF_MATCHED;
+        }
+    }
+
+    return NGX_HTTP_WAF_NOT_MATCHED;
+}
+
+
+ngx_int_t regex_set_jit_compile(regex_set_t* set, ngx_log_t* log, ngx_uint_t* count) {
+    *count = 0;
+
+#if (NGX_PCRE2 || NGX_HAVE_PCRE_JIT)
+    ngx_regex_elt_t* rules = set->rules->elts;
+
+    for (ngx_uint_t i = 0; i < set->rules->nelts; i++) {
+        if (_regex_set_jit_compile_one(rules[i].regex) == NGX_HTTP_WAF_SUCCESS) {
+            ++(*count);
+        } else {
+            ngx_log_error(NGX_LOG_WARN, log, 0, 
+                "ngx_waf: In %s, the JIT compiler does not support the regex [%s].", set->name, rules[i].name);
+        }
+    }
+
+    /* 合并后的正则表达式编译失败时会退回到逐条匹配，所以不单独报告。 */
+    if (set->segments != NULL) {
+        regex_segment_t* segment = set->segments->elts;
+        for (ngx_uint_t i = 0; i < set->segments->nelts; i++) {
+            if (segment[i].regex != NULL) {
+                _regex_set_jit_compile_one(segment[i].regex);
+            }
+        }
+    }
+
+    set->jit = NGX_HTTP_WAF_TRUE;
+
+    return NGX_HTTP_WAF_SUCCESS;
+#else
+    return NGX_HTTP_WAF_FAIL;
+#endif
+}
+
+
+ngx_int_t regex_set_jit_stack_init(ngx_log_t* log) {
+#if (NGX_PCRE2)
+    if (_regex_set_match_context != NULL) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    _regex_set_jit_stack = pcre2_jit_stack_create(NGX_HTTP_WAF_REGEX_JIT_STACK_MIN, 
+                                                  NGX_HTTP_WAF_REGEX_JIT_STACK_MAX, 
+                                                  NULL);
+    _regex_set_match_context = pcre2_match_context_create(NULL);
+    _regex_set_match_data = pcre2_match_data_create(NGX_HTTP_WAF_REGEX_SET_MAX_CAPTURES + 1, NULL);
+
+    if (_regex_set_jit_stack == NULL || _regex_set_match_context == NULL || _regex_set_match_data == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, 
+            "ngx_waf: the JIT stack cannot be created because the memory allocation failed.");
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    pcre2_jit_stack_assign(_regex_set_match_context, NULL, _regex_set_jit_stack);
+
+    return NGX_HTTP_WAF_SUCCESS;
+#elif (NGX_HAVE_PCRE_JIT)
+    if (_regex_set_jit_stack != NULL) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    _regex_set_jit_stack = pcre_jit_stack_alloc(NGX_HTTP_WAF_REGEX_JIT_STACK_MIN, NGX_HTTP_WAF_REGEX_JIT_STACK_MAX);
+
+    if (_regex_set_jit_stack == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, 
+            "ngx_waf: the JIT stack cannot be created because the memory allocation failed.");
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    return NGX_HTTP_WAF_SUCCESS;
+#else
+    return NGX_HTTP_WAF_FAIL;
+#endif
+}
+
+
+void regex_set_jit_warm_up(regex_set_t* set) {
+    if (set == NULL || set->rules == NULL || set->jit != NGX_HTTP_WAF_TRUE) {
+        return;
+    }
+
+    ngx_regex_elt_t* rules = set->rules->elts;
+    for (ngx_uint_t i = 0; i < set->rules->nelts; i++) {
+        _regex_set_jit_warm_up_one(set, rules[i].regex);
+    }
+
+    if (set->segments != NULL) {
+        regex_segment_t* segment = set->segments->elts;
+        for (ngx_uint_t i = 0; i < set->segments->nelts; i++) {
+            if (segment[i].regex != NULL) {
+                _regex_set_jit_warm_up_one(set, segment[i].regex);
+            }
+        }
+    }
+}
+
+
+static ngx_int_t _regex_set_regex_exec(regex_set_t* set, ngx_regex_t* regex, ngx_str_t* str, int* captures, ngx_uint_t size) {
+#if (NGX_PCRE2)
+    /* ngx_regex_exec() 不接受匹配上下文，只能自己调用 pcre2_match() 才能用上预先分配的 JIT 栈。 */
+    if (set->jit == NGX_HTTP_WAF_TRUE && _regex_set_match_context != NULL) {
+        int rc = pcre2_match(regex, str->data, str->len, 0, 0, _regex_set_match_data, _regex_set_match_context);
+        if (rc < 0) {
+            return rc;
+        }
+
+        ngx_uint_t n = pcre2_get_ovector_count(_regex_set_match_data);
+        PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(_regex_set_match_data);
+
+        if (n > size / 3) {
+            n = size / 3;
+        }
+
+        for (ngx_uint_t i = 0; i < n; i++) {
+            captures[i * 2] = ovector[i * 2];
+            captures[i * 2 + 1] = ovector[i * 2 + 1];
+        }
+
+        return rc;
+    }
+#endif
+
+    return ngx_regex_exec(regex, str, captures, size);
+}
+
+
+static ngx_int_t _regex_set_jit_compile_one(ngx_regex_t* regex) {
+#if (NGX_PCRE2)
+    size_t jit_size = 0;
+
+    if (pcre2_jit_compile(regex, PCRE2_JIT_COMPLETE) != 0
+        || pcre2_pattern_info(regex, PCRE2_INFO_JITSIZE, &jit_size) != 0
+        || jit_size == 0) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    return NGX_HTTP_WAF_SUCCESS;
+#elif (NGX_HAVE_PCRE_JIT)
+    const char* errstr = NULL;
+    int jit = 0;
+
+    /* 配置了 pcre_jit on 时 nginx 已经完成了 JIT 编译。 */
+    if (regex->extra != NULL
+        && pcre_fullinfo(regex->code, regex->extra, PCRE_INFO_JIT, &jit) == 0
+        && jit == 1) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    pcre_extra* extra = pcre_study(regex->code, PCRE_STUDY_JIT_COMPILE, &errstr);
+    if (extra == NULL) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    if (pcre_fullinfo(regex->code, extra, PCRE_INFO_JIT, &jit) != 0 || jit != 1) {
+        pcre_free_study(extra);
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    if (regex->extra != NULL) {
+        pcre_free_study(regex->extra);
+    }
+    regex->extra = extra;
+
+    return NGX_HTTP_WAF_SUCCESS;
+#else
+    return NGX_HTTP_WAF_FAIL;
+#endif
+}
+
+
+static void _regex_set_jit_warm_up_one(regex_set_t* set, ngx_regex_t* regex) {
+    ngx_str_t str = ngx_string("ngx_waf");
+
+#if (NGX_HAVE_PCRE_JIT && !NGX_PCRE2)
+    if (regex->extra != NULL && _regex_set_jit_stack != NULL) {
+        pcre_assign_jit_stack(regex->extra, NULL, _regex_set_jit_stack);
+    }
+#endif
+
+    /* 第一次执行时会触碰 JIT 代码和栈所在的页面，提前做掉以免落在第一个请求上。 */
+    _regex_set_regex_exec(set, regex, &str, NULL, 0);
+}
+
+
+static ngx_int_t _regex_set_is_combinable(u_char* pattern) {
+    for (u_char* p = pattern; *p != '\0'; p++) {
+        if (*p == '\\') {
+            ++p;
+            /* 反向引用或者 \Q 会受到合并后的捕获组编号或者右括号的影响。 */
+            if ((*p >= '0' && *p <= '9') || *p == 'g' || *p == 'k' || *p == 'Q') {
+                return NGX_HTTP_WAF_FALSE;
+            }
+            if (*p == '\0') {
+                return NGX_HTTP_WAF_FALSE;
+            }
+            continue;
+        }
+
+        if (*p != '(') {
+            continue;
+        }
+
+        /* (*UTF8) 等只能出现在整个表达式的开头。 */
+        if (p[1] == '*') {
+            return NGX_HTTP_WAF_FALSE;
+        }
+
+        if (p[1] != '?') {
+            continue;
+        }
+
+        u_char* q = p + 2;
+        /* 递归、条件、分支重置以及按名称的引用。 */
+        if (*q == 'R' || *q == '&' || *q == '|' || *q == '(' || *q == '+'
+            || (*q >= '0' && *q <= '9')
+            || (*q == '-' && q[1] >= '0' && q[1] <= '9')
+            || (*q == 'P' && (q[1] == '=' || q[1] == '>'))) {
+            return NGX_HTTP_WAF_FALSE;
+        }
+
+        /* (?x) 中的 # 注释会吞掉合并时添加的右括号。 */
+        for (; (*q >= 'a' && *q <= 'z') || (*q >= 'A' && *q <= 'Z') || *q == '-'; q++) {
+            if (*q == 'x') {
+                return NGX_HTTP_WAF_FALSE;
+            }
+        }
+    }
+
+    return NGX_HTTP_WAF_TRUE;
+}
+
+
+static ngx_int_t _regex_set_add_segment(regex_set_t* set, ngx_uint_t start, ngx_uint_t end, ngx_int_t combine) {
+    if (start >= end) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    regex_segment_t* segment = ngx_array_push(set->segments);
+    if (segment == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    segment->regex = NULL;
+    segment->start = start;
+    segment->end = end;
+    segment->group = NULL;
+    segment->captures = 0;
+
+    if (end - start == 1 || combine != NGX_HTTP_WAF_TRUE) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    ngx_regex_elt_t* rules = set->rules->elts;
+    ngx_int_t* captures = set->captures->elts;
+    size_t len = 0;
+
+    for (ngx_uint_t i = start; i < end; i++) {
+        len += ngx_strlen(rules[i].name) + sizeof("()|") - 1;
+    }
+
+    u_char* pattern = ngx_pnalloc(set->pool, len);
+    segment->group = ngx_palloc(set->pool, sizeof(ngx_uint_t) * (end - start));
+    if (pattern == NULL || segment->group == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    /* 每条规则被包裹在一个捕获组中，组号等于之前所有规则的捕获组数量之和再加一。 */
+    u_char* p = pattern;
+    ngx_uint_t group = 1;
+    for (ngx_uint_t i = start; i < end; i++) {
+        if (i != start) {
+            *p++ = '|';
+        }
+        *p++ = '(';
+        p = ngx_cpymem(p, rules[i].name, ngx_strlen(rules[i].name));
+        *p++ = ')';
+
+        segment->group[i - start] = group;
+        group += captures[i] + 1;
+    }
+
+    ngx_regex_compile_t   regex_compile;
+    u_char                errstr[NGX_MAX_CONF_ERRSTR];
+
+    ngx_memzero(&regex_compile, sizeof(ngx_regex_compile_t));
+    regex_compile.pattern.data = pattern;
+    regex_compile.pattern.len = p - pattern;
+    regex_compile.pool = set->pool;
+    regex_compile.err.len = NGX_MAX_CONF_ERRSTR;
+    regex_compile.err.data = errstr;
+
+    /* 比如不同的规则中出现了同名的捕获组，这时退回到逐条匹配。 */
+    if (ngx_regex_compile(&regex_compile) != NGX_OK
+        || regex_compile.captures != (ngx_int_t)group - 1) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    segment->regex = regex_compile.regex;
+    segment->captures = regex_compile.captures;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+static ngx_int_t _regex_set_exec_range(regex_set_t* set, 
+                                       ngx_str_t* str, 
+                                       ngx_uint_t start, 
+                                       ngx_uint_t end, 
+                                       u_char* bitmap, 
+                                       ngx_regex_elt_t** rule) {
+    ngx_regex_elt_t* p = (ngx_regex_elt_t*)(set->rules->elts) + start;
+
+    for (ngx_uint_t i = start; i < end; i++, p++) {
+        if (_regex_set_is_possible(set, i, bitmap) != NGX_HTTP_WAF_TRUE) {
+            continue;
+        }
+
+        memmem_needle_t* needle = set->needles == NULL ? NULL : ((memmem_needle_t**)(set->needles->elts))[i];
+        if (needle != NULL) {
+            if (memmem_needle_exec(needle, str->data, str->len) != NULL) {
+                *rule = p;
+                return NGX_HTTP_WAF_MATCHED;
+            }
+            continue;
+        }
+
+        ngx_int_t rc = _regex_set_regex_exec(set, p->regex, str, NULL, 0);
+        if (rc >= 0) {
+            *rule = p;
+            return NGX_HTTP_WAF_MATCHED;
+        }
+    }
+
+    return NGX_HTTP_WAF_NOT_MATCHED;
+}
+
+
+static ngx_int_t _regex_set_is_possible(regex_set_t* set, ngx_uint_t index, u_char* bitmap) {
+    if (bitmap == NULL) {
+        return NGX_HTTP_WAF_TRUE;
+    }
+
+    regex_literals_t* literals = (regex_literals_t*)(set->literals->elts) + index;
+
+    for (ngx_uint_t i = 0; i < literals->count; i++) {
+        ngx_uint_t id = literals->id[i];
+        if ((bitmap[id / 8] & (1 << (id % 8))) == 0) {
+            return NGX_HTTP_WAF_FALSE;
+        }
+    }
+
+    return NGX_HTTP_WAF_TRUE;
+}
+
+
+static ngx_int_t _regex_set_build_needles(regex_set_t* set) {
+    set->needles = ngx_array_create(set->pool, set->rules->nelts + 1, sizeof(memmem_needle_t*));
+    if (set->needles == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    ngx_regex_elt_t* rules = set->rules->elts;
+    for (ngx_uint_t i = 0; i < set->rules->nelts; i++) {
+        memmem_needle_t** needle = ngx_array_push(set->needles);
+        if (needle == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+        *needle = _regex_set_parse_literal(set->pool, rules[i].name);
+    }
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+/**
+ * @brief 判断一条规则是否只是一个字面量，比如 sqlmap、(?i)(?:sqlmap) 或者 \.git。
+ * @return 是字面量时返回预处理过的模式串，反之或者内存不足时返回 NULL，此时退回到正则匹配。
+*/
+static memmem_needle_t* _regex_set_parse_literal(ngx_pool_t* pool, u_char* pattern) {
+    u_char* p = pattern;
+    u_char* end = pattern + ngx_strlen(pattern);
+    ngx_int_t caseless = NGX_HTTP_WAF_FALSE;
+
+    if (end - p >= 4 && ngx_strncmp(p, "(?i)", 4) == 0) {
+        caseless = NGX_HTTP_WAF_TRUE;
+        p += 4;
+    }
+
+    /* 中间不含任何括号，所以这对括号一定是匹配的。 */
+    if (end - p >= 4 && ngx_strncmp(p, "(?:", 3) == 0 && end[-1] == ')') {
+        p += 3;
+        --end;
+    }
+
+    if (p >= end) {
+        return NULL;
+    }
+
+    u_char* data = ngx_pnalloc(pool, end - p);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    for (; p < end; p++) {
+        if (*p == '\\') {
+            /* 只接受转义的标点符号，\d、\x41 等都不是字面量。 */
+            ++p;
+            if (p == end || !ispunct(*p)) {
+                return NULL;
+            }
+
+        } else if (ngx_strchr("^$.|?*+()[]{}", *p) != NULL) {
+            return NULL;
+        }
+
+        data[len++] = caseless == NGX_HTTP_WAF_TRUE ? (u_char)tolower(*p) : *p;
+    }
+
+    memmem_needle_t* needle = ngx_palloc(pool, sizeof(memmem_needle_t));
+    if (needle == NULL) {
+        return NULL;
+    }
+
+    memmem_needle_init(needle, data, len, caseless);
+
+    return needle;
+}
+
+
+static ngx_int_t _regex_set_build_prefilter(regex_set_t* set) {
+    set->literals = ngx_array_create(set->pool, set->rules->nelts + 1, sizeof(regex_literals_t));
+    set->prefilter = ngx_pcalloc(set->pool, sizeof(ac_automaton_t));
+    if (set->literals == NULL 
+        || set->prefilter == NULL
+        || ac_automaton_init(set->prefilter, gernal_pool, set->pool) != NGX_HTTP_WAF_SUCCESS) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    ngx_regex_elt_t* rules = set->rules->elts;
+    ngx_uint_t filtered = 0;
+
+    for (ngx_uint_t i = 0; i < set->rules->nelts; i++) {
+        regex_literals_t* literals = ngx_array_push(set->literals);
+        ngx_array_t* found = ngx_array_create(set->pool, 4, sizeof(ngx_str_t));
+        if (literals == NULL || found == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+
+        literals->count = 0;
+
+        u_char* begin = rules[i].name;
+        u_char* end = begin + ngx_strlen(begin);
+        if (_regex_set_extract_literals(set->pool, begin, end, found) != NGX_HTTP_WAF_TRUE) {
+            continue;
+        }
+
+        /* 越长的字面量越少见，只保留最长的几个。 */
+        ngx_str_t* lit = found->elts;
+        for (ngx_uint_t j = 0; j < found->nelts; j++) {
+            for (ngx_uint_t k = j + 1; k < found->nelts; k++) {
+                if (lit[k].len > lit[j].len) {
+                    ngx_str_t tmp = lit[j];
+                    lit[j] = lit[k];
+                    lit[k] = tmp;
+                }
+            }
+        }
+
+        for (ngx_uint_t j = 0; j < found->nelts && literals->count < NGX_HTTP_WAF_REGEX_SET_MAX_LITERALS; j++) {
+            ngx_uint_t id;
+            ngx_int_t rc = ac_automaton_add(set->prefilter, lit[j].data, lit[j].len, &id);
+            if (rc == NGX_HTTP_WAF_MALLOC_ERROR) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            } else if (rc != NGX_HTTP_WAF_SUCCESS) {
+                break;
+            }
+            literals->id[literals->count++] = id;
+        }
+
+        if (literals->count != 0) {
+            ++filtered;
+        }
+    }
+
+    if (filtered == 0) {
+        set->prefilter = NULL;
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    return ac_automaton_build(set->prefilter) == NGX_HTTP_WAF_SUCCESS ? NGX_HTTP_WAF_SUCCESS : NGX_HTTP_WAF_MALLOC_ERROR;
+}
+
+
+/**
+ * @brief 找出一段正则表达式匹配成功时必然出现的字面量，结果是保守的。
+ * @return 如果这一段在最外层没有分支则返回 NGX_HTTP_WAF_TRUE，并将找到的字面量追加到 literals 中，
+ *         反之返回 NGX_HTTP_WAF_FALSE，此时 literals 中的内容没有意义。
+*/
+static ngx_int_t _regex_set_extract_literals(ngx_pool_t* pool, u_char* begin, u_char* end, ngx_array_t* literals) {
+    u_char* run = ngx_pnalloc(pool, end - begin + 1);
+    size_t run_len = 0;
+    u_char* p = begin;
+
+    if (run == NULL) {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    #define ngx_http_waf_flush_run() {                                                  \
+        if (run_len >= NGX_HTTP_WAF_REGEX_SET_MIN_LITERAL_LEN) {                       \
+            ngx_str_t* lit = ngx_array_push(literals);                                  \
+            if (lit == NULL) {                                                          \
+                return NGX_HTTP_WAF_FALSE;                                              \
+            }                                                                           \
+            lit->data = run;                                                            \
+            lit->len = run_len;                                                         \
+            run += run_len;                                                             \
+        }                                                                               \
+        run_len = 0;                                                                    \
+    }
+
+    while (p < end) {
+        u_char ch;
+        u_char* next = NULL;
+
+        switch (*p) {
+            case '|':
+                return NGX_HTTP_WAF_FALSE;
+
+            case '\\':
+                if (p + 1 >= end) {
+                    return NGX_HTTP_WAF_FALSE;
+                }
+                /* \d、\x41、\1 等转义序列不是字面量，\Q 则会改变后续内容的含义。 */
+                if (isalnum(p[1])) {
+                    if (p[1] == 'Q') {
+                        return NGX_HTTP_WAF_FALSE;
+                    }
+                    ngx_http_waf_flush_run();
+                    p = _regex_set_skip_escape(p, end);
+                    _regex_set_quantifier(p, end, &p);
+                    continue;
+                }
+                ch = p[1];
+                p += 2;
+                break;
+
+            case '[':
+                ngx_http_waf_flush_run();
+                p = _regex_set_skip_class(p, end);
+                if (p == NULL) {
+                    return NGX_HTTP_WAF_FALSE;
+                }
+                _regex_set_quantifier(p, end, &p);
+                continue;
+
+            case '(':
+            {
+                ngx_http_waf_flush_run();
+                u_char* group_end = _regex_set_skip_group(p, end);
+                if (group_end == NULL) {
+                    return NGX_HTTP_WAF_FALSE;
+                }
+
+                u_char* inner = p + 1;
+                u_char* inner_end = group_end - 1;
+                ngx_int_t has_content = NGX_HTTP_WAF_TRUE;
+
+                if (*inner == '*') {
+                    has_content = NGX_HTTP_WAF_FALSE;
+                } else if (*inner == '?') {
+                    ++inner;
+                    if (*inner == ':' || *inner == '>') {
+                        ++inner;
+                    } else if ((*inner == '<' && inner[1] != '=' && inner[1] != '!')
+                            || (*inner == 'P' && inner[1] == '<')
+                            || *inner == '\'') {
+                        u_char close = *inner == '\'' ? '\'' : '>';
+                        while (inner < inner_end && *inner != close) {
+                            ++inner;
+                        }
+                        ++inner;
+                    } else {
+                        ngx_int_t negated = NGX_HTTP_WAF_FALSE;
+                        while (inner < inner_end && (isalpha(*inner) || *inner == '-')) {
+                            /* 开启了 x 选项后空白和 # 都不再是字面量，放弃这一层。 */
+                            if (*inner == 'x' && negated == NGX_HTTP_WAF_FALSE) {
+                                return NGX_HTTP_WAF_FALSE;
+                            }
+                            if (*inner == '-') {
+                                negated = NGX_HTTP_WAF_TRUE;
+                            }
+                            ++inner;
+                        }
+                        if (inner < inner_end && *inner == ':') {
+                            ++inner;
+                        } else {
+                            /* 选项设置、注释、环视、递归和条件分支。 */
+                            has_content = NGX_HTTP_WAF_FALSE;
+                        }
+                    }
+                }
+
+                /* 可以出现零次的分组里的字面量不是必需的。 */
+                if (_regex_set_quantifier(group_end, end, &p) != 2
+                    && has_content == NGX_HTTP_WAF_TRUE
+                    && inner <= inner_end) {
+                    ngx_uint_t nelts = literals->nelts;
+                    if (_regex_set_extract_literals(pool, inner, inner_end, literals) != NGX_HTTP_WAF_TRUE) {
+                        literals->nelts = nelts;
+                    }
+                }
+                continue;
+            }
+
+            case '.':
+            case '^':
+            case '$':
+                ngx_http_waf_flush_run();
+                _regex_set_quantifier(p + 1, end, &p);
+                continue;
+
+            case '*':
+            case '+':
+            case '?':
+            case ')':
+                ngx_http_waf_flush_run();
+                ++p;
+                continue;
+
+            case '{':
+                if (_regex_set_quantifier(p, end, &next) != 0) {
+                    ngx_http_waf_flush_run();
+                    p = next;
+                    continue;
+                }
+                ch = *p++;
+                break;
+
+            default:
+                ch = *p++;
+                break;
+        }
+
+        switch (_regex_set_quantifier(p, end, &p)) {
+            case 0:
+                run[run_len++] = ngx_tolower(ch);
+                break;
+            case 1:
+                run[run_len++] = ngx_tolower(ch);
+                ngx_http_waf_flush_run();
+                break;
+            default:
+                ngx_http_waf_flush_run();
+                break;
+        }
+    }
+
+    ngx_http_waf_flush_run();
+
+    #undef ngx_http_waf_flush_run
+
+    return NGX_HTTP_WAF_TRUE;
+}
+
+
+/**
+ * @brief 解析 p 处的量词。
+ * @param[out] next 量词之后的位置，没有量词时等于 p。
+ * @return 没有量词时返回 0，至少重复一次时返回 1，可以出现零次时返回 2。
+*/
+static ngx_int_t _regex_set_quantifier(u_char* p, u_char* end, u_char** next) {
+    ngx_int_t ret = 0;
+
+    *next = p;
+
+    if (p >= end) {
+        return 0;
+    }
+
+    if (*p == '?' || *p == '*') {
+        ret = 2;
+        ++p;
+    } else if (*p == '+') {
+        ret = 1;
+        ++p;
+    } else if (*p == '{') {
+        u_char* q = p + 1;
+        ngx_int_t min = 0;
+        ngx_int_t has_min = NGX_HTTP_WAF_FALSE;
+
+        while (q < end && *q >= '0' && *q <= '9') {
+            min = min * 10 + (*q - '0');
+            has_min = NGX_HTTP_WAF_TRUE;
+            ++q;
+        }
+
+        if (q < end && *q == ',') {
+            ++q;
+            while (q < end && *q >= '0' && *q <= '9') {
+                ++q;
+            }
+        }
+
+        /* 不是合法量词的 { 被当作普通字符。 */
+        if (has_min == NGX_HTTP_WAF_FALSE || q >= end || *q != '}') {
+            return 0;
+        }
+
+        ret = min == 0 ? 2 : 1;
+        p = q + 1;
+    } else {
+        return 0;
+    }
+
+    /* 非贪婪和占有量词 */
+    if (p < end && (*p == '?' || *p == '+')) {
+        ++p;
+    }
+
+    *next = p;
+    return ret;
+}
+
+
+static u_char* _regex_set_skip_escape(u_char* p, u_char* end) {
+    u_char* q = p + 2;
+
+    switch (p[1]) {
+        case 'c':
+            return ngx_min(q + 1, end);
+
+        case 'x':
+            if (q < end && *q == '{') {
+                break;
+            }
+            for (int i = 0; i < 2 && q < end && isxdigit(*q); i++) {
+                ++q;
+            }
+            return q;
+
+        case 'g':
+            if (q < end && (*q == '+' || *q == '-')) {
+                ++q;
+            }
+            /* fall through */
+
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            while (q < end && *q >= '0' && *q <= '9') {
+                ++q;
+            }
+            if (p[1] != 'g' || q != p + 2) {
+                return q;
+            }
+            break;
+
+        case 'o': case 'p': case 'P': case 'N': case 'k':
+            break;
+
+        default:
+            return q;
+    }
+
+    /* \x{..}、\p{..}、\g{..}、\k<..> 等 */
+    if (q < end && (*q == '{' || *q == '<' || *q == '\'')) {
+        u_char close = *q == '{' ? '}' : (*q == '<' ? '>' : '\'');
+        while (q < end && *q != close) {
+            ++q;
+        }
+        return ngx_min(q + 1, end);
+    }
+
+    return q;
+}
+
+
+static u_char* _regex_set_skip_class(u_char* p, u_char* end) {
+    ++p;
+
+    if (p < end && *p == '^') {
+        ++p;
+    }
+
+    /* 紧跟在开头的 ] 是普通字符 */
+    if (p < end && *p == ']') {
+        ++p;
+    }
+
+    while (p < end && *p != ']') {
+        if (*p == '\\') {
+            p += 2;
+        } else if (*p == '[' && p + 1 < end && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            u_char delimiter = p[1];
+            p += 2;
+            while (p + 1 < end && !(p[0] == delimiter && p[1] == ']')) {
+                ++p;
+            }
+            p += 2;
+        } else {
+            ++p;
+        }
+    }
+
+    return p < end ? p + 1 : NULL;
+}
+
+
+static u_char* _regex_set_skip_group(u_char* p, u_char* end) {
+    ngx_int_t depth = 0;
+
+    while (p < end) {
+        switch (*p) {
+            case '\\':
+                p += 2;
+                break;
+            case '[':
+                p = _regex_set_skip_class(p, end);
+                if (p == NULL) {
+                    return NULL;
+                }
+                break;
+            case '(':
+                ++depth;
+                ++p;
+                break;
+            case ')':
+                --depth;
+                ++p;
+                if (depth == 0) {
+                    return p;
+                }
+                break;
+            default:
+                ++p;
+                break;
+        }
+    }
+
+    return NULL;
+}
@@ -1,5 +1,74 @@
 #include <ngx_http_waf_module_vm.h>
 
+extern ngx_module_t ngx_http_waf_module; /**< 模块详情 */
+
+
+static void _vm_find_query_string(ngx_str_t* args, ngx_str_t* key, ngx_str_t* out);
+
+
+static void _vm_find_header_in(ngx_list_t* headers, ngx_str_t* key, ngx_str_t* out);
+
+
+static void _vm_find_cookie(ngx_array_t* cookies, ngx_str_t* key, ngx_str_t* out);
+
+
+static ngx_int_t _vm_str_contains(ngx_str_t* haystack, ngx_str_t* needle);
+
+
+static uint64_t _vm_cache_key(ngx_http_request_t* r, ngx_array_t* inputs, uint32_t generation, 
+                              ngx_str_t* url, ngx_str_t* user_agent, ngx_str_t* referer, u_char* fingerprint_key);
+
+
+static vm_node_t* _vm_new_node(ngx_pool_t* pool, vm_code_t* code);
+
+
+static vm_node_t* _vm_optimize_node(ngx_pool_t* pool, vm_node_t* node, vm_predicate_t** predicates);
+
+
+static ngx_int_t _vm_is_predicate(vm_node_t* node);
+
+
+/**
+ * @brief 把谓词及其操作数的指令序列化，作为查找相同谓词时的关键字。
+ * @return 成功返回 NGX_HTTP_WAF_SUCCESS，操作数中有无法比较的参数时返回 NGX_HTTP_WAF_FAIL。
+*/
+static ngx_int_t _vm_predicate_key(ngx_pool_t* pool, vm_node_t* node, ngx_str_t* out);
+
+
+static ngx_int_t _vm_is_url_guard(vm_node_t* node);
+
+
+static ngx_int_t _vm_guard_of(vm_code_t* code, vm_rule_t* rule, ngx_str_t* key, ngx_int_t* is_prefix);
+
+
+static ngx_int_t _vm_index_add(ngx_pool_t* pool, vm_index_item_t** head, ngx_str_t* key, ngx_uint_t rule_no);
+
+
+static ngx_uint_t _vm_index_lookup(vm_index_t* index, ngx_str_t* url, vm_index_cursor_t* cursors);
+
+
+static ngx_int_t _vm_index_next(vm_index_cursor_t* cursors, ngx_uint_t count);
+
+
+/**
+ * @brief 运行完一条规则之后，按照索引找到下一条需要运行的规则。
+ * @param[out] code 下一条规则的第一条指令
+ * @param[out] code_end 下一条规则的最后一条指令的下一条指令
+ * @return 没有索引或者已经没有需要运行的规则时返回 NGX_HTTP_WAF_FALSE，反之为 NGX_HTTP_WAF_TRUE。
+*/
+static ngx_int_t _vm_next_rule(vm_index_t* index, vm_index_cursor_t* cursors, ngx_uint_t count, 
+                               vm_code_t* front, vm_code_t** code, vm_code_t** code_end);
+
+
+static void _vm_emit_node(UT_array* array, vm_node_t* node);
+
+
+static ngx_int_t _vm_build_set(ngx_pool_t* pool, vm_stack_arg_t* argv, ngx_int_t is_ip, const char* file_name, u_char** invalid);
+
+
+static ngx_int_t _vm_set_add(ngx_pool_t* pool, vm_set_t* set, ngx_int_t is_ip, u_char* data, size_t len, u_char** invalid);
+
+
 ngx_int_t ngx_http_waf_vm_exec(ngx_http_request_t* r, ngx_int_t* out_http_status) {
     static ngx_str_t s_empty_str = ngx_string("");
     ngx_http_waf_loc_conf_t* loc_conf = NULL;
@@ -16,8 +85,6 @@ ngx_int_t ngx_http_waf_vm_exec(ngx_http_request_t* r, ngx_int_t* out_http_status
         return ret;
     }
 
-    // ipv4_t client_ipv4;
-
     ngx_str_t* url = &(r->uri);
     if (url->len == 0 || url->data == NULL) {
         url = &s_empty_str;
@@ -33,319 +100,345 @@ ngx_int_t ngx_http_waf_vm_exec(ngx_http_request_t* r, ngx_int_t* out_http_status
         referer = &(r->headers_in.referer->value);
     }
 
-    key_value_t* query_string = NULL;
-    ngx_http_waf_parse_query_string(&(r->args), &query_string);
+    /* 
+     * 执行结果只取决于规则读取的请求字段，所以按照这些字段的值缓存执行结果，
+     * 这些字段都相同的请求直接使用之前的结果，不需要再执行任何指令。
+    */
+    lru_cache_t* cache = NULL;
+    uint64_t cache_key = 0;
+    if (ngx_http_waf_check_flag(loc_conf->waf_mode, NGX_HTTP_WAF_MODE_EXTRA_CACHE) == NGX_HTTP_WAF_TRUE
+        && loc_conf->waf_inspection_capacity != NGX_CONF_UNSET
+        && loc_conf->advanced_inspection_cache != NULL
+        && loc_conf->advanced_inputs != NULL) {
+        ngx_http_waf_main_conf_t* main_conf = ngx_http_get_module_main_conf(r, ngx_http_waf_module);
+        cache = loc_conf->advanced_inspection_cache;
+        cache_key = _vm_cache_key(r, loc_conf->advanced_inputs, loc_conf->advanced_generation, 
+                                  url, user_agent, referer, main_conf->cache_fingerprint_key);
+
+        lru_cache_find_result_t tmp = lru_cache_find(cache, &cache_key, sizeof(cache_key));
+        if (tmp.status == NGX_HTTP_WAF_KEY_EXISTS) {
+            vm_verdict_t* verdict = *(tmp.data);
+            if (verdict->is_matched == NGX_HTTP_WAF_TRUE) {
+                ctx->checked = NGX_HTTP_WAF_TRUE;
+                ctx->blocked = verdict->http_status == NGX_DECLINED ? NGX_HTTP_WAF_FALSE : NGX_HTTP_WAF_TRUE;
+                *out_http_status = verdict->http_status;
+                ngx_strcpy(ctx->rule_type, "ADVANCED");
+                ngx_strcpy(ctx->rule_deatils, verdict->rule_id);
+                return NGX_HTTP_WAF_MATCHED;
+            }
+            return NGX_HTTP_WAF_NOT_MATCHED;
+        }
+    }
+
+    vm_verdict_t verdict;
+    ngx_memzero(&verdict, sizeof(vm_verdict_t));
 
-    key_value_t* header_in = NULL;
-    ngx_http_waf_parse_header(&(r->headers_in.headers), &header_in);
+    /* 
+     * 栈的深度在加载规则时已经检查过，不会越界。
+     * 压入栈中的字符串直接指向请求或者指令中的数据，整个执行过程不分配任何内存。
+    */
+    vm_value_t stack[NGX_HTTP_WAF_VM_STACK_SIZE];
+    vm_value_t* top = stack;
 
-    
+    /* 被多条规则共用的谓词在每个请求中最多求值一次 */
+    u_char memo_known[NGX_HTTP_WAF_VM_MEMO_SIZE / 8];
+    u_char memo_value[NGX_HTTP_WAF_VM_MEMO_SIZE / 8];
+    ngx_memzero(memo_known, sizeof(memo_known));
+    vm_code_t* front = (vm_code_t*)utarray_front(loc_conf->advanced_rule);
+    vm_code_t* code = front;
+    vm_code_t* code_end = front + utarray_len(loc_conf->advanced_rule);
 
-    vm_stack_arg_t* stack = NULL;
-    vm_code_t* code = NULL;
+    /* 有索引时只依次运行没有前提的规则和前提可能成立的规则 */
+    vm_index_t* index = loc_conf->advanced_index;
+    vm_index_cursor_t cursors[NGX_HTTP_WAF_VM_INDEX_MAX_PREFIXES + 2];
+    ngx_uint_t cursor_count = 0;
+    if (index != NULL) {
+        cursor_count = _vm_index_lookup(index, url, cursors);
+        code_end = code;
+    }
+
+    #define ngx_http_waf_vm_push_str(str) {     \
+        top->type = VM_DATA_STR;                \
+        top->value.str_val = (str);             \
+        top->operand = NULL;                    \
+        ++top;                                  \
+    }
 
-    while (code = (vm_code_t*)utarray_next(loc_conf->advanced_rule, code), code != NULL) {
+    for (; code < code_end || _vm_next_rule(index, cursors, cursor_count, front, &code, &code_end) == NGX_HTTP_WAF_TRUE; code++) {
         vm_stack_arg_t* argv = &(code->argv);
         switch (code->type) {
             case VM_CODE_PUSH_INT:
+                top->type = VM_DATA_INT;
+                top->value.int_val = argv->value[0].int_val;
+                top->operand = NULL;
+                ++top;
                 break;
             
-            case VM_CODE_PUSH_STR:
+            case VM_CODE_PUSH_BOOL:
+                top->type = VM_DATA_BOOL;
+                top->value.bool_val = argv->value[0].bool_val;
+                top->operand = NULL;
+                ++top;
+                break;
+
+            case VM_CODE_JMP_FALSE_OR_POP:
+                if (!top[-1].value.bool_val) {
+                    code += argv->value[0].int_val - 1;
+                } else {
+                    --top;
+                }
+                break;
+
+            case VM_CODE_JMP_TRUE_OR_POP:
+                if (top[-1].value.bool_val) {
+                    code += argv->value[0].int_val - 1;
+                } else {
+                    --top;
+                }
+                break;
+
+            case VM_CODE_LOAD_MEMO:
+            {
+                int slot = argv->value[0].int_val;
+                if (memo_known[slot >> 3] & (1 << (slot & 7))) {
+                    top->type = VM_DATA_BOOL;
+                    top->value.bool_val = (memo_value[slot >> 3] >> (slot & 7)) & 1;
+                    top->operand = NULL;
+                    ++top;
+                    code += argv->value[1].int_val - 1;
+                }
+                break;
+            }
+
+            case VM_CODE_STORE_MEMO:
             {
-                vm_stack_arg_t* temp = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                temp->type[0] = VM_DATA_STR;
-                temp->argc = 1;
-                temp->value[0].str_val.data = ngx_pcalloc(r->pool, sizeof(u_char) * (argv->value[0].str_val.len + 1));
-                temp->value[0].str_val.len = argv->value[0].str_val.len;
-                ngx_memcpy(temp->value[0].str_val.data, argv->value[0].str_val.data, sizeof(u_char) * argv->value[0].str_val.len);
-                STACK_PUSH2(stack, temp, utstack_handle);
+                int slot = argv->value[0].int_val;
+                memo_known[slot >> 3] |= (u_char)(1 << (slot & 7));
+                if (top[-1].value.bool_val) {
+                    memo_value[slot >> 3] |= (u_char)(1 << (slot & 7));
+                } else {
+                    memo_value[slot >> 3] &= (u_char)~(1 << (slot & 7));
+                }
                 break;
             }
 
+            case VM_CODE_PUSH_STR:
+                ngx_http_waf_vm_push_str(argv->value[0].str_val);
+                /* 连同加载规则时预编译好的操作数一起压入栈中 */
+                top[-1].operand = argv;
+                break;
+
             case VM_CODE_PUSH_CLIENT_IP:
             {
-                vm_stack_arg_t* temp = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
+                top->type = VM_DATA_VOID;
+                top->operand = NULL;
 
                 if (r->connection->sockaddr->sa_family == AF_INET) {
                     struct sockaddr_in* sin = (struct sockaddr_in*)r->connection->sockaddr;
-                    temp->type[0] = VM_DATA_IPV4;
-                    ngx_memcpy(&(temp->value[0].inx_addr_val.ipv4), &(sin->sin_addr), sizeof(struct in_addr));
+                    top->type = VM_DATA_IPV4;
+                    ngx_memcpy(&(top->value.inx_addr_val.ipv4), &(sin->sin_addr), sizeof(struct in_addr));
                 } 
 #if (NGX_HAVE_INET6)
                 else if (r->connection->sockaddr->sa_family == AF_INET6) {
                     struct sockaddr_in6* sin6 = (struct sockaddr_in6*)r->connection->sockaddr;
-                    temp->type[0] = VM_DATA_IPV6;
-                    ngx_memcpy(&(temp->value[0].inx_addr_val.ipv6), &(sin6->sin6_addr), sizeof(struct in_addr));
+                    top->type = VM_DATA_IPV6;
+                    ngx_memcpy(&(top->value.inx_addr_val.ipv6), &(sin6->sin6_addr), sizeof(struct in6_addr));
                 }
 #endif
-                temp->argc = 1;
-                STACK_PUSH2(stack, temp, utstack_handle);
+                ++top;
                 break;
             }
 
             case VM_CODE_PUSH_URL:
-            {
-                vm_stack_arg_t* temp = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                temp->type[0] = VM_DATA_STR;
-                temp->argc = 1;
-                temp->value[0].str_val.data = ngx_pcalloc(r->pool, sizeof(u_char) * (url->len + 1));
-                temp->value[0].str_val.len = url->len;
-                ngx_memcpy(temp->value[0].str_val.data, url->data, sizeof(u_char) * url->len);
-                STACK_PUSH2(stack, temp, utstack_handle);
+                ngx_http_waf_vm_push_str(*url);
                 break;
-            }
 
             case VM_CODE_PUSH_USER_AGENT:
-            {
-                vm_stack_arg_t* temp = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                temp->type[0] = VM_DATA_STR;
-                temp->argc = 1;
-                temp->value[0].str_val.data = ngx_pcalloc(r->pool, sizeof(u_char) * (user_agent->len + 1));
-                temp->value[0].str_val.len = user_agent->len;
-                ngx_memcpy(temp->value[0].str_val.data, user_agent->data, sizeof(u_char) * user_agent->len);
-                STACK_PUSH2(stack, temp, utstack_handle);
+                ngx_http_waf_vm_push_str(*user_agent);
                 break;
-            }
 
             case VM_CODE_PUSH_REFERER:
-            {
-                vm_stack_arg_t* temp = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                temp->type[0] = VM_DATA_STR;
-                temp->argc = 1;
-                temp->value[0].str_val.data = ngx_pcalloc(r->pool, sizeof(u_char) * (referer->len + 1));
-                temp->value[0].str_val.len = referer->len;
-                ngx_memcpy(temp->value[0].str_val.data, referer->data, sizeof(u_char) * referer->len);
-                STACK_PUSH2(stack, temp, utstack_handle);
+                ngx_http_waf_vm_push_str(*referer);
                 break;
-            }
 
             case VM_CODE_PUSH_QUERY_STRING:
-            {
-                vm_stack_arg_t* result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_STR;
-                result->argc = 1;
-                key_value_t* temp = NULL;
-                HASH_FIND(hh, query_string, argv->value[0].str_val.data, argv->value[0].str_val.len * sizeof(u_char), temp);
-                if (temp != NULL) {
-                    result->value[0].str_val.data = ngx_pcalloc(r->pool, sizeof(u_char) * (temp->value.len + 1));
-                    ngx_memcpy(result->value[0].str_val.data, temp->value.data, sizeof(u_char) * temp->value.len);
-                    result->value[0].str_val.len = temp->value.len;
-                } else {
-                    result->value[0].str_val.data = ngx_pcalloc(r->pool, 1);
-                    result->value[0].str_val.len = 0;
-                }
-                STACK_PUSH2(stack, result, utstack_handle);
+                ngx_http_waf_vm_push_str(s_empty_str);
+                _vm_find_query_string(&(r->args), &(argv->value[0].str_val), &(top[-1].value.str_val));
                 break;
-            }
 
             case VM_CODE_PUSH_HEADER_IN:
-            {
-                ngx_str_t header_key;
-                header_key.data = ngx_strdup(argv->value[0].str_val.data);
-                header_key.len = argv->value[0].str_val.len;
-                ngx_strlow(header_key.data, header_key.data, header_key.len);
-
-                key_value_t* temp = NULL;
-                HASH_FIND(hh, header_in, header_key.data, header_key.len * sizeof(u_char), temp);
-
-                free(header_key.data);
-                header_key.len = 0;
-
-                vm_stack_arg_t* result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_STR;
-                result->argc = 1;
-                
-                if (temp != NULL) {
-                    result->value[0].str_val.data = ngx_pcalloc(r->pool, sizeof(u_char) * (temp->value.len + 1));
-                    ngx_memcpy(result->value[0].str_val.data, temp->value.data, sizeof(u_char) * temp->value.len);
-                    result->value[0].str_val.len = temp->value.len;
-                } else {
-                    result->value[0].str_val.data = ngx_pcalloc(r->pool, sizeof(u_char));
-                    result->value[0].str_val.len = 0;
-                }
-                STACK_PUSH2(stack, result, utstack_handle);
+                ngx_http_waf_vm_push_str(s_empty_str);
+                _vm_find_header_in(&(r->headers_in.headers), &(argv->value[0].str_val), &(top[-1].value.str_val));
+                break;
+
+            case VM_CODE_PUSH_COOKIE:
+                ngx_http_waf_vm_push_str(s_empty_str);
+                _vm_find_cookie(&(r->headers_in.cookies), &(argv->value[0].str_val), &(top[-1].value.str_val));
                 break;
-            }
             
             case VM_CODE_OP_NOT:
-            {
-                vm_stack_arg_t* temp = NULL;
-                STACK_POP2(stack, temp, utstack_handle);
-                temp->value[0].bool_val = !temp->value[0].bool_val;
-                STACK_PUSH2(stack, temp, utstack_handle);
+                top[-1].value.bool_val = !top[-1].value.bool_val;
                 break;
-            }
 
             case VM_CODE_OP_AND:
             case VM_CODE_OP_OR:
             {
-                vm_stack_arg_t *left = NULL, *right = NULL, *result = NULL;
-                STACK_POP2(stack, left, utstack_handle);
-                STACK_POP2(stack, right, utstack_handle);
-                result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_BOOL;
-                result->argc = 1;
+                vm_value_t* left = top - 1;
+                vm_value_t* right = top - 2;
+                uint8_t bool_val;
                 if (code->type == VM_CODE_OP_AND) {
-                    result->value[0].bool_val = left->value[0].bool_val && right->value[0].bool_val;
+                    bool_val = left->value.bool_val && right->value.bool_val;
                 } else {
-                    result->value[0].bool_val = left->value[0].bool_val || right->value[0].bool_val;
+                    bool_val = left->value.bool_val || right->value.bool_val;
                 }
-                STACK_PUSH2(stack, result, utstack_handle);
+                --top;
+                top[-1].type = VM_DATA_BOOL;
+                top[-1].value.bool_val = bool_val;
+                top[-1].operand = NULL;
                 break;
             }
             
             case VM_CODE_OP_BELONG_TO:
             {
-                vm_stack_arg_t *left = NULL, *right = NULL, *result = NULL;
-                STACK_POP2(stack, left, utstack_handle);
-                STACK_POP2(stack, right, utstack_handle);
-                result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_BOOL;
-                result->argc = 1;
-
-                if (left->type[0] == VM_DATA_IPV4 && right->type[0] == VM_DATA_STR) {
+                vm_value_t* left = top - 1;
+                vm_value_t* right = top - 2;
+                vm_stack_arg_t* operand = right->operand;
+                uint8_t bool_val = 0;
+
+                if (left->type == VM_DATA_IPV4 && right->type == VM_DATA_STR) {
                     ipv4_t ipv4;
-                    if (ngx_http_waf_parse_ipv4(right->value[0].str_val, &ipv4) == NGX_HTTP_WAF_SUCCESS) {
-                        if (ngx_http_waf_ipv4_netcmp(left->value[0].inx_addr_val.ipv4.s_addr, &ipv4) == NGX_HTTP_WAF_MATCHED) {
-                            result->value[0].bool_val = 1;
-                        } else {
-                            result->value[0].bool_val = 0;
-                        }
-                    } else {
-                        result->value[0].bool_val = 0;
+                    ipv4_t* block = NULL;
+                    if (operand != NULL && operand->argc > 1) {
+                        block = operand->type[1] == VM_DATA_IPV4_BLOCK ? &(operand->value[1].ipv4_val) : NULL;
+                    } else if (ngx_http_waf_parse_ipv4(right->value.str_val, &ipv4) == NGX_HTTP_WAF_SUCCESS) {
+                        block = &ipv4;
                     }
-                    
+
+                    bool_val = block != NULL 
+                        && ngx_http_waf_ipv4_netcmp(left->value.inx_addr_val.ipv4.s_addr, block) == NGX_HTTP_WAF_MATCHED;
                 } 
 #if (NGX_HAVE_INET6)
-                else if (left->type[0] == VM_DATA_IPV6 && right->type[0] == VM_DATA_STR) {
+                else if (left->type == VM_DATA_IPV6 && right->type == VM_DATA_STR) {
                     ipv6_t ipv6;
-                    if (ngx_http_waf_parse_ipv6(right->value[0].str_val, &ipv6) == NGX_HTTP_WAF_SUCCESS) {
-                        if (ngx_http_waf_ipv6_netcmp(left->value[0].inx_addr_val.ipv6.s6_addr, &ipv6) == NGX_HTTP_WAF_MATCHED) {
-                            result->value[0].bool_val = 1;
-                        } else {
-                            result->value[0].bool_val = 0;
-                        }
-                    } else {
-                        result->value[0].bool_val = 0;
+                    ipv6_t* block = NULL;
+                    if (operand != NULL && operand->argc > 1) {
+                        block = operand->type[2] == VM_DATA_IPV6_BLOCK ? &(operand->value[2].ipv6_val) : NULL;
+                    } else if (ngx_http_waf_parse_ipv6(right->value.str_val, &ipv6) == NGX_HTTP_WAF_SUCCESS) {
+                        block = &ipv6;
                     }
+
+                    bool_val = block != NULL 
+                        && ngx_http_waf_ipv6_netcmp(left->value.inx_addr_val.ipv6.s6_addr, block) == NGX_HTTP_WAF_MATCHED;
                 } 
 #endif
-                else {
-                    result->value[0].bool_val = 0;
-                }
-                STACK_PUSH2(stack, result, utstack_handle);
+
+                --top;
+                top[-1].type = VM_DATA_BOOL;
+                top[-1].value.bool_val = bool_val;
+                top[-1].operand = NULL;
                 break;
             }
 
             case VM_CODE_OP_EQUALS:
             {
-                vm_stack_arg_t *left = NULL, *right = NULL, *result = NULL;
-                STACK_POP2(stack, left, utstack_handle);
-                STACK_POP2(stack, right, utstack_handle);
-                result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_BOOL;
-                result->argc = 1;
-                if (left->type[0] == VM_DATA_STR && right->type[0] == VM_DATA_STR) {
-                    if (ngx_strcmp(left->value[0].str_val.data, right->value[0].str_val.data) == 0) {
-                        result->value[0].bool_val = 1;
-                    } else {
-                        result->value[0].bool_val = 0;
-                    }
-                } else if (left->type[0] == VM_DATA_IPV4 && right->type[0] == VM_DATA_STR) {
-                    struct in_addr addr4;
-                    if (inet_pton(AF_INET, (char*)right->value[0].str_val.data, &addr4) != 1) {
-                        result->value[0].bool_val = 0;
-                    } else {
-                        result->value[0].bool_val = ngx_memcmp(&(left->value[0].inx_addr_val.ipv4), 
-                                                               &addr4, 
-                                                                sizeof(struct in_addr));
+                vm_value_t* left = top - 1;
+                vm_value_t* right = top - 2;
+                vm_stack_arg_t* operand = right->operand;
+                uint8_t bool_val = 0;
+
+                if (left->type == VM_DATA_STR && right->type == VM_DATA_STR) {
+                    bool_val = left->value.str_val.len == right->value.str_val.len
+                        && ngx_memcmp(left->value.str_val.data, right->value.str_val.data, left->value.str_val.len) == 0;
+
+                } else if (left->type == VM_DATA_IPV4 && right->type == VM_DATA_STR) {
+                    struct in_addr* addr = NULL;
+                    if (operand != NULL && operand->argc > 1 && operand->type[1] == VM_DATA_IPV4) {
+                        addr = &(operand->value[1].inx_addr_val.ipv4);
                     }
-                    
+
+                    bool_val = addr != NULL 
+                        && ngx_memcmp(&(left->value.inx_addr_val.ipv4), addr, sizeof(struct in_addr)) == 0;
                 } 
 #if (NGX_HAVE_INET6)
-                else if (left->type[0] == VM_DATA_IPV6 && right->type[0] == VM_DATA_STR) {
-                    struct in6_addr addr6;
-                    if (inet_pton(AF_INET6, (char*)right->value[0].str_val.data, &addr6) != 1) {
-                        result->value[0].bool_val = 0;
-                    } else {
-                        result->value[0].bool_val = ngx_memcmp(&(left->value[0].inx_addr_val.ipv6), 
-                                                               &addr6, 
-                                                                sizeof(struct in6_addr));
+                else if (left->type == VM_DATA_IPV6 && right->type == VM_DATA_STR) {
+                    struct in6_addr* addr = NULL;
+                    if (operand != NULL && operand->argc > 2 && operand->type[2] == VM_DATA_IPV6) {
+                        addr = &(operand->value[2].inx_addr_val.ipv6);
                     }
+
+                    bool_val = addr != NULL 
+                        && ngx_memcmp(&(left->value.inx_addr_val.ipv6), addr, sizeof(struct in6_addr)) == 0;
                 } 
 #endif
-                else {
-                    result->value[0].bool_val = 0;
-                }
 
-                STACK_PUSH2(stack, result, utstack_handle);
+                --top;
+                top[-1].type = VM_DATA_BOOL;
+                top[-1].value.bool_val = bool_val;
+                top[-1].operand = NULL;
                 break;
             }
 
             case VM_CODE_OP_CONTAINS:
             {
-                vm_stack_arg_t *left = NULL, *right = NULL, *result = NULL;
-                STACK_POP2(stack, left, utstack_handle);
-                STACK_POP2(stack, right, utstack_handle);
-                result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_BOOL;
-                result->argc = 1;
-                if (ngx_strstr(left->value[0].str_val.data, right->value[0].str_val.data) != NULL) {
-                    result->value[0].bool_val = 1;
+                vm_value_t* left = top - 1;
+                vm_value_t* right = top - 2;
+                vm_stack_arg_t* operand = right->operand;
+                uint8_t bool_val;
+
+                if (operand != NULL && operand->argc > 1 && operand->type[1] == VM_DATA_NEEDLE) {
+                    memmem_needle_t* needle = operand->value[1].needle_val;
+                    bool_val = needle->len == 0 
+                            || memmem_needle_exec(needle, left->value.str_val.data, left->value.str_val.len) != NULL;
                 } else {
-                    result->value[0].bool_val = 0;
+                    bool_val = _vm_str_contains(&(left->value.str_val), &(right->value.str_val)) == NGX_HTTP_WAF_TRUE;
                 }
-                STACK_PUSH2(stack, result, utstack_handle);
+
+                --top;
+                top[-1].type = VM_DATA_BOOL;
+                top[-1].value.bool_val = bool_val;
+                top[-1].operand = NULL;
                 break;
             }
 
             case VM_CODE_OP_MATCHES:
             {
-                vm_stack_arg_t *left = NULL, *right = NULL, *result = NULL;
-                STACK_POP2(stack, left, utstack_handle);
-                STACK_POP2(stack, right, utstack_handle);
-
-                result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_BOOL;
-                result->argc = 1;
-
-                ngx_regex_compile_t   regex_compile;
-                u_char errstr[NGX_MAX_CONF_ERRSTR];
-                ngx_regex_elt_t* ngx_regex_elt = ngx_pcalloc(r->pool, sizeof(ngx_regex_elt_t));
-                ngx_memzero(&regex_compile, sizeof(ngx_regex_compile_t));
-                ngx_memcpy(&(regex_compile.pattern), &(right->value[0].str_val), sizeof(ngx_str_t));
-                regex_compile.pool = r->pool;
-                regex_compile.err.len = NGX_MAX_CONF_ERRSTR;
-                regex_compile.err.data = errstr;
+                vm_value_t* left = top - 1;
+                vm_value_t* right = top - 2;
+                vm_stack_arg_t* operand = right->operand;
+                ngx_regex_t* regex = NULL;
 
-                if (ngx_regex_compile(&regex_compile) != NGX_OK) {
-                    result->value[0].bool_val = 0;
+                if (operand != NULL && operand->argc > 1 && operand->type[1] == VM_DATA_REGEX) {
+                    regex = operand->value[1].regex_val;
                 } else {
-                     ngx_regex_elt->regex = regex_compile.regex;
-                     ngx_int_t rc = ngx_regex_exec(ngx_regex_elt->regex, &(left->value[0].str_val), NULL, 0);
-                    if (rc >= 0) {
-                        result->value[0].bool_val = 1;
-                    } else {
-                        result->value[0].bool_val = 0;
+                    /* 右操作数不是字面量（比如 url matches referer）时只能在这里编译 */
+                    ngx_regex_compile_t   regex_compile;
+                    u_char errstr[NGX_MAX_CONF_ERRSTR];
+                    ngx_memzero(&regex_compile, sizeof(ngx_regex_compile_t));
+                    ngx_memcpy(&(regex_compile.pattern), &(right->value.str_val), sizeof(ngx_str_t));
+                    regex_compile.pool = r->pool;
+                    regex_compile.err.len = NGX_MAX_CONF_ERRSTR;
+                    regex_compile.err.data = errstr;
+
+                    if (ngx_regex_compile(&regex_compile) == NGX_OK) {
+                        regex = regex_compile.regex;
                     }
                 }
-                
-                STACK_PUSH2(stack, result, utstack_handle);
+
+                uint8_t bool_val = regex != NULL && ngx_regex_exec(regex, &(left->value.str_val), NULL, 0) >= 0;
+                --top;
+                top[-1].type = VM_DATA_BOOL;
+                top[-1].value.bool_val = bool_val;
+                top[-1].operand = NULL;
                 break;
             }
 
             case VM_CODE_OP_SQLI_DETN:
             {
-                vm_stack_arg_t *operand = NULL, *result = NULL;
-                STACK_POP2(stack, operand, utstack_handle);
-                result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_BOOL;
-                result->argc = 1;
-                
+                vm_value_t* operand = top - 1;
                 sfilter sf;
                 libinjection_sqli_init(&sf, 
-                                        (char*)(operand->value[0].str_val.data), 
-                                        operand->value[0].str_val.len,
+                                        (char*)(operand->value.str_val.data), 
+                                        operand->value.str_val.len,
                                         FLAG_NONE | 
                                         FLAG_QUOTE_NONE | 
                                         FLAG_QUOTE_SINGLE | 
@@ -353,62 +446,70 @@ ngx_int_t ngx_http_waf_vm_exec(ngx_http_request_t* r, ngx_int_t* out_http_status
                                         FLAG_SQL_ANSI | 
                                         FLAG_SQL_MYSQL);
 
-                if (libinjection_is_sqli(&sf) == 1) {
-                    result->value[0].bool_val = 1;
-                } else {
-                    result->value[0].bool_val = 0;
-                }
-
-                STACK_PUSH2(stack, result, utstack_handle);
+                operand->type = VM_DATA_BOOL;
+                operand->value.bool_val = libinjection_is_sqli(&sf) == 1;
+                operand->operand = NULL;
                 break;
             }
 
             case VM_CODE_OP_XSS_DETN:
             {
-                vm_stack_arg_t *operand = NULL, *result = NULL;
-                STACK_POP2(stack, operand, utstack_handle);
-                result = ngx_pcalloc(r->pool, sizeof(vm_stack_arg_t));
-                result->type[0] = VM_DATA_BOOL;
-                result->argc = 1;
-                
-                if (libinjection_xss((char*)(operand->value[0].str_val.data), operand->value[0].str_val.len) == 1) {
-                    result->value[0].bool_val = 1;
-                } else {
-                    result->value[0].bool_val = 0;
-                }
-
-                STACK_PUSH2(stack, result, utstack_handle);
+                vm_value_t* operand = top - 1;
+                uint8_t bool_val = libinjection_xss((char*)(operand->value.str_val.data), operand->value.str_val.len) == 1;
+                operand->type = VM_DATA_BOOL;
+                operand->value.bool_val = bool_val;
+                operand->operand = NULL;
                 break;
             }
 
-            case VM_CODE_ACT_RETURN:
+            case VM_CODE_OP_IN:
             {
-                vm_stack_arg_t *bool_val = NULL, *id = NULL;
-                STACK_POP2(stack, bool_val, utstack_handle);
-                STACK_POP2(stack, id, utstack_handle);
-                if (bool_val->value->bool_val) {
-                    ctx->blocked = NGX_HTTP_WAF_TRUE;
-                    ctx->checked = NGX_HTTP_WAF_TRUE;
-                    *out_http_status = argv->value[0].int_val;
-                    ngx_strcpy(ctx->rule_type, "ADVANCED");
-                    ngx_strcpy(ctx->rule_deatils, id->value[0].str_val.data);
-                    ret = NGX_HTTP_WAF_MATCHED;
-                    goto RELEASE;
+                vm_value_t* operand = top - 1;
+                vm_set_t* set = argv->argc > 2 && argv->type[2] == VM_DATA_SET ? argv->value[2].set_val : NULL;
+                ip_trie_node_t* ip_trie_node = NULL;
+                uint8_t bool_val = 0;
+
+                /* 集合在加载规则时建立，查找的代价与集合的大小无关。 */
+                if (set != NULL && operand->type == VM_DATA_STR) {
+                    vm_set_item_t* item = NULL;
+                    HASH_FIND(hh, set->strings, operand->value.str_val.data, operand->value.str_val.len, item);
+                    bool_val = item != NULL;
+                } else if (set != NULL && set->ipv4 != NULL && operand->type == VM_DATA_IPV4) {
+                    bool_val = ip_trie_find(set->ipv4, &(operand->value.inx_addr_val), &ip_trie_node) == NGX_HTTP_WAF_SUCCESS;
+                }
+#if (NGX_HAVE_INET6)
+                else if (set != NULL && set->ipv6 != NULL && operand->type == VM_DATA_IPV6) {
+                    bool_val = ip_trie_find(set->ipv6, &(operand->value.inx_addr_val), &ip_trie_node) == NGX_HTTP_WAF_SUCCESS;
                 }
+#endif
+
+                operand->type = VM_DATA_BOOL;
+                operand->value.bool_val = bool_val;
+                operand->operand = NULL;
                 break;
             }
 
+            case VM_CODE_ACT_RETURN:
             case VM_CODE_ACT_ALLOW:
             {
-                vm_stack_arg_t *bool_val = NULL, *id = NULL;
-                STACK_POP2(stack, bool_val, utstack_handle);
-                STACK_POP2(stack, id, utstack_handle);
-                if (bool_val->value->bool_val) {
-                    ctx->blocked = NGX_HTTP_WAF_FALSE;
+                vm_value_t* bool_val = top - 1;
+                vm_value_t* id = top - 2;
+                top -= 2;
+                if (bool_val->value.bool_val) {
                     ctx->checked = NGX_HTTP_WAF_TRUE;
-                    *out_http_status = NGX_DECLINED;
+                    if (code->type == VM_CODE_ACT_RETURN) {
+                        ctx->blocked = NGX_HTTP_WAF_TRUE;
+                        *out_http_status = argv->value[0].int_val;
+                    } else {
+                        ctx->blocked = NGX_HTTP_WAF_FALSE;
+                        *out_http_status = NGX_DECLINED;
+                    }
                     ngx_strcpy(ctx->rule_type, "ADVANCED");
-                    ngx_strcpy(ctx->rule_deatils, id->value[0].str_val.data);
+                    /* 规则的 ID 由 PUSH_STR 压入，指向指令中以 '\0' 结尾的字符串。 */
+                    ngx_strcpy(ctx->rule_deatils, id->value.str_val.data);
+                    verdict.is_matched = NGX_HTTP_WAF_TRUE;
+                    verdict.http_status = *out_http_status;
+                    verdict.rule_id = id->value.str_val.data;
                     ret = NGX_HTTP_WAF_MATCHED;
                     goto RELEASE;
                 }
@@ -420,96 +521,1554 @@ ngx_int_t ngx_http_waf_vm_exec(ngx_http_request_t* r, ngx_int_t* out_http_status
         }
     }
 
-    RELEASE: ;
+    #undef ngx_http_waf_vm_push_str
 
-    key_value_t *temp0 = NULL, *temp1 = NULL;
-    HASH_ITER(hh, query_string, temp0, temp1) {
-        HASH_DEL(query_string, temp0);
-        free(temp0->key.data);
-        free(temp0->value.data);
-        free(temp0);
-    }
+    RELEASE: ;
 
-    temp0 = NULL;
-    temp1 = NULL;
-    HASH_ITER(hh, header_in, temp0, temp1) {
-        HASH_DEL(header_in, temp0);
-        free(temp0->key.data);
-        free(temp0->value.data);
-        free(temp0);
+    if (cache != NULL) {
+        lru_cache_add_result_t tmp = lru_cache_add(cache, &cache_key, sizeof(cache_key));
+        if (tmp.status == NGX_HTTP_WAF_SUCCESS) {
+            ngx_memcpy(*(tmp.data), &verdict, sizeof(vm_verdict_t));
+        }
     }
 
     return ret;
 }
 
 
-void ngx_http_waf_print_code(UT_array* array) {
-    vm_code_t* p = NULL;
-    while (p = (vm_code_t*)utarray_next(array, p), p != NULL) {
-        vm_code_t* q = p;
-        switch (q->type) {
+ngx_int_t ngx_http_waf_vm_optimize(UT_array* array, ngx_pool_t* pool) {
+    ngx_uint_t len = utarray_len(array);
+
+    if (len == 0) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    vm_node_t** stack = ngx_palloc(pool, sizeof(vm_node_t*) * len);
+    ngx_array_t* rules = ngx_array_create(pool, 16, sizeof(vm_node_t*));
+    if (stack == NULL || rules == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    /* 将后缀形式的指令还原成每条规则一棵的表达式树 */
+    ngx_uint_t depth = 0;
+    for (ngx_uint_t i = 0; i < len; i++) {
+        vm_code_t* code = (vm_code_t*)utarray_eltptr(array, i);
+        vm_node_t* node = _vm_new_node(pool, code);
+        if (node == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+
+        switch (code->type) {
             case VM_CODE_PUSH_INT:
-                printf("PUSH_INT %d\n", q->argv.value[0].int_val);
-                break;
+            case VM_CODE_PUSH_BOOL:
             case VM_CODE_PUSH_STR:
-                printf("PUSH_STR %s\n", q->argv.value[0].str_val.data);
-                break;
             case VM_CODE_PUSH_CLIENT_IP:
-                printf("PUSH_CLIENT_IP\n");
-                break;
             case VM_CODE_PUSH_URL:
-                printf("PUSH_URL\n");
-                break;
-            case VM_CODE_PUSH_USER_AGENT:
-                printf("PUSH_USER_AGENT\n");
-                break;
             case VM_CODE_PUSH_QUERY_STRING:
-                printf("PUSH_QUERY_STRING %s\n", (char*)(q->argv.value[0].str_val.data));
-                break;
             case VM_CODE_PUSH_REFERER:
-                printf("PUSH_REFERER\n");
-                break;
+            case VM_CODE_PUSH_USER_AGENT:
             case VM_CODE_PUSH_HEADER_IN:
-                printf("PUSH_HEADER_IN %s\n", (char*)(q->argv.value[0].str_val.data));
+            case VM_CODE_PUSH_COOKIE:
                 break;
+
             case VM_CODE_OP_NOT:
-                printf("OP_NOT\n");
+            case VM_CODE_OP_SQLI_DETN:
+            case VM_CODE_OP_XSS_DETN:
+            case VM_CODE_OP_IN:
+                if (depth < 1) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                node->child[0] = stack[--depth];
                 break;
+
             case VM_CODE_OP_AND:
-                printf("OP_AND\n");
-                break;
             case VM_CODE_OP_OR:
-                printf("OP_OR\n");
+                if (depth < 2) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                node->child[1] = stack[--depth];
+                node->child[0] = stack[--depth];
                 break;
+
             case VM_CODE_OP_CONTAINS:
-                printf("OP_CONTAINS\n");
-                break;
             case VM_CODE_OP_MATCHES:
-                printf("OP_MATCHES\n");
-                break;
             case VM_CODE_OP_EQUALS:
-                printf("OP_EQUALS\n");
-                break;
             case VM_CODE_OP_BELONG_TO:
-                printf("OP_BELONG_TO\n");
-                break;
             case VM_CODE_ACT_RETURN:
-                printf("ACT_RET %d\n", q->argv.value[0].int_val);
-                break;
             case VM_CODE_ACT_ALLOW:
-                printf("ACT_ALLOW\n");
-                break;
-            case VM_CODE_OP_SQLI_DETN:
-                printf("OP_SQLI_DETN\n");
+                if (depth < 2) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                node->child[0] = stack[--depth];
+                node->child[1] = stack[--depth];
                 break;
-            case VM_CODE_OP_XSS_DETN:
-                printf("OP_XSS_DETN\n");
+
+            /* 已经优化过或者无法识别的指令，保持原样。 */
+            default:
+                return NGX_HTTP_WAF_SUCCESS;
+        }
+
+        if (code->type == VM_CODE_ACT_RETURN || code->type == VM_CODE_ACT_ALLOW) {
+            vm_node_t** p = ngx_array_push(rules);
+            if (p == NULL) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            }
+            *p = node;
+        } else {
+            stack[depth++] = node;
+        }
+    }
+
+    if (depth != 0) {
+        return NGX_HTTP_WAF_FAIL;
+    }
+
+    /* 
+     * 所有规则中相同的谓词共用一个节点，整个规则集构成一个有向无环图。
+     * 按照序列化之后的指令在哈希表中查找相同的谓词，加载规则的时间与谓词的数量成正比。
+    */
+    vm_predicate_t* predicates = NULL;
+
+    vm_node_t** rule = rules->elts;
+    for (ngx_uint_t i = 0; i < rules->nelts; i++) {
+        rule[i]->child[0] = _vm_optimize_node(pool, rule[i]->child[0], &predicates);
+        if (rule[i]->child[0] == NULL) {
+            HASH_CLEAR(hh, predicates);
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+    }
+
+    /* 只为被引用了多次的谓词分配备忘录中的位置，哈希表按照插入的顺序遍历。 */
+    ngx_int_t slot = 0;
+    vm_predicate_t *predicate = NULL, *tmp = NULL;
+    HASH_ITER(hh, predicates, predicate, tmp) {
+        if (predicate->node->refs > 1 && slot < NGX_HTTP_WAF_VM_MEMO_SIZE) {
+            predicate->node->slot = slot++;
+        }
+    }
+    HASH_CLEAR(hh, predicates);
+
+    UT_array* optimized = NULL;
+    UT_icd icd = ngx_http_waf_make_utarray_vm_code_icd();
+    utarray_new(optimized, &icd);
+
+    for (ngx_uint_t i = 0; i < rules->nelts; i++) {
+        /* 永远不会命中的规则 */
+        if (rule[i]->child[0]->constant == NGX_HTTP_WAF_FALSE) {
+            continue;
+        }
+
+        _vm_emit_node(optimized, rule[i]);
+    }
+
+    utarray_clear(array);
+    utarray_concat(array, optimized);
+    utarray_free(optimized);
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+ngx_int_t ngx_http_waf_vm_collect_inputs(UT_array* array, ngx_pool_t* pool, ngx_array_t** out) {
+    *out = NULL;
+
+    if (utarray_len(array) == 0) {
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    ngx_array_t* inputs = ngx_array_create(pool, NGX_HTTP_WAF_VM_CACHE_MAX_INPUTS, sizeof(vm_input_t));
+    if (inputs == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    vm_code_t* code = (vm_code_t*)utarray_front(array);
+    ngx_uint_t len = utarray_len(array);
+    for (ngx_uint_t i = 0; i < len; i++) {
+        ngx_str_t key = ngx_null_string;
+
+        switch (code[i].type) {
+            case VM_CODE_PUSH_QUERY_STRING:
+            case VM_CODE_PUSH_HEADER_IN:
+            case VM_CODE_PUSH_COOKIE:
+                key = code[i].argv.value[0].str_val;
                 break;
-            case VM_CODE_NOP:
-                printf("NOP\n");
+            case VM_CODE_PUSH_CLIENT_IP:
+            case VM_CODE_PUSH_URL:
+            case VM_CODE_PUSH_USER_AGENT:
+            case VM_CODE_PUSH_REFERER:
                 break;
             default:
+                continue;
+        }
+
+        /* 同一个字段只记录一次 */
+        vm_input_t* input = inputs->elts;
+        ngx_uint_t j = 0;
+        for (; j < inputs->nelts; j++) {
+            if (input[j].type == code[i].type
+                && input[j].key.len == key.len
+                && ngx_memcmp(input[j].key.data, key.data, key.len) == 0) {
                 break;
+            }
+        }
+
+        if (j < inputs->nelts) {
+            continue;
+        }
+
+        /* 读取的字段过多时缓存很难命中，不如直接执行。 */
+        if (inputs->nelts >= NGX_HTTP_WAF_VM_CACHE_MAX_INPUTS) {
+            return NGX_HTTP_WAF_SUCCESS;
+        }
+
+        input = ngx_array_push(inputs);
+        if (input == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
         }
+        input->type = code[i].type;
+        input->key = key;
+    }
+
+    *out = inputs;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+ngx_int_t ngx_http_waf_vm_build_index(UT_array* array, ngx_pool_t* pool, vm_index_t** out) {
+    *out = NULL;
+
+    vm_index_t* index = ngx_pcalloc(pool, sizeof(vm_index_t));
+    if (index == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    index->rules = ngx_array_create(pool, 16, sizeof(vm_rule_t));
+    index->unguarded = ngx_array_create(pool, 16, sizeof(ngx_uint_t));
+    index->prefix_lens = ngx_array_create(pool, NGX_HTTP_WAF_VM_INDEX_MAX_PREFIXES, sizeof(size_t));
+    if (index->rules == NULL || index->unguarded == NULL || index->prefix_lens == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
     }
-}
\ No newline at end of file
+
+    /* 每条规则以 ACT_RETURN 或者 ACT_ALLOW 结尾 */
+    vm_code_t* code = (vm_code_t*)utarray_front(array);
+    ngx_uint_t len = utarray_len(array);
+    ngx_uint_t start = 0;
+    for (ngx_uint_t i = 0; i < len; i++) {
+        if (code[i].type == VM_CODE_ACT_RETURN || code[i].type == VM_CODE_ACT_ALLOW) {
+            vm_rule_t* rule = ngx_array_push(index->rules);
+            if (rule == NULL) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            }
+            rule->start = start;
+            rule->end = i + 1;
+            start = i + 1;
+        }
+    }
+
+    ngx_uint_t guarded = 0;
+    vm_rule_t* rule = index->rules->elts;
+    for (ngx_uint_t i = 0; i < index->rules->nelts; i++) {
+        ngx_str_t key;
+        ngx_int_t is_prefix = NGX_HTTP_WAF_FALSE;
+
+        if (_vm_guard_of(code, &rule[i], &key, &is_prefix) == NGX_HTTP_WAF_TRUE) {
+            if (is_prefix == NGX_HTTP_WAF_FALSE) {
+                if (_vm_index_add(pool, &index->exact, &key, i) != NGX_HTTP_WAF_SUCCESS) {
+                    return NGX_HTTP_WAF_MALLOC_ERROR;
+                }
+                ++guarded;
+                continue;
+            }
+
+            /* 前缀的长度按照从小到大的顺序插入 */
+            size_t* lens = index->prefix_lens->elts;
+            ngx_uint_t j = 0;
+            while (j < index->prefix_lens->nelts && lens[j] < key.len) {
+                ++j;
+            }
+
+            if (j < index->prefix_lens->nelts && lens[j] == key.len) {
+                if (_vm_index_add(pool, &index->prefix, &key, i) != NGX_HTTP_WAF_SUCCESS) {
+                    return NGX_HTTP_WAF_MALLOC_ERROR;
+                }
+                ++guarded;
+                continue;
+            }
+
+            if (index->prefix_lens->nelts < NGX_HTTP_WAF_VM_INDEX_MAX_PREFIXES) {
+                if (ngx_array_push(index->prefix_lens) == NULL) {
+                    return NGX_HTTP_WAF_MALLOC_ERROR;
+                }
+                lens = index->prefix_lens->elts;
+                ngx_memmove(lens + j + 1, lens + j, sizeof(size_t) * (index->prefix_lens->nelts - 1 - j));
+                lens[j] = key.len;
+
+                if (_vm_index_add(pool, &index->prefix, &key, i) != NGX_HTTP_WAF_SUCCESS) {
+                    return NGX_HTTP_WAF_MALLOC_ERROR;
+                }
+                ++guarded;
+                continue;
+            }
+        }
+
+        ngx_uint_t* p = ngx_array_push(index->unguarded);
+        if (p == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+        *p = i;
+    }
+
+    /* 没有可以索引的规则时直接顺序执行 */
+    if (guarded != 0) {
+        *out = index;
+    }
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+ngx_int_t ngx_http_waf_vm_precompile(UT_array* array, ngx_pool_t* pool, const char* file_name, u_char** invalid) {
+    *invalid = NULL;
+
+    /* 虚拟机使用固定深度的栈，这里计算出每条指令执行后的深度并确保不会越界。 */
+    ngx_int_t depth = 0;
+    for (ngx_uint_t i = 0; i < utarray_len(array); i++) {
+        vm_code_t* code = (vm_code_t*)utarray_eltptr(array, i);
+        switch (code->type) {
+            case VM_CODE_PUSH_INT:
+            case VM_CODE_PUSH_BOOL:
+            case VM_CODE_PUSH_STR:
+            case VM_CODE_PUSH_CLIENT_IP:
+            case VM_CODE_PUSH_URL:
+            case VM_CODE_PUSH_QUERY_STRING:
+            case VM_CODE_PUSH_REFERER:
+            case VM_CODE_PUSH_USER_AGENT:
+            case VM_CODE_PUSH_HEADER_IN:
+            case VM_CODE_PUSH_COOKIE:
+                ++depth;
+                break;
+            case VM_CODE_OP_AND:
+            case VM_CODE_OP_OR:
+            case VM_CODE_OP_CONTAINS:
+            case VM_CODE_OP_MATCHES:
+            case VM_CODE_OP_EQUALS:
+            case VM_CODE_OP_BELONG_TO:
+                depth -= 2;
+                if (depth < 0) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                ++depth;
+                break;
+            case VM_CODE_OP_NOT:
+            case VM_CODE_OP_SQLI_DETN:
+            case VM_CODE_OP_XSS_DETN:
+            case VM_CODE_OP_IN:
+                if (depth < 1) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                break;
+            case VM_CODE_JMP_FALSE_OR_POP:
+            case VM_CODE_JMP_TRUE_OR_POP:
+                /* 跳转目标处的深度与顺序执行到那里时相同，所以按照不跳转计算即可。 */
+                if (depth < 1 || code->argv.value[0].int_val < 1) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                --depth;
+                break;
+            case VM_CODE_LOAD_MEMO:
+                /* 跳过的指令恰好压入一个布尔值，与直接压入记录的结果效果相同。 */
+                if (code->argv.value[0].int_val < 0 
+                    || code->argv.value[0].int_val >= NGX_HTTP_WAF_VM_MEMO_SIZE
+                    || code->argv.value[1].int_val < 1) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                break;
+            case VM_CODE_STORE_MEMO:
+                if (depth < 1 
+                    || code->argv.value[0].int_val < 0 
+                    || code->argv.value[0].int_val >= NGX_HTTP_WAF_VM_MEMO_SIZE) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                break;
+            case VM_CODE_ACT_RETURN:
+            case VM_CODE_ACT_ALLOW:
+                depth -= 2;
+                if (depth < 0) {
+                    return NGX_HTTP_WAF_FAIL;
+                }
+                break;
+            default:
+                break;
+        }
+
+        if (depth > NGX_HTTP_WAF_VM_STACK_SIZE) {
+            return NGX_HTTP_WAF_FAIL;
+        }
+    }
+
+    /* in 的左操作数紧挨着它入栈，据此决定建立字符串集合还是 IP 集合。 */
+    for (ngx_uint_t i = 1; i < utarray_len(array); i++) {
+        vm_code_t* code = (vm_code_t*)utarray_eltptr(array, i);
+        vm_code_t* left = (vm_code_t*)utarray_eltptr(array, i - 1);
+
+        if (code->type != VM_CODE_OP_IN || code->argv.argc != 2) {
+            continue;
+        }
+
+        /* 相同的集合只建立一次，比如被多条规则共用的谓词会被生成多次。 */
+        for (ngx_uint_t j = 1; j < i; j++) {
+            vm_code_t* prev = (vm_code_t*)utarray_eltptr(array, j);
+            vm_code_t* prev_left = (vm_code_t*)utarray_eltptr(array, j - 1);
+            if (prev->type == VM_CODE_OP_IN 
+                && prev->argv.argc == 3
+                && (prev_left->type == VM_CODE_PUSH_CLIENT_IP) == (left->type == VM_CODE_PUSH_CLIENT_IP)
+                && prev->argv.value[1].int_val == code->argv.value[1].int_val
+                && prev->argv.value[0].str_val.len == code->argv.value[0].str_val.len
+                && ngx_memcmp(prev->argv.value[0].str_val.data, 
+                              code->argv.value[0].str_val.data, 
+                              code->argv.value[0].str_val.len) == 0) {
+                code->argv.argc = 3;
+                code->argv.type[2] = VM_DATA_SET;
+                code->argv.value[2].set_val = prev->argv.value[2].set_val;
+                break;
+            }
+        }
+
+        if (code->argv.argc == 3) {
+            continue;
+        }
+
+        ngx_int_t is_ip = left->type == VM_CODE_PUSH_CLIENT_IP ? NGX_HTTP_WAF_TRUE : NGX_HTTP_WAF_FALSE;
+        ngx_int_t ret = _vm_build_set(pool, &(code->argv), is_ip, file_name, invalid);
+        if (ret != NGX_HTTP_WAF_SUCCESS) {
+            return ret;
+        }
+    }
+
+    for (ngx_uint_t i = 2; i < utarray_len(array); i++) {
+        vm_code_t* code = (vm_code_t*)utarray_eltptr(array, i);
+        vm_code_t* left = (vm_code_t*)utarray_eltptr(array, i - 1);
+        vm_code_t* right = (vm_code_t*)utarray_eltptr(array, i - 2);
+
+        /* 右操作数先于左操作数入栈，所以只有紧挨着的两条指令才能确定操作数。 */
+        if (right->type != VM_CODE_PUSH_STR || right->argv.argc != 1) {
+            continue;
+        }
+
+        vm_stack_arg_t* argv = &(right->argv);
+
+        switch (code->type) {
+            case VM_CODE_OP_CONTAINS:
+            {
+                memmem_needle_t* needle = ngx_palloc(pool, sizeof(memmem_needle_t));
+                if (needle == NULL) {
+                    return NGX_HTTP_WAF_MALLOC_ERROR;
+                }
+
+                memmem_needle_init(needle, argv->value[0].str_val.data, argv->value[0].str_val.len, NGX_HTTP_WAF_FALSE);
+                argv->argc = 2;
+                argv->type[1] = VM_DATA_NEEDLE;
+                argv->value[1].needle_val = needle;
+                break;
+            }
+
+            case VM_CODE_OP_MATCHES:
+            {
+                ngx_regex_compile_t   regex_compile;
+                u_char errstr[NGX_MAX_CONF_ERRSTR];
+                ngx_memzero(&regex_compile, sizeof(ngx_regex_compile_t));
+                ngx_memcpy(&(regex_compile.pattern), &(argv->value[0].str_val), sizeof(ngx_str_t));
+                regex_compile.pool = pool;
+                regex_compile.err.len = NGX_MAX_CONF_ERRSTR;
+                regex_compile.err.data = errstr;
+
+                if (ngx_regex_compile(&regex_compile) != NGX_OK) {
+                    *invalid = argv->value[0].str_val.data;
+                    return NGX_HTTP_WAF_FAIL;
+                }
+
+                argv->argc = 2;
+                argv->type[1] = VM_DATA_REGEX;
+                argv->value[1].regex_val = regex_compile.regex;
+                break;
+            }
+
+            case VM_CODE_OP_BELONG_TO:
+                if (left->type != VM_CODE_PUSH_CLIENT_IP) {
+                    break;
+                }
+
+                argv->argc = 3;
+                argv->type[1] = VM_DATA_VOID;
+                argv->type[2] = VM_DATA_VOID;
+
+                if (ngx_http_waf_parse_ipv4(argv->value[0].str_val, &(argv->value[1].ipv4_val)) == NGX_HTTP_WAF_SUCCESS) {
+                    argv->type[1] = VM_DATA_IPV4_BLOCK;
+                }
+#if (NGX_HAVE_INET6)
+                if (ngx_http_waf_parse_ipv6(argv->value[0].str_val, &(argv->value[2].ipv6_val)) == NGX_HTTP_WAF_SUCCESS) {
+                    argv->type[2] = VM_DATA_IPV6_BLOCK;
+                }
+#endif
+                break;
+
+            case VM_CODE_OP_EQUALS:
+                if (left->type != VM_CODE_PUSH_CLIENT_IP) {
+                    break;
+                }
+
+                argv->argc = 3;
+                argv->type[1] = VM_DATA_VOID;
+                argv->type[2] = VM_DATA_VOID;
+
+                if (inet_pton(AF_INET, (char*)argv->value[0].str_val.data, &(argv->value[1].inx_addr_val.ipv4)) == 1) {
+                    argv->type[1] = VM_DATA_IPV4;
+                }
+#if (NGX_HAVE_INET6)
+                if (inet_pton(AF_INET6, (char*)argv->value[0].str_val.data, &(argv->value[2].inx_addr_val.ipv6)) == 1) {
+                    argv->type[2] = VM_DATA_IPV6;
+                }
+#endif
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+void ngx_http_waf_print_code(UT_array* array) {
+    vm_code_t* p = NULL;
+    while (p = (vm_code_t*)utarray_next(array, p), p != NULL) {
+        vm_code_t* q = p;
+        switch (q->type) {
+            case VM_CODE_PUSH_INT:
+                printf("PUSH_INT %d\n", q->argv.value[0].int_val);
+                break;
+            case VM_CODE_PUSH_BOOL:
+                printf("PUSH_BOOL %s\n", q->argv.value[0].bool_val ? "true" : "false");
+                break;
+            case VM_CODE_PUSH_STR:
+                printf("PUSH_STR %s\n", q->argv.value[0].str_val.data);
+                break;
+            case VM_CODE_PUSH_COOKIE:
+                printf("PUSH_COOKIE %s\n", (char*)(q->argv.value[0].str_val.data));
+                break;
+            case VM_CODE_JMP_FALSE_OR_POP:
+                printf("JMP_FALSE_OR_POP +%d\n", q->argv.value[0].int_val);
+                break;
+            case VM_CODE_JMP_TRUE_OR_POP:
+                printf("JMP_TRUE_OR_POP +%d\n", q->argv.value[0].int_val);
+                break;
+            case VM_CODE_LOAD_MEMO:
+                printf("LOAD_MEMO %d +%d\n", q->argv.value[0].int_val, q->argv.value[1].int_val);
+                break;
+            case VM_CODE_STORE_MEMO:
+                printf("STORE_MEMO %d\n", q->argv.value[0].int_val);
+                break;
+            case VM_CODE_PUSH_CLIENT_IP:
+                printf("PUSH_CLIENT_IP\n");
+                break;
+            case VM_CODE_PUSH_URL:
+                printf("PUSH_URL\n");
+                break;
+            case VM_CODE_PUSH_USER_AGENT:
+                printf("PUSH_USER_AGENT\n");
+                break;
+            case VM_CODE_PUSH_QUERY_STRING:
+                printf("PUSH_QUERY_STRING %s\n", (char*)(q->argv.value[0].str_val.data));
+                break;
+            case VM_CODE_PUSH_REFERER:
+                printf("PUSH_REFERER\n");
+                break;
+            case VM_CODE_PUSH_HEADER_IN:
+                printf("PUSH_HEADER_IN %s\n", (char*)(q->argv.value[0].str_val.data));
+                break;
+            case VM_CODE_OP_NOT:
+                printf("OP_NOT\n");
+                break;
+            case VM_CODE_OP_AND:
+                printf("OP_AND\n");
+                break;
+            case VM_CODE_OP_OR:
+                printf("OP_OR\n");
+                break;
+            case VM_CODE_OP_CONTAINS:
+                printf("OP_CONTAINS\n");
+                break;
+            case VM_CODE_OP_MATCHES:
+                printf("OP_MATCHES\n");
+                break;
+            case VM_CODE_OP_EQUALS:
+                printf("OP_EQUALS\n");
+                break;
+            case VM_CODE_OP_BELONG_TO:
+                printf("OP_BELONG_TO\n");
+                break;
+            case VM_CODE_ACT_RETURN:
+                printf("ACT_RET %d\n", q->argv.value[0].int_val);
+                break;
+            case VM_CODE_ACT_ALLOW:
+                printf("ACT_ALLOW\n");
+                break;
+            case VM_CODE_OP_SQLI_DETN:
+                printf("OP_SQLI_DETN\n");
+                break;
+            case VM_CODE_OP_XSS_DETN:
+                printf("OP_XSS_DETN\n");
+                break;
+            case VM_CODE_OP_IN:
+                printf("OP_IN %s%s\n", q->argv.value[1].int_val ? "@" : "", (char*)(q->argv.value[0].str_val.data));
+                break;
+            case VM_CODE_NOP:
+                printf("NOP\n");
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+static void _vm_find_query_string(ngx_str_t* args, ngx_str_t* key, ngx_str_t* out) {
+    u_char* p = args->data;
+    u_char* end = args->data + args->len;
+
+    /* 
+     * 同名的参数取最后一个，PHP 等大多数后端也是这样做的。
+     * 如果取第一个，攻击者可以在后面再写一个同名参数来绕过检查。
+    */
+    while (p < end) {
+        u_char* pair_end = ngx_strlchr(p, end, '&');
+        if (pair_end == NULL) {
+            pair_end = end;
+        }
+
+        u_char* equal = ngx_strlchr(p, pair_end, '=');
+        if (equal != NULL
+            && (size_t)(equal - p) == key->len 
+            && ngx_memcmp(p, key->data, key->len) == 0) {
+            out->data = equal + 1;
+            out->len = pair_end - equal - 1;
+        }
+
+        p = pair_end + 1;
+    }
+}
+
+
+static void _vm_find_header_in(ngx_list_t* headers, ngx_str_t* key, ngx_str_t* out) {
+    ngx_list_part_t* part = &(headers->part);
+    ngx_table_elt_t* header = part->elts;
+
+    /* 和查询字符串一样，同名的头部取最后一个。 */
+    for (ngx_uint_t i = 0; ; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].key.len == key->len 
+            && ngx_strncasecmp(header[i].key.data, key->data, key->len) == 0) {
+            *out = header[i].value;
+        }
+    }
+}
+
+
+static void _vm_find_cookie(ngx_array_t* cookies, ngx_str_t* key, ngx_str_t* out) {
+    ngx_table_elt_t** elts = cookies->elts;
+
+    /* 和查询字符串一样，同名的 Cookie 取最后一个。 */
+    for (ngx_uint_t i = 0; i < cookies->nelts; i++) {
+        u_char* p = elts[i]->value.data;
+        u_char* end = p + elts[i]->value.len;
+
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                ++p;
+            }
+
+            u_char* pair_end = ngx_strlchr(p, end, ';');
+            if (pair_end == NULL) {
+                pair_end = end;
+            }
+
+            u_char* equal = ngx_strlchr(p, pair_end, '=');
+            if (equal != NULL
+                && (size_t)(equal - p) == key->len 
+                && ngx_memcmp(p, key->data, key->len) == 0) {
+                out->data = equal + 1;
+                out->len = pair_end - equal - 1;
+            }
+
+            p = pair_end + 1;
+        }
+    }
+}
+
+
+static ngx_int_t _vm_str_contains(ngx_str_t* haystack, ngx_str_t* needle) {
+    /* 空字符串的 data 可能为 NULL，所以单独判断。 */
+    if (needle->len == 0 || memmem_find(haystack->data, haystack->len, needle->data, needle->len) != NULL) {
+        return NGX_HTTP_WAF_TRUE;
+    }
+
+    return NGX_HTTP_WAF_FALSE;
+}
+
+
+static uint64_t _vm_cache_key(ngx_http_request_t* r, ngx_array_t* inputs, uint32_t generation, 
+                              ngx_str_t* url, ngx_str_t* user_agent, ngx_str_t* referer, u_char* fingerprint_key) {
+    uint64_t fingerprints[NGX_HTTP_WAF_VM_CACHE_MAX_INPUTS + 1];
+    vm_input_t* input = inputs->elts;
+
+    /* 分别计算每个字段的指纹，这样字段之间的边界不会混淆。 */
+    for (ngx_uint_t i = 0; i < inputs->nelts; i++) {
+        ngx_str_t value = ngx_null_string;
+        u_char addr[sizeof(inx_addr_t) + 1];
+
+        switch (input[i].type) {
+            case VM_CODE_PUSH_URL:
+                value = *url;
+                break;
+            case VM_CODE_PUSH_USER_AGENT:
+                value = *user_agent;
+                break;
+            case VM_CODE_PUSH_REFERER:
+                value = *referer;
+                break;
+            case VM_CODE_PUSH_QUERY_STRING:
+                _vm_find_query_string(&(r->args), &(input[i].key), &value);
+                break;
+            case VM_CODE_PUSH_HEADER_IN:
+                _vm_find_header_in(&(r->headers_in.headers), &(input[i].key), &value);
+                break;
+            case VM_CODE_PUSH_COOKIE:
+                _vm_find_cookie(&(r->headers_in.cookies), &(input[i].key), &value);
+                break;
+            case VM_CODE_PUSH_CLIENT_IP:
+                /* 地址族也计入指纹 */
+                addr[0] = (u_char)r->connection->sockaddr->sa_family;
+                value.data = addr;
+                value.len = 1;
+                if (r->connection->sockaddr->sa_family == AF_INET) {
+                    struct sockaddr_in* sin = (struct sockaddr_in*)r->connection->sockaddr;
+                    ngx_memcpy(addr + 1, &(sin->sin_addr), sizeof(struct in_addr));
+                    value.len += sizeof(struct in_addr);
+                }
+#if (NGX_HAVE_INET6)
+                else if (r->connection->sockaddr->sa_family == AF_INET6) {
+                    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)r->connection->sockaddr;
+                    ngx_memcpy(addr + 1, &(sin6->sin6_addr), sizeof(struct in6_addr));
+                    value.len += sizeof(struct in6_addr);
+                }
+#endif
+                break;
+            default:
+                break;
+        }
+
+        crypto_shorthash((u_char*)&fingerprints[i], value.data, value.len, fingerprint_key);
+    }
+
+    /* 没有设置 waf_cache 的子块会继承父块的缓存，但是可能有自己的规则，所以还要区分规则。 */
+    fingerprints[inputs->nelts] = generation;
+
+    uint64_t key;
+    crypto_shorthash((u_char*)&key, (u_char*)fingerprints, sizeof(uint64_t) * (inputs->nelts + 1), fingerprint_key);
+
+    return key;
+}
+
+
+uint32_t ngx_http_waf_vm_generation(UT_array* array) {
+    uint32_t generation;
+    ngx_crc32_init(generation);
+
+    vm_code_t* code = NULL;
+    while (code = (vm_code_t*)utarray_next(array, code), code != NULL) {
+        vm_stack_arg_t* argv = &(code->argv);
+        ngx_crc32_update(&generation, (u_char*)&(code->type), sizeof(vm_code_type_e));
+
+        /* 预编译的操作数都是指针，它们由字面量生成，只计算字面量即可。 */
+        for (size_t i = 0; i < argv->argc; i++) {
+            switch (argv->type[i]) {
+                case VM_DATA_STR:
+                    ngx_crc32_update(&generation, (u_char*)&(argv->value[i].str_val.len), sizeof(size_t));
+                    ngx_crc32_update(&generation, argv->value[i].str_val.data, argv->value[i].str_val.len);
+                    break;
+                case VM_DATA_INT:
+                    ngx_crc32_update(&generation, (u_char*)&(argv->value[i].int_val), sizeof(int));
+                    break;
+                case VM_DATA_BOOL:
+                    ngx_crc32_update(&generation, (u_char*)&(argv->value[i].bool_val), sizeof(uint8_t));
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    ngx_crc32_final(generation);
+    return generation;
+}
+
+
+static vm_node_t* _vm_new_node(ngx_pool_t* pool, vm_code_t* code) {
+    vm_node_t* node = ngx_pcalloc(pool, sizeof(vm_node_t));
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->code = code;
+    node->constant = NGX_CONF_UNSET;
+    node->slot = NGX_CONF_UNSET;
+
+    if (code == NULL) {
+        return node;
+    }
+
+    /* 粗略估计的求值代价，只用于决定 and 和 or 的操作数的先后顺序。 */
+    switch (code->type) {
+        case VM_CODE_OP_EQUALS:
+        case VM_CODE_OP_BELONG_TO:
+        case VM_CODE_OP_IN:
+            node->cost = 1;
+            break;
+        case VM_CODE_OP_CONTAINS:
+        case VM_CODE_PUSH_QUERY_STRING:
+        case VM_CODE_PUSH_HEADER_IN:
+        case VM_CODE_PUSH_COOKIE:
+            node->cost = 2;
+            break;
+        case VM_CODE_OP_MATCHES:
+            node->cost = 8;
+            break;
+        case VM_CODE_OP_SQLI_DETN:
+        case VM_CODE_OP_XSS_DETN:
+            node->cost = 16;
+            break;
+        default:
+            node->cost = 0;
+            break;
+    }
+
+    return node;
+}
+
+
+static vm_node_t* _vm_optimize_node(ngx_pool_t* pool, vm_node_t* node, vm_predicate_t** predicates) {
+    vm_code_t* code = node->code;
+
+    if (code == NULL) {
+        return node;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (node->child[i] != NULL) {
+            node->child[i] = _vm_optimize_node(pool, node->child[i], predicates);
+            if (node->child[i] == NULL) {
+                return NULL;
+            }
+            node->cost += node->child[i]->cost;
+        }
+    }
+
+    vm_node_t* left = node->child[0];
+    vm_node_t* right = node->child[1];
+    ngx_int_t constant = NGX_CONF_UNSET;
+
+    #define ngx_http_waf_is_literal(node) ((node)->code != NULL && (node)->code->type == VM_CODE_PUSH_STR)
+
+    switch (code->type) {
+        case VM_CODE_OP_NOT:
+            if (left->constant != NGX_CONF_UNSET) {
+                constant = !left->constant;
+            } else if (left->code->type == VM_CODE_OP_NOT) {
+                return left->child[0];
+            }
+            break;
+
+        case VM_CODE_OP_AND:
+        case VM_CODE_OP_OR:
+        {
+            /* and 的单位元是真，零元是假；or 则相反。 */
+            ngx_int_t identity = code->type == VM_CODE_OP_AND ? NGX_HTTP_WAF_TRUE : NGX_HTTP_WAF_FALSE;
+            if (left->constant == !identity || right->constant == !identity) {
+                constant = !identity;
+            } else if (left->constant == identity) {
+                return right;
+            } else if (right->constant == identity) {
+                return left;
+            } else if (code->type == VM_CODE_OP_AND 
+                    && _vm_is_url_guard(right) == NGX_HTTP_WAF_TRUE 
+                    && _vm_is_url_guard(left) == NGX_HTTP_WAF_FALSE) {
+                /* 将 URL 前提放在最前面，以便 ngx_http_waf_vm_build_index() 识别。 */
+                node->child[0] = right;
+                node->child[1] = left;
+            } else if (right->cost < left->cost
+                    && (code->type != VM_CODE_OP_AND || _vm_is_url_guard(left) == NGX_HTTP_WAF_FALSE)) {
+                /* 操作数都没有副作用，先计算代价小的那个，便于短路。 */
+                node->child[0] = right;
+                node->child[1] = left;
+            }
+            break;
+        }
+
+        case VM_CODE_OP_EQUALS:
+            if (ngx_http_waf_is_literal(left) && ngx_http_waf_is_literal(right)) {
+                ngx_str_t* l = &(left->code->argv.value[0].str_val);
+                ngx_str_t* r = &(right->code->argv.value[0].str_val);
+                constant = l->len == r->len && ngx_memcmp(l->data, r->data, l->len) == 0;
+            }
+            break;
+
+        case VM_CODE_OP_CONTAINS:
+            if (ngx_http_waf_is_literal(left) && ngx_http_waf_is_literal(right)) {
+                constant = _vm_str_contains(&(left->code->argv.value[0].str_val), 
+                                            &(right->code->argv.value[0].str_val)) == NGX_HTTP_WAF_TRUE;
+            }
+            break;
+
+        case VM_CODE_OP_MATCHES:
+            if (ngx_http_waf_is_literal(left) && ngx_http_waf_is_literal(right)) {
+                ngx_regex_compile_t   regex_compile;
+                u_char errstr[NGX_MAX_CONF_ERRSTR];
+                ngx_memzero(&regex_compile, sizeof(ngx_regex_compile_t));
+                ngx_memcpy(&(regex_compile.pattern), &(right->code->argv.value[0].str_val), sizeof(ngx_str_t));
+                regex_compile.pool = pool;
+                regex_compile.err.len = NGX_MAX_CONF_ERRSTR;
+                regex_compile.err.data = errstr;
+
+                /* 非法的正则表达式留给 ngx_http_waf_vm_precompile() 报告 */
+                if (ngx_regex_compile(&regex_compile) == NGX_OK) {
+                    constant = ngx_regex_exec(regex_compile.regex, &(left->code->argv.value[0].str_val), NULL, 0) >= 0;
+                }
+            }
+            break;
+
+        case VM_CODE_OP_SQLI_DETN:
+            if (ngx_http_waf_is_literal(left)) {
+                sfilter sf;
+                ngx_str_t* str = &(left->code->argv.value[0].str_val);
+                libinjection_sqli_init(&sf, 
+                                        (char*)(str->data), 
+                                        str->len,
+                                        FLAG_NONE | 
+                                        FLAG_QUOTE_NONE | 
+                                        FLAG_QUOTE_SINGLE | 
+                                        FLAG_QUOTE_DOUBLE | 
+                                        FLAG_SQL_ANSI | 
+                                        FLAG_SQL_MYSQL);
+                constant = libinjection_is_sqli(&sf) == 1;
+            }
+            break;
+
+        case VM_CODE_OP_XSS_DETN:
+            if (ngx_http_waf_is_literal(left)) {
+                ngx_str_t* str = &(left->code->argv.value[0].str_val);
+                constant = libinjection_xss((char*)(str->data), str->len) == 1;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    #undef ngx_http_waf_is_literal
+
+    if (constant != NGX_CONF_UNSET) {
+        vm_node_t* result = _vm_new_node(pool, NULL);
+        if (result == NULL) {
+            return NULL;
+        }
+        result->constant = constant ? NGX_HTTP_WAF_TRUE : NGX_HTTP_WAF_FALSE;
+        return result;
+    }
+
+    if (_vm_is_predicate(node) == NGX_HTTP_WAF_TRUE) {
+        ngx_str_t key;
+        ngx_int_t rc = _vm_predicate_key(pool, node, &key);
+        if (rc == NGX_HTTP_WAF_MALLOC_ERROR) {
+            return NULL;
+        }
+
+        if (rc == NGX_HTTP_WAF_SUCCESS) {
+            vm_predicate_t* predicate = NULL;
+            HASH_FIND(hh, *predicates, key.data, key.len, predicate);
+            if (predicate != NULL) {
+                ++(predicate->node->refs);
+                return predicate->node;
+            }
+
+            predicate = ngx_pcalloc(pool, sizeof(vm_predicate_t));
+            if (predicate == NULL) {
+                return NULL;
+            }
+            predicate->key = key;
+            predicate->node = node;
+            node->refs = 1;
+            HASH_ADD_KEYPTR(hh, *predicates, predicate->key.data, predicate->key.len, predicate);
+        }
+    }
+
+    return node;
+}
+
+
+static ngx_int_t _vm_is_predicate(vm_node_t* node) {
+    if (node->code == NULL) {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    switch (node->code->type) {
+        case VM_CODE_OP_CONTAINS:
+        case VM_CODE_OP_MATCHES:
+        case VM_CODE_OP_EQUALS:
+        case VM_CODE_OP_BELONG_TO:
+        case VM_CODE_OP_SQLI_DETN:
+        case VM_CODE_OP_XSS_DETN:
+        case VM_CODE_OP_IN:
+            break;
+        default:
+            return NGX_HTTP_WAF_FALSE;
+    }
+
+    /* 谓词的操作数都是直接压栈的指令，比较指令本身就能判断两个谓词是否相同。 */
+    for (int i = 0; i < 2; i++) {
+        if (node->child[i] != NULL 
+            && (node->child[i]->code == NULL || node->child[i]->child[0] != NULL)) {
+            return NGX_HTTP_WAF_FALSE;
+        }
+    }
+
+    return NGX_HTTP_WAF_TRUE;
+}
+
+
+static ngx_int_t _vm_predicate_key(ngx_pool_t* pool, vm_node_t* node, ngx_str_t* out) {
+    vm_code_t* codes[3] = { node->code, node->child[0]->code, NULL };
+    if (node->child[1] != NULL) {
+        codes[2] = node->child[1]->code;
+    }
+
+    /* 第一遍计算长度，第二遍填充内容。 */
+    u_char* p = NULL;
+    size_t len = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        #define ngx_http_waf_key_append(src, size) {    \
+            if (p != NULL) {                            \
+                p = ngx_cpymem(p, (src), (size));       \
+            }                                           \
+            len += (size);                              \
+        }
+
+        for (int i = 0; i < 3 && codes[i] != NULL; i++) {
+            vm_stack_arg_t* argv = &(codes[i]->argv);
+            ngx_http_waf_key_append(&(codes[i]->type), sizeof(vm_code_type_e));
+            ngx_http_waf_key_append(&(argv->argc), sizeof(size_t));
+
+            for (size_t j = 0; j < argv->argc; j++) {
+                ngx_http_waf_key_append(&(argv->type[j]), sizeof(vm_data_type_e));
+                switch (argv->type[j]) {
+                    case VM_DATA_STR:
+                        ngx_http_waf_key_append(&(argv->value[j].str_val.len), sizeof(size_t));
+                        ngx_http_waf_key_append(argv->value[j].str_val.data, argv->value[j].str_val.len);
+                        break;
+                    case VM_DATA_INT:
+                        ngx_http_waf_key_append(&(argv->value[j].int_val), sizeof(int));
+                        break;
+                    case VM_DATA_BOOL:
+                        ngx_http_waf_key_append(&(argv->value[j].bool_val), sizeof(uint8_t));
+                        break;
+                    default:
+                        return NGX_HTTP_WAF_FAIL;
+                }
+            }
+        }
+
+        #undef ngx_http_waf_key_append
+
+        if (pass == 0) {
+            out->len = len;
+            out->data = ngx_pnalloc(pool, len);
+            if (out->data == NULL) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            }
+            p = out->data;
+        }
+    }
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+static void _vm_emit_node(UT_array* array, vm_node_t* node) {
+    vm_code_t code;
+
+    if (node->slot != NGX_CONF_UNSET) {
+        /* 
+         * 共用的谓词 P 被编译为 LOAD_MEMO slot L; P; STORE_MEMO slot; L:
+         * 先暂时清除 slot 以便递归地生成 P 本身。
+        */
+        ngx_int_t slot = node->slot;
+        node->slot = NGX_CONF_UNSET;
+
+        code.type = VM_CODE_LOAD_MEMO;
+        code.argv.argc = 2;
+        code.argv.type[0] = VM_DATA_INT;
+        code.argv.value[0].int_val = (int)slot;
+        code.argv.type[1] = VM_DATA_INT;
+        code.argv.value[1].int_val = 0;
+        utarray_push_back(array, &code);
+        ngx_uint_t load = utarray_len(array) - 1;
+
+        _vm_emit_node(array, node);
+
+        code.type = VM_CODE_STORE_MEMO;
+        code.argv.argc = 1;
+        utarray_push_back(array, &code);
+
+        vm_code_t* p = (vm_code_t*)utarray_eltptr(array, load);
+        p->argv.value[1].int_val = (int)(utarray_len(array) - load);
+
+        node->slot = slot;
+        return;
+    }
+
+    if (node->code == NULL) {
+        code.type = VM_CODE_PUSH_BOOL;
+        code.argv.argc = 1;
+        code.argv.type[0] = VM_DATA_BOOL;
+        code.argv.value[0].bool_val = node->constant == NGX_HTTP_WAF_TRUE;
+        utarray_push_back(array, &code);
+        return;
+    }
+
+    switch (node->code->type) {
+        case VM_CODE_OP_AND:
+        case VM_CODE_OP_OR:
+        {
+            /* 
+             * A and B 被编译为 A; JMP_FALSE_OR_POP L; B; L:
+             * A or B 被编译为 A; JMP_TRUE_OR_POP L; B; L:
+            */
+            _vm_emit_node(array, node->child[0]);
+
+            code.type = node->code->type == VM_CODE_OP_AND ? VM_CODE_JMP_FALSE_OR_POP : VM_CODE_JMP_TRUE_OR_POP;
+            code.argv.argc = 1;
+            code.argv.type[0] = VM_DATA_INT;
+            code.argv.value[0].int_val = 0;
+            utarray_push_back(array, &code);
+            ngx_uint_t jump = utarray_len(array) - 1;
+
+            _vm_emit_node(array, node->child[1]);
+
+            vm_code_t* p = (vm_code_t*)utarray_eltptr(array, jump);
+            p->argv.value[0].int_val = (int)(utarray_len(array) - jump);
+            return;
+        }
+
+        case VM_CODE_OP_NOT:
+        case VM_CODE_OP_SQLI_DETN:
+        case VM_CODE_OP_XSS_DETN:
+        case VM_CODE_OP_IN:
+            _vm_emit_node(array, node->child[0]);
+            break;
+
+        /* 右操作数先入栈 */
+        case VM_CODE_OP_CONTAINS:
+        case VM_CODE_OP_MATCHES:
+        case VM_CODE_OP_EQUALS:
+        case VM_CODE_OP_BELONG_TO:
+        case VM_CODE_ACT_RETURN:
+        case VM_CODE_ACT_ALLOW:
+            _vm_emit_node(array, node->child[1]);
+            _vm_emit_node(array, node->child[0]);
+            break;
+
+        default:
+            break;
+    }
+
+    utarray_push_back(array, node->code);
+}
+
+
+static ngx_int_t _vm_is_url_guard(vm_node_t* node) {
+    if (node->code == NULL) {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    if (node->code->type == VM_CODE_OP_AND) {
+        return _vm_is_url_guard(node->child[0]);
+    }
+
+    if (node->code->type != VM_CODE_OP_EQUALS && node->code->type != VM_CODE_OP_MATCHES) {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    vm_code_t* left = node->child[0]->code;
+    vm_code_t* right = node->child[1]->code;
+    if (left == NULL || right == NULL) {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    if (left->type == VM_CODE_PUSH_URL && right->type == VM_CODE_PUSH_STR) {
+        return node->code->type == VM_CODE_OP_EQUALS || right->argv.value[0].str_val.data[0] == '^';
+    }
+
+    if (node->code->type == VM_CODE_OP_EQUALS && left->type == VM_CODE_PUSH_STR && right->type == VM_CODE_PUSH_URL) {
+        return NGX_HTTP_WAF_TRUE;
+    }
+
+    return NGX_HTTP_WAF_FALSE;
+}
+
+
+static ngx_int_t _vm_guard_of(vm_code_t* code, vm_rule_t* rule, ngx_str_t* key, ngx_int_t* is_prefix) {
+    /* 跳过规则的 ID */
+    ngx_uint_t i = rule->start + 1;
+
+    if (i < rule->end && code[i].type == VM_CODE_LOAD_MEMO) {
+        ++i;
+    }
+
+    if (i + 3 > rule->end) {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    /* 右操作数先入栈 */
+    vm_code_t* right = &code[i];
+    vm_code_t* left = &code[i + 1];
+    vm_code_t* op = &code[i + 2];
+    i += 3;
+
+    if (op->type == VM_CODE_OP_EQUALS) {
+        if (left->type == VM_CODE_PUSH_URL && right->type == VM_CODE_PUSH_STR) {
+            *key = right->argv.value[0].str_val;
+        } else if (left->type == VM_CODE_PUSH_STR && right->type == VM_CODE_PUSH_URL) {
+            *key = left->argv.value[0].str_val;
+        } else {
+            return NGX_HTTP_WAF_FALSE;
+        }
+        *is_prefix = NGX_HTTP_WAF_FALSE;
+
+    } else if (op->type == VM_CODE_OP_MATCHES) {
+        if (left->type != VM_CODE_PUSH_URL || right->type != VM_CODE_PUSH_STR) {
+            return NGX_HTTP_WAF_FALSE;
+        }
+
+        ngx_str_t* pattern = &(right->argv.value[0].str_val);
+        if (pattern->len < 2 || pattern->data[0] != '^') {
+            return NGX_HTTP_WAF_FALSE;
+        }
+
+        /* 含有 | 时 ^ 不一定作用于整个表达式 */
+        if (ngx_strlchr(pattern->data, pattern->data + pattern->len, '|') != NULL) {
+            return NGX_HTTP_WAF_FALSE;
+        }
+
+        /* 取 ^ 之后的字面量作为前缀，遇到元字符时停止。 */
+        size_t j = 1;
+        while (j < pattern->len && ngx_strchr("\\.^$|?*+()[]{}", pattern->data[j]) == NULL) {
+            ++j;
+        }
+
+        /* 后面跟着可以重复零次的量词时，最后一个字符不一定出现。 */
+        if (j < pattern->len && ngx_strchr("?*{", pattern->data[j]) != NULL) {
+            --j;
+        }
+
+        if (j <= 1) {
+            return NGX_HTTP_WAF_FALSE;
+        }
+
+        key->data = pattern->data + 1;
+        key->len = j - 1;
+        *is_prefix = NGX_HTTP_WAF_TRUE;
+
+    } else {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    if (i < rule->end && code[i].type == VM_CODE_STORE_MEMO) {
+        ++i;
+    }
+
+    /* 
+     * 只有前提为假时规则一定不会命中，前提才能用于索引。
+     * 也就是前提为假时，沿着 JMP_FALSE_OR_POP 一路跳转后直接到达规则的结尾。
+    */
+    while (i < rule->end) {
+        if (code[i].type == VM_CODE_JMP_FALSE_OR_POP) {
+            i += code[i].argv.value[0].int_val;
+        } else if (code[i].type == VM_CODE_ACT_RETURN || code[i].type == VM_CODE_ACT_ALLOW) {
+            return NGX_HTTP_WAF_TRUE;
+        } else {
+            return NGX_HTTP_WAF_FALSE;
+        }
+    }
+
+    return NGX_HTTP_WAF_FALSE;
+}
+
+
+static ngx_int_t _vm_index_add(ngx_pool_t* pool, vm_index_item_t** head, ngx_str_t* key, ngx_uint_t rule_no) {
+    vm_index_item_t* item = NULL;
+    HASH_FIND(hh, *head, key->data, key->len, item);
+
+    if (item == NULL) {
+        item = ngx_pcalloc(pool, sizeof(vm_index_item_t));
+        if (item == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+
+        item->key = *key;
+        item->rules = ngx_array_create(pool, 4, sizeof(ngx_uint_t));
+        if (item->rules == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+
+        HASH_ADD_KEYPTR(hh, *head, item->key.data, item->key.len, item);
+    }
+
+    ngx_uint_t* p = ngx_array_push(item->rules);
+    if (p == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+    *p = rule_no;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+static ngx_uint_t _vm_index_lookup(vm_index_t* index, ngx_str_t* url, vm_index_cursor_t* cursors) {
+    ngx_uint_t count = 0;
+    vm_index_item_t* item = NULL;
+
+    #define ngx_http_waf_vm_add_cursor(array) {     \
+        cursors[count].elts = (array)->elts;        \
+        cursors[count].nelts = (array)->nelts;      \
+        cursors[count].next = 0;                    \
+        ++count;                                    \
+    }
+
+    if (index->unguarded->nelts != 0) {
+        ngx_http_waf_vm_add_cursor(index->unguarded);
+    }
+
+    HASH_FIND(hh, index->exact, url->data, url->len, item);
+    if (item != NULL) {
+        ngx_http_waf_vm_add_cursor(item->rules);
+    }
+
+    size_t* lens = index->prefix_lens->elts;
+    for (ngx_uint_t i = 0; i < index->prefix_lens->nelts && lens[i] <= url->len; i++) {
+        item = NULL;
+        HASH_FIND(hh, index->prefix, url->data, lens[i], item);
+        if (item != NULL) {
+            ngx_http_waf_vm_add_cursor(item->rules);
+        }
+    }
+
+    #undef ngx_http_waf_vm_add_cursor
+
+    return count;
+}
+
+
+static ngx_int_t _vm_index_next(vm_index_cursor_t* cursors, ngx_uint_t count) {
+    vm_index_cursor_t* min = NULL;
+
+    /* 各组内的规则已经有序，每次取出序号最小的一条即可保持规则原本的顺序。 */
+    for (ngx_uint_t i = 0; i < count; i++) {
+        if (cursors[i].next < cursors[i].nelts 
+            && (min == NULL || cursors[i].elts[cursors[i].next] < min->elts[min->next])) {
+            min = &cursors[i];
+        }
+    }
+
+    if (min == NULL) {
+        return NGX_CONF_UNSET;
+    }
+
+    return (ngx_int_t)(min->elts[min->next++]);
+}
+
+
+static ngx_int_t _vm_next_rule(vm_index_t* index, vm_index_cursor_t* cursors, ngx_uint_t count, 
+                               vm_code_t* front, vm_code_t** code, vm_code_t** code_end) {
+    if (index == NULL) {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    ngx_int_t rule_no = _vm_index_next(cursors, count);
+    if (rule_no == NGX_CONF_UNSET) {
+        return NGX_HTTP_WAF_FALSE;
+    }
+
+    vm_rule_t* rule = (vm_rule_t*)(index->rules->elts) + rule_no;
+    *code = front + rule->start;
+    *code_end = front + rule->end;
+
+    return NGX_HTTP_WAF_TRUE;
+}
+
+
+static ngx_int_t _vm_build_set(ngx_pool_t* pool, vm_stack_arg_t* argv, ngx_int_t is_ip, const char* file_name, u_char** invalid) {
+    vm_set_t* set = ngx_pcalloc(pool, sizeof(vm_set_t));
+    if (set == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+
+    if (is_ip == NGX_HTTP_WAF_TRUE) {
+        set->ipv4 = ngx_pcalloc(pool, sizeof(ip_trie_t));
+        if (set->ipv4 == NULL || ip_trie_init(set->ipv4, gernal_pool, pool, AF_INET) != NGX_HTTP_WAF_SUCCESS) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+#if (NGX_HAVE_INET6)
+        set->ipv6 = ngx_pcalloc(pool, sizeof(ip_trie_t));
+        if (set->ipv6 == NULL || ip_trie_init(set->ipv6, gernal_pool, pool, AF_INET6) != NGX_HTTP_WAF_SUCCESS) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+#endif
+    }
+
+    /* 参数中的各项依次以 '\0' 结尾 */
+    u_char* data = argv->value[0].str_val.data;
+    u_char* end = data + argv->value[0].str_val.len;
+
+    if (argv->value[1].int_val == 0) {
+        while (data < end) {
+            size_t len = ngx_strlen(data);
+            ngx_int_t ret = _vm_set_add(pool, set, is_ip, data, len, invalid);
+            if (ret != NGX_HTTP_WAF_SUCCESS) {
+                return ret;
+            }
+            data += len + 1;
+        }
+
+    } else {
+        /* 相对路径相对于高级规则文件所在的目录 */
+        u_char* path = data;
+        u_char* slash = (u_char*)strrchr(file_name, '/');
+        if (data[0] != '/' && slash != NULL) {
+            size_t dir_len = slash - (u_char*)file_name + 1;
+            size_t len = ngx_strlen(data);
+            path = ngx_pnalloc(pool, dir_len + len + 1);
+            if (path == NULL) {
+                return NGX_HTTP_WAF_MALLOC_ERROR;
+            }
+            ngx_memcpy(path, file_name, dir_len);
+            ngx_memcpy(path + dir_len, data, len + 1);
+        }
+
+        char* line = ngx_pnalloc(pool, sizeof(char) * NGX_HTTP_WAF_RULE_MAX_LEN);
+        if (line == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+
+        FILE* fp = fopen((char*)path, "r");
+        if (fp == NULL) {
+            *invalid = path;
+            return NGX_HTTP_WAF_FAIL;
+        }
+
+        /* 每行一项，忽略行尾的换行符和空行。 */
+        while (fgets(line, NGX_HTTP_WAF_RULE_MAX_LEN - 16, fp) != NULL) {
+            size_t len = ngx_strlen(line);
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+                --len;
+            }
+
+            if (len == 0) {
+                continue;
+            }
+
+            line[len] = '\0';
+            ngx_int_t ret = _vm_set_add(pool, set, is_ip, (u_char*)line, len, invalid);
+            if (ret != NGX_HTTP_WAF_SUCCESS) {
+                fclose(fp);
+                return ret;
+            }
+        }
+
+        fclose(fp);
+    }
+
+    argv->argc = 3;
+    argv->type[2] = VM_DATA_SET;
+    argv->value[2].set_val = set;
+
+    return NGX_HTTP_WAF_SUCCESS;
+}
+
+
+static ngx_int_t _vm_set_add(ngx_pool_t* pool, vm_set_t* set, ngx_int_t is_ip, u_char* data, size_t len, u_char** invalid) {
+    /* 集合中的字符串和出错时报告的字符串都需要在加载规则之后继续存在 */
+    u_char* copy = ngx_pnalloc(pool, len + 1);
+    if (copy == NULL) {
+        return NGX_HTTP_WAF_MALLOC_ERROR;
+    }
+    ngx_memcpy(copy, data, len);
+    copy[len] = '\0';
+
+    ngx_str_t str;
+    str.data = copy;
+    str.len = len;
+
+    if (is_ip == NGX_HTTP_WAF_FALSE) {
+        vm_set_item_t* item = NULL;
+        HASH_FIND(hh, set->strings, str.data, str.len, item);
+        if (item != NULL) {
+            return NGX_HTTP_WAF_SUCCESS;
+        }
+
+        item = ngx_pcalloc(pool, sizeof(vm_set_item_t));
+        if (item == NULL) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+
+        item->key = str;
+        HASH_ADD_KEYPTR(hh, set->strings, item->key.data, item->key.len, item);
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+    ipv4_t ipv4;
+    inx_addr_t inx_addr;
+    ngx_memzero(&inx_addr, sizeof(inx_addr_t));
+
+    /* 与已有的地址块重叠的地址块已经被包含在集合中，可以忽略。 */
+    if (ngx_http_waf_parse_ipv4(str, &ipv4) == NGX_HTTP_WAF_SUCCESS) {
+        inx_addr.ipv4.s_addr = ipv4.prefix;
+        if (ip_trie_add(set->ipv4, &inx_addr, ipv4.suffix_num, ipv4.text, 32) == NGX_HTTP_WAF_MALLOC_ERROR) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+
+#if (NGX_HAVE_INET6)
+    ipv6_t ipv6;
+    if (ngx_http_waf_parse_ipv6(str, &ipv6) == NGX_HTTP_WAF_SUCCESS) {
+        ngx_memcpy(inx_addr.ipv6.s6_addr, ipv6.prefix, 16);
+        if (ip_trie_add(set->ipv6, &inx_addr, ipv6.suffix_num, ipv6.text, 64) == NGX_HTTP_WAF_MALLOC_ERROR) {
+            return NGX_HTTP_WAF_MALLOC_ERROR;
+        }
+        return NGX_HTTP_WAF_SUCCESS;
+    }
+#endif
+
+    *invalid = copy;
+    return NGX_HTTP_WAF_FAIL;
+}
@@ -0,0 +1,239 @@
+/**
+ * @file vm.c
+ * @brief 测量高级规则的虚拟机执行一个请求的平均耗时。
+ * @note 规则由 ngx_http_waf_load_all_rule() 加载，与 nginx 读取配置时经过同样的解析和预处理，
+ *       然后对构造好的请求直接调用 ngx_http_waf_vm_exec()，不开启检查缓存。
+ *       用到的函数在虚拟机改写之前的版本中签名相同，所以同一份源码可以分别与改写前后的模块链接，比较两者的开销。
+ *       旧的语法一个文件最多只能包含两条规则，所以生成两条规则，每条规则包含多个谓词。
+ *       规则目录中的 advanced 文件会被覆盖，所以请传入 assets/rules 的一份副本。
+ *       在 nginx 的源码目录中执行 ./configure --add-module=/path/to/ngx_waf && make 之后编译：
+ * @code
+ * objcopy --redefine-sym main=ngx_main objs/src/core/nginx.o objs/nginx-bench.o
+ * cc -O2 -o vm-bench /path/to/ngx_waf/test/benchmark/vm.c objs/ngx_modules.o objs/nginx-bench.o \
+ *    $(find objs/src objs/addon -name '*.o' ! -path objs/src/core/nginx.o) \
+ *    -I src/core -I src/event -I src/event/modules -I src/os/unix -I src/http -I src/http/modules -I objs \
+ *    -I /path/to/ngx_waf/inc -I /path/to/uthash/include \
+ *    <objs/Makefile 中链接 nginx 时使用的库>
+ * cp -r /path/to/ngx_waf/assets/rules /tmp/vm-bench-rules && ./vm-bench /tmp/vm-bench-rules/
+ * @endcode
+ *       改写之前的版本可以用 git worktree add 检出之后，以同样的方式另外编译一份 nginx 和 vm-bench。
+*/
+
+#include <stdio.h>
+#include <time.h>
+#include <ngx_http_waf_module_config.h>
+#include <ngx_http_waf_module_vm.h>
+
+#define BENCHMARK_ROUNDS    (200000)
+#define BENCHMARK_TERMS     (16)
+
+
+extern ngx_module_t ngx_http_waf_module;
+
+
+typedef struct {
+    const char* uri;
+    const char* args;
+    const char* user_agent;
+} bench_request_t;
+
+
+static ngx_open_file_t s_log_file;
+static ngx_log_t s_log;
+static ngx_cycle_t s_cycle;
+
+
+static double _now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/**
+ * @brief 生成两条规则，每条规则先用 or 连接 BENCHMARK_TERMS 个针对 URL 的谓词和一个针对 User-Agent 的谓词，再用 and 连接一个针对参数的谓词。
+ * @note 最后一条规则之后没有换行，旧的语法不接受多余的换行。
+*/
+static ngx_int_t _write_rules(const char* rule_path) {
+    char file_name[NGX_HTTP_WAF_RULE_MAX_LEN];
+    if (snprintf(file_name, sizeof(file_name), "%s%s", rule_path, NGX_HTTP_WAF_ADVANCED_FILE) >= (int)sizeof(file_name)) {
+        return NGX_ERROR;
+    }
+
+    FILE* fp = fopen(file_name, "w");
+    if (fp == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        fprintf(fp, "%sid: bench_%d\nif: ", i == 0 ? "" : "\n\n", i);
+        for (int j = 0; j < BENCHMARK_TERMS; j++) {
+            fprintf(fp, "url equals \"/admin/%d/%d\" or ", i, j);
+        }
+        fprintf(fp, "user_agent contains \"sqlmap-%d\" and query_string[page] equals \"%d\"\ndo: return(403)", i, i);
+    }
+
+    fclose(fp);
+    return NGX_OK;
+}
+
+
+static ngx_http_request_t* _make_request(ngx_pool_t* pool, ngx_connection_t* c, void** loc_conf, const bench_request_t* sample) {
+    ngx_http_request_t* r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
+    void** ctx = ngx_pcalloc(pool, sizeof(void*));
+    if (r == NULL || ctx == NULL) {
+        return NULL;
+    }
+
+    ctx[0] = ngx_pcalloc(pool, sizeof(ngx_http_waf_ctx_t));
+    if (ctx[0] == NULL) {
+        return NULL;
+    }
+
+    r->pool = pool;
+    r->connection = c;
+    r->loc_conf = loc_conf;
+    r->ctx = ctx;
+    r->method = NGX_HTTP_GET;
+    r->uri.data = (u_char*)sample->uri;
+    r->uri.len = strlen(sample->uri);
+    r->args.data = (u_char*)sample->args;
+    r->args.len = strlen(sample->args);
+
+    if (ngx_list_init(&(r->headers_in.headers), pool, 4, sizeof(ngx_table_elt_t)) != NGX_OK) {
+        return NULL;
+    }
+
+    ngx_table_elt_t* h = ngx_list_push(&(r->headers_in.headers));
+    if (h == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(h, sizeof(ngx_table_elt_t));
+    h->hash = 1;
+    ngx_str_set(&(h->key), "User-Agent");
+    h->lowcase_key = (u_char*)"user-agent";
+    h->value.data = (u_char*)sample->user_agent;
+    h->value.len = strlen(sample->user_agent);
+    r->headers_in.user_agent = h;
+
+    return r;
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s /path/to/rules/\n", argv[0]);
+        return 1;
+    }
+
+    static const bench_request_t samples[] = {
+        { "/api/v1/accounts/12345/orders/67890/items", "page=2&per_page=50&sort=created_at&order=desc",
+          "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36" },
+        { "/static/js/app.4f9c2b.js", "v=3",
+          "Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Mobile/15E148" },
+        { "/admin/0/15", "page=1", "curl/8.4.0" },
+        { "/admin/1/15", "page=1", "sqlmap-1/1.7.10#stable (https://sqlmap.org)" }
+    };
+
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+    ngx_time_init();
+    ngx_regex_init();
+
+    s_log_file.fd = ngx_stderr;
+    s_log.file = &s_log_file;
+    s_log.log_level = NGX_LOG_WARN;
+    s_cycle.log = &s_log;
+    ngx_cycle = &s_cycle;
+
+    if (_write_rules(argv[1]) != NGX_OK) {
+        fprintf(stderr, "failed to write %s%s\n", argv[1], NGX_HTTP_WAF_ADVANCED_FILE);
+        return 1;
+    }
+
+    /* 独立运行时没有经过 ngx_count_modules()，模块只有这一份配置。 */
+    ngx_http_waf_module.ctx_index = 0;
+
+    ngx_conf_file_t conf_file;
+    ngx_memzero(&conf_file, sizeof(ngx_conf_file_t));
+    ngx_str_set(&(conf_file.file.name), "vm-bench");
+
+    void* main_confs[1];
+    ngx_http_conf_ctx_t http_ctx;
+    ngx_memzero(&http_ctx, sizeof(ngx_http_conf_ctx_t));
+    http_ctx.main_conf = main_confs;
+
+    ngx_conf_t cf;
+    ngx_memzero(&cf, sizeof(ngx_conf_t));
+    cf.pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &s_log);
+    cf.temp_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &s_log);
+    cf.log = &s_log;
+    cf.cycle = &s_cycle;
+    cf.conf_file = &conf_file;
+    cf.ctx = &http_ctx;
+    if (cf.pool == NULL || cf.temp_pool == NULL) {
+        return 1;
+    }
+
+    main_confs[0] = ngx_http_waf_create_main_conf(&cf);
+    ngx_http_waf_loc_conf_t* conf = ngx_http_waf_create_loc_conf(&cf);
+    if (main_confs[0] == NULL || conf == NULL) {
+        return 1;
+    }
+
+    conf->waf = 1;
+    conf->waf_mode = NGX_HTTP_WAF_MODE_INSPECT_GET | NGX_HTTP_WAF_MODE_INSPECT_ADV;
+    conf->waf_rule_path.data = (u_char*)argv[1];
+    conf->waf_rule_path.len = strlen(argv[1]);
+
+    if (ngx_http_waf_alloc_memory(&cf, conf) != NGX_HTTP_WAF_SUCCESS
+        || ngx_http_waf_load_all_rule(&cf, conf) != NGX_HTTP_WAF_SUCCESS) {
+        fprintf(stderr, "failed to load the rules in %s\n", argv[1]);
+        return 1;
+    }
+
+    void* loc_confs[1] = { conf };
+
+    struct sockaddr_in sin;
+    ngx_memzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    ngx_connection_t connection;
+    ngx_memzero(&connection, sizeof(ngx_connection_t));
+    connection.log = &s_log;
+    connection.sockaddr = (struct sockaddr*)&sin;
+    connection.socklen = sizeof(struct sockaddr_in);
+
+    size_t sample_count = sizeof(samples) / sizeof(samples[0]);
+    size_t matched = 0;
+    double elapsed = 0;
+
+    for (size_t i = 0; i < BENCHMARK_ROUNDS; i++) {
+        ngx_pool_t* pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, &s_log);
+        if (pool == NULL) {
+            return 1;
+        }
+
+        /* 每个请求使用自己的内存池，计时包括虚拟机执行期间的分配，但不包括构造请求和释放内存池。 */
+        ngx_http_request_t* r = _make_request(pool, &connection, loc_confs, &samples[i % sample_count]);
+        if (r == NULL) {
+            return 1;
+        }
+
+        ngx_int_t http_status = NGX_DECLINED;
+        double start = _now();
+        if (ngx_http_waf_vm_exec(r, &http_status) == NGX_HTTP_WAF_MATCHED) {
+            ++matched;
+        }
+        elapsed += _now() - start;
+
+        ngx_destroy_pool(pool);
+    }
+
+    printf("rules: 2 x %d terms, requests: %d, matched: %zu\n", BENCHMARK_TERMS + 2, BENCHMARK_ROUNDS, matched);
+    printf("ngx_http_waf_vm_exec: %.1f ns/request\n", elapsed / BENCHMARK_ROUNDS * 1e9);
+
+    return 0;
+}
@@ -55,4 +55,70 @@ echo "DDDD::/16" >> ./rules/white-ipv6
 echo "/white/" >> ./rules/white-url
 echo "/white/" >> ./rules/white-referer
 
+mkdir -p ./advanced-rules
+cp ./rules/* ./advanced-rules/
+
+cat > ./advanced-rules/advanced <<'EOF'
+id: adv_matches
+if: url matches "^/adv/matches/[0-9]+$"
+do: return(403)
+
+id: adv_equals
+if: url equals "/adv/equals"
+do: return(403)
+
+id: adv_contains
+if: user_agent contains "adv-scanner"
+do: return(403)
+
+id: adv_belong_to
+if: url equals "/adv/belong_to" and client_ip belong_to "127.0.0.0/8"
+do: return(403)
+
+id: adv_not_belong_to
+if: url equals "/adv/not_belong_to" and client_ip belong_to "10.0.0.0/8"
+do: return(403)
+
+id: adv_sqli_detn
+if: url equals "/adv/sqli_detn" and sqli_detn query_string[adv]
+do: return(403)
+
+id: adv_and
+if: url equals "/adv/and" and query_string[adv] equals "1"
+do: return(403)
+
+id: adv_or
+if: url equals "/adv/or" or query_string[adv_or] equals "1"
+do: return(403)
+
+id: adv_shared_ua
+if: query_string[shared] equals "1" and user_agent contains "adv-shared"
+do: return(403)
+
+id: adv_shared_args
+if: query_string[shared] equals "1" and query_string[t] equals "b"
+do: return(403)
+
+id: adv_in_list
+if: url in ["/adv/in/a", "/adv/in/b"]
+do: return(403)
+
+id: adv_in_file
+if: url in @"advanced-urls"
+do: return(403)
+
+id: adv_header_in
+if: header_in[X-Adv] equals "block"
+do: return(403)
+EOF
+
+echo "/adv/file/a" >> ./advanced-rules/advanced-urls
+
+cat > ./cache-snippet.conf <<EOF
+waf on;
+waf_mode FULL !CC;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cache capacity=1 shared=1m;
+EOF
+
 cd "$origin_dir"
\ No newline at end of file
@@ -0,0 +1,258 @@
+use Test::Nginx::Socket 'no_plan';
+
+run_tests();
+
+
+__DATA__
+
+=== TEST: General
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- request
+GET /
+
+--- error_code chomp
+200
+
+
+=== TEST: Operators
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- pipelined_requests eval
+[
+    "GET /adv/matches/123",
+    "GET /adv/matches/test0",
+    "GET /adv/equals",
+    "GET /adv/equals/test0",
+    "GET /adv/belong_to",
+    "GET /adv/not_belong_to",
+    "GET /adv/sqli_detn?adv=1'or'1'='1",
+    "GET /adv/sqli_detn?adv=test0"
+]
+
+--- error_code eval
+[
+    403,
+    404,
+    403,
+    404,
+    403,
+    404,
+    403,
+    404
+]
+
+
+=== TEST: Contains
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- request
+GET /adv/test0
+
+--- more_headers
+User-Agent: adv-scanner/1.0
+
+--- error_code chomp
+403
+
+
+=== TEST: Short-circuit
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- pipelined_requests eval
+[
+    "GET /adv/and?adv=1",
+    "GET /adv/and?adv=0",
+    "GET /adv/test0?adv=1",
+    "GET /adv/or?adv_or=0",
+    "GET /adv/test0?adv_or=1",
+    "GET /adv/test0?adv_or=0"
+]
+
+--- error_code eval
+[
+    403,
+    404,
+    404,
+    403,
+    403,
+    404
+]
+
+
+=== TEST: Shared predicate
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- pipelined_requests eval
+[
+    "GET /adv/test0?shared=1&t=b",
+    "GET /adv/test0?shared=1&t=c",
+    "GET /adv/test0?shared=0&t=b"
+]
+
+--- error_code eval
+[
+    403,
+    404,
+    404
+]
+
+
+=== TEST: Shared predicate and user-agent
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- request
+GET /adv/test0?shared=1&t=c
+
+--- more_headers
+User-Agent: adv-shared/1.0
+
+--- error_code chomp
+403
+
+
+=== TEST: URL prefix index
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- pipelined_requests eval
+[
+    "GET /adv/matches/123",
+    "GET /adv/matches/test0",
+    "GET /adv/matches",
+    "GET /adv/test0"
+]
+
+--- error_code eval
+[
+    403,
+    404,
+    404,
+    404
+]
+
+
+=== TEST: Sets
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- pipelined_requests eval
+[
+    "GET /adv/in/a",
+    "GET /adv/in/b",
+    "GET /adv/in/c",
+    "GET /adv/file/a",
+    "GET /adv/file/b"
+]
+
+--- error_code eval
+[
+    403,
+    403,
+    404,
+    403,
+    404
+]
+
+
+=== TEST: Verdict cache
+
+--- config
+waf on;
+waf_mode GET ADV CACHE;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+waf_cache capacity=50;
+
+--- pipelined_requests eval
+[
+    "GET /adv/equals",
+    "GET /adv/equals",
+    "GET /adv/test0?shared=1&t=b",
+    "GET /adv/test0?shared=1&t=b",
+    "GET /adv/test0?shared=1&t=c",
+    "GET /adv/test0?shared=1&t=c",
+    "GET /adv/test0",
+    "GET /adv/test0"
+]
+
+--- error_code eval
+[
+    403,
+    403,
+    403,
+    403,
+    404,
+    404,
+    404,
+    404
+]
+
+
+=== TEST: Duplicated query string
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- pipelined_requests eval
+[
+    "GET /adv/sqli_detn?adv=test0&adv=1'or'1'='1",
+    "GET /adv/sqli_detn?adv=1'or'1'='1&adv=test0",
+    "GET /adv/and?adv=0&adv=1"
+]
+
+--- error_code eval
+[
+    403,
+    404,
+    403
+]
+
+
+=== TEST: Duplicated header
+
+--- config
+waf on;
+waf_mode GET ADV;
+waf_rule_path ${base_dir}/waf/advanced-rules/;
+
+--- request
+GET /adv/test0
+
+--- more_headers
+X-Adv: test0
+X-Adv: block
+
+--- error_code chomp
+403
@@ -108,6 +108,38 @@ waf_cc_deny rate=100r/m duration=1h bad=bad;
 --- must_die
 
 
+=== TEST: Bad directive waf_cc_deny (11)
+
+--- config
+waf_cc_deny rate=100r/s duration=1h;
+
+--- must_die
+
+
+=== TEST: Bad directive waf_cc_deny (12)
+
+--- config
+waf_cc_deny rate=100r/s mode=gcra duration=1h;
+
+--- must_die
+
+
+=== TEST: Bad directive waf_cc_deny (13)
+
+--- config
+waf_cc_deny rate=100r/s mode=token_bucket burst=0;
+
+--- must_die
+
+
+=== TEST: Bad directive waf_cc_deny (14)
+
+--- config
+waf_cc_deny rate=100r/m ipv6_prefix=129;
+
+--- must_die
+
+
 === TEST: Bad directive waf_cache (1)
 
 --- config
@@ -124,6 +156,22 @@ waf_cache bad=bad;
 --- must_die
 
 
+=== TEST: Bad directive waf_cache (3)
+
+--- config
+waf_cache capacity=50 shared=bad;
+
+--- must_die
+
+
+=== TEST: Bad directive waf_cache (4)
+
+--- config
+waf_cache capacity=50 size=1m;
+
+--- must_die
+
+
 === TEST: Bad directive waf_under_attack (1)
 
 --- config
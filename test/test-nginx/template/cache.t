@@ -39,4 +39,209 @@ waf_cache capacity=1;
     404,
     404,
     404
-]
\ No newline at end of file
+]
+
+
+=== TEST: Shared cache
+
+--- config
+waf on;
+waf_mode FULL !CC;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cache capacity=1 shared=1m;
+
+location /occupancy {
+    return 200 \$waf_cache_occupancy;
+}
+
+--- pipelined_requests eval
+[
+    "GET /test0",
+    "GET /test0",
+    "GET /test1",
+    "GET /test1",
+    "GET /test2",
+    "GET /test2",
+    "GET /test3",
+    "GET /test3",
+    "GET /test4",
+    "GET /test4",
+    "GET /occupancy"
+]
+
+--- error_code eval
+[
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    200
+]
+
+--- response_body_like eval
+[
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ",SHARED-HITS=[1-9]\\d*\$"
+]
+
+
+=== TEST: Shared cache in an included file
+
+--- config
+location /a {
+    include ${base_dir}/waf/cache-snippet.conf;
+
+    location /a/occupancy {
+        return 200 \$waf_cache_occupancy;
+    }
+}
+
+location /b {
+    include ${base_dir}/waf/cache-snippet.conf;
+}
+
+--- pipelined_requests eval
+[
+    "GET /a/test0",
+    "GET /a/test0",
+    "GET /a/test1",
+    "GET /a/test1",
+    "GET /a/test2",
+    "GET /a/test2",
+    "GET /a/test3",
+    "GET /a/test3",
+    "GET /a/test4",
+    "GET /a/test4",
+    "GET /a/occupancy"
+]
+
+--- error_code eval
+[
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    404,
+    200
+]
+
+--- response_body_like eval
+[
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    ",SHARED-HITS=[1-9]\\d*\$"
+]
+
+
+=== TEST: Unified cache
+
+--- config
+waf on;
+waf_mode FULL !CC;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cache size=1m;
+
+location /occupancy {
+    return 200 \$waf_cache_occupancy;
+}
+
+--- pipelined_requests eval
+[
+    "GET /test0",
+    "GET /test0",
+    "GET /test1",
+    "GET /test1",
+    "GET /occupancy",
+]
+
+--- error_code eval
+[
+    404,
+    404,
+    404,
+    404,
+    200
+]
+
+--- response_body_like eval
+[
+    ".*",
+    ".*",
+    ".*",
+    ".*",
+    "^WHITE-URL=\\d+,BLACK-URL=\\d+,BLACK-ARGS=\\d+,BLACK-UA=\\d+,WHITE-REFERER=\\d+,BLACK-REFERER=\\d+,BLACK-COOKIE=\\d+,BLACK-POST=0\$"
+]
+
+
+=== TEST: Verdict cache
+
+--- config
+waf on;
+waf_mode FULL !CC;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cache capacity=50 verdict=on;
+
+--- pipelined_requests eval
+[
+    "GET /www.bak",
+    "GET /www.bak",
+    "GET /test0",
+    "GET /test0"
+]
+
+--- error_code eval
+[
+    403,
+    403,
+    404,
+    404
+]
+
+
+=== TEST: Cache with XSS detection
+
+--- config
+waf on;
+waf_mode GET ARGS LIB-INJECTION-XSS CACHE;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cache capacity=50;
+
+--- pipelined_requests eval
+[
+    "GET /?<svg>",
+    "GET /?s=<svg>"
+]
+
+--- error_code eval
+[
+    200,
+    403
+]
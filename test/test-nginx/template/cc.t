@@ -43,4 +43,77 @@ location /t {
     404,
     404,
     404
-]
\ No newline at end of file
+]
+
+
+=== TEST: CC with GCRA
+
+--- config
+waf on;
+waf_mode FULL;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cc_deny rate=1r/s mode=gcra burst=1;
+
+--- pipelined_requests eval
+[
+    "GET /",
+    "GET /",
+    "GET /"
+]
+
+--- error_code eval
+[
+    200,
+    200,
+    503
+]
+
+
+=== TEST: CC with token bucket
+
+--- config
+waf on;
+waf_mode FULL;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cc_deny rate=1r/m mode=token_bucket burst=2 duration=1m;
+
+--- pipelined_requests eval
+[
+    "GET /",
+    "GET /",
+    "GET /",
+    "GET /"
+]
+
+--- error_code eval
+[
+    200,
+    200,
+    503,
+    503
+]
+
+
+=== TEST: CC with custom key
+
+--- config
+waf on;
+waf_mode FULL;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cc_deny rate=1r/m ipv4_prefix=24 key=\$uri;
+
+--- pipelined_requests eval
+[
+    "GET /",
+    "GET /",
+    "GET /t",
+    "GET /t"
+]
+
+--- error_code eval
+[
+    200,
+    503,
+    404,
+    503
+]
@@ -39,3 +39,30 @@ onload=
 --- error_code chomp
 403
 
+
+=== TEST: Cached POST
+
+--- config
+waf on;
+waf_mode GET POST RBODY CACHE;
+waf_rule_path ${base_dir}/waf/rules/;
+waf_cache capacity=50 max_body=64k;
+
+location /t {
+}
+
+--- pipelined_requests eval
+[
+    "POST /t\nonload=",
+    "POST /t\nonload=",
+    "POST /t\ns=test",
+    "POST /t\ns=test"
+]
+
+--- error_code eval
+[
+    403,
+    403,
+    404,
+    404
+]
@@ -61,4 +61,50 @@ waf_rule_path ${base_dir}/waf/rules/;
 [
     404,
     404
-]
\ No newline at end of file
+]
+
+=== TEST: Black URI with combined regexes
+
+--- config
+waf on;
+waf_mode GET URL MULTI-REGEX !CC;
+waf_rule_path ${base_dir}/waf/rules/;
+
+
+--- pipelined_requests eval
+[
+    "GET /",
+    "GET /www.bak",
+    "GET /static/index.php"
+]
+
+--- error_code eval
+[
+    200,
+    403,
+    403
+]
+
+=== TEST: Black URI with JIT-compiled regexes
+
+--- http_config
+waf_regex_jit on;
+
+--- config
+waf on;
+waf_mode GET URL !CC;
+waf_rule_path ${base_dir}/waf/rules/;
+
+--- pipelined_requests eval
+[
+    "GET /",
+    "GET /www.bak",
+    "GET /static/index.php"
+]
+
+--- error_code eval
+[
+    200,
+    403,
+    403
+]